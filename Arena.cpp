@@ -0,0 +1,121 @@
+#include <hexrays.hpp>
+#include "Arena.hpp"
+
+// The first chunk is big enough for the analysis of a modest function
+#define ARENA_FIRST_CHUNK 0x10000
+
+Arena::~Arena()
+{
+	// Don't run the finalizers here. This object may be destroyed after the
+	// decompiler has gone away, and the objects would call into it. Owners 
+	// must Reset() their arenas while the decompiler is still around.
+	FreeChunks();
+}
+
+void Arena::FreeChunks()
+{
+	while (m_Chunks != NULL)
+	{
+		Chunk *next = m_Chunks->next;
+		qfree(m_Chunks);
+		m_Chunks = next;
+	}
+	m_nReserved = 0;
+}
+
+// Get a new chunk with room for at least minSize bytes, twice as large as the
+// current one, and make it the current one.
+Arena::Chunk *Arena::NewChunk(size_t minSize)
+{
+	size_t size = m_Chunks == NULL ? ARENA_FIRST_CHUNK : m_Chunks->size * 2;
+	while (size < minSize + sizeof(Chunk))
+		size *= 2;
+	Chunk *c = static_cast<Chunk *>(qalloc(size));
+	if (c == NULL)
+		throw std::bad_alloc();
+	c->next = m_Chunks;
+	c->size = size;
+	c->used = sizeof(Chunk);
+	m_Chunks = c;
+	m_nReserved += size;
+	return c;
+}
+
+void *Arena::Allocate(size_t size, size_t align)
+{
+	Chunk *c = m_Chunks;
+	size_t offset = 0;
+	if (c != NULL)
+		offset = (c->used + align - 1) & ~(align - 1);
+	if (c == NULL || offset + size > c->size)
+	{
+		c = NewChunk(size + align);
+		offset = (c->used + align - 1) & ~(align - 1);
+	}
+	c->used = offset + size;
+	m_nAllocated += size;
+	if (m_nAllocated > m_nPeak)
+		m_nPeak = m_nAllocated;
+	return reinterpret_cast<char *>(c) + offset;
+}
+
+void Arena::AddFinalizer(void (*fn)(void *), void *obj)
+{
+	Finalizer *f = static_cast<Finalizer *>(Allocate(sizeof(Finalizer), alignof(Finalizer)));
+	f->fn = fn;
+	f->obj = obj;
+	f->next = m_Finalizers;
+	m_Finalizers = f;
+}
+
+// Destroy the objects created by New(), in the reverse order of their 
+// creation, and make all of the memory available again. If the arena had to
+// grow, only keep one chunk, big enough for everything that was allocated 
+// from all of them, so that the next function of the same size fits without
+// growing again. The largest chunk on its own is only about as big as all of 
+// the smaller ones put together, so it usually has to be replaced with a 
+// bigger one; if that fails, just keep the largest chunk. This runs from 
+// destructors, so it mustn't throw.
+void Arena::Reset()
+{
+	for (Finalizer *f = m_Finalizers; f != NULL; f = f->next)
+		f->fn(f->obj);
+	m_Finalizers = NULL;
+
+	if (m_Chunks != NULL)
+	{
+		size_t nUsed = m_Chunks->used;
+		while (m_Chunks->next != NULL)
+		{
+			Chunk *next = m_Chunks->next->next;
+			nUsed += m_Chunks->next->used - sizeof(Chunk);
+			m_nReserved -= m_Chunks->next->size;
+			qfree(m_Chunks->next);
+			m_Chunks->next = next;
+		}
+
+		size_t size = m_Chunks->size;
+		while (size < nUsed)
+			size *= 2;
+		Chunk *c = size == m_Chunks->size ? NULL : static_cast<Chunk *>(qalloc(size));
+		if (c != NULL)
+		{
+			m_nReserved += size - m_Chunks->size;
+			qfree(m_Chunks);
+			c->next = NULL;
+			c->size = size;
+			m_Chunks = c;
+		}
+		m_Chunks->used = sizeof(Chunk);
+	}
+	m_nAllocated = 0;
+	++m_nResets;
+}
+
+// Like Reset, but give the largest chunk back too, for an arena that won't be
+// used again for a while
+void Arena::Release()
+{
+	Reset();
+	FreeChunks();
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <new>
+#include <vector>
+#include <type_traits>
+#include <hexrays.hpp>
+
+// A bump-pointer allocator for analysis data whose lifetime is a single 
+// function. Allocations are never freed individually; instead, Reset() makes
+// all of the memory available again at once. Memory is obtained in chunks 
+// that double in size, and when the arena is reset, they're replaced by a 
+// single chunk that holds everything allocated since the last reset. So once
+// the arena has grown large enough to hold a function's worth of data, 
+// resetting it is O(1) and allocating never touches the heap.
+//
+// Objects with non-trivial destructors can be created with New(), which 
+// arranges for their destructors to run when the arena is reset.
+struct Arena
+{
+	Arena() : m_nAllocated(0), m_nPeak(0), m_nReserved(0), m_nResets(0), m_Chunks(NULL), m_Finalizers(NULL) {}
+	~Arena();
+
+	void *Allocate(size_t size, size_t align);
+	void Reset();
+	void Release();
+
+	template <class T, class... Args>
+	T *New(Args&&... args)
+	{
+		void *mem = Allocate(sizeof(T), alignof(T));
+		T *obj = new (mem) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value)
+			AddFinalizer(&Destroy<T>, obj);
+		return obj;
+	}
+
+	// Bytes handed out since the last reset, the most ever handed out between
+	// two resets, and the size of the chunks currently held
+	size_t m_nAllocated;
+	size_t m_nPeak;
+	size_t m_nReserved;
+	int m_nResets;
+
+private:
+	struct Chunk
+	{
+		Chunk *next;
+		size_t size;
+		size_t used;
+	};
+	struct Finalizer
+	{
+		void (*fn)(void *);
+		void *obj;
+		Finalizer *next;
+	};
+
+	template <class T>
+	static void Destroy(void *obj) { static_cast<T *>(obj)->~T(); }
+	void AddFinalizer(void (*fn)(void *), void *obj);
+	Chunk *NewChunk(size_t minSize);
+	void FreeChunks();
+
+	// The current chunk is at the head of the list
+	Chunk *m_Chunks;
+	Finalizer *m_Finalizers;
+
+	Arena(const Arena &);
+	Arena &operator=(const Arena &);
+};
+
+// Standard library allocator that draws from an Arena. An allocator without 
+// an arena uses the heap, so containers that use this allocator still work 
+// when they're not part of a function's analysis (e.g., for verification).
+template <class T>
+struct ArenaAllocator
+{
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	Arena *m_Arena;
+
+	ArenaAllocator(Arena *arena = NULL) : m_Arena(arena) {}
+	template <class U>
+	ArenaAllocator(const ArenaAllocator<U> &other) : m_Arena(other.m_Arena) {}
+
+	T *allocate(size_t n)
+	{
+		if (m_Arena != NULL)
+			return static_cast<T *>(m_Arena->Allocate(n * sizeof(T), alignof(T)));
+		return static_cast<T *>(::operator new(n * sizeof(T)));
+	}
+	void deallocate(T *p, size_t)
+	{
+		if (m_Arena == NULL)
+			::operator delete(p);
+	}
+	template <class U>
+	bool operator==(const ArenaAllocator<U> &other) const { return m_Arena == other.m_Arena; }
+	template <class U>
+	bool operator!=(const ArenaAllocator<U> &other) const { return m_Arena != other.m_Arena; }
+};
+
+template <class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+// Containers must give up their arena memory before the arena is reset; 
+// clear() alone would keep the (soon-to-be-reused) storage around.
+template <class V>
+void ArenaRelease(V &v)
+{
+	V(v.get_allocator()).swap(v);
+}
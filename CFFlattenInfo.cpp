@@ -1,12 +1,13 @@
+#include <algorithm>
 #include <hexrays.hpp>
 #include "HexRaysUtil.hpp"
 #include "CFFlattenInfo.hpp"
+#include "VerdictStore.hpp"
+#include "PhaseTimer.hpp"
 #include "Config.hpp"
 
-#define MIN_NUM_COMPARISONS 2
-
-extern std::set<ea_t> g_BlackList;
-extern std::set<ea_t> g_WhiteList;
+// Jump tables spanning more keys than this aren't indexed directly
+#define MAX_DENSE_KEYS 0x10000
 
 
 static int debugmsg(const char *fmt, ...)
@@ -19,6 +20,37 @@ static int debugmsg(const char *fmt, ...)
 	return 0;
 }
 
+// Count the number of 1-bits in the constant values used for comparison, and
+// compute the percentage of 1-bits. Given that these constants seem to be 
+// created pseudorandomly, the percentage should be roughly 1/2.
+float JZInfo::ComputeEntropy(int &iNumBits, int &iNumOnes) const
+{
+	iNumBits = 0;
+	iNumOnes = 0;
+	for (auto num : nums)
+	{
+		int nBits = num->size * 8;
+		uint64 v = num->nnn->value;
+		if (nBits < 64)
+			v &= (1ULL << nBits) - 1;
+		iNumBits += nBits;
+		iNumOnes += popcount64(v);
+	}
+	return iNumBits == 0 ? 0.0 : (float)iNumOnes / (float(iNumBits));
+}
+
+// The same tests as below, but without any output, for deciding whether a
+// variable other than the most-compared one might also be a dispatch 
+// variable.
+bool JZInfo::LooksLikeDispatchVar() const
+{
+	if (nSeen < MIN_NUM_COMPARISONS)
+		return false;
+	int iNumBits, iNumOnes;
+	float fEntropy = ComputeEntropy(iNumBits, iNumOnes);
+	return fEntropy >= MIN_KEY_ENTROPY && fEntropy <= MAX_KEY_ENTROPY;
+}
+
 // This method determines whether a given function is likely obfuscated. It 
 // does this by ensuring that:
 // 1) Some minimum number of comparisons are made against the "comparison 
@@ -37,23 +69,8 @@ bool JZInfo::ShouldBlacklist()
 		return true;
 	};
 
-	// Count the number of 1-bits in the constant values used for comparison
-	int iNumBits = 0;
-	int iNumOnes = 0;
-	for (auto num : nums)
-	{
-		iNumBits += num->size * 8;
-		uint64 v = num->nnn->value;
-		for (int i = 0; i < num->size * 8; ++i)
-		{
-			if (v & (1 << i))
-				++iNumOnes;
-		}
-	}
-	
-	// Compute the percentage of 1-bits. Given that these constants seem to be
-	// created pseudorandomly, the percentage should be roughly 1/2.
-	float fEntropy = iNumBits == 0 ? 0.0 : (float)iNumOnes / (float(iNumBits));
+	int iNumBits, iNumOnes;
+	float fEntropy = ComputeEntropy(iNumBits, iNumOnes);
 #if UNFLATTENVERBOSE
 	debugmsg("[I] %d comparisons, %d numbers, %d bits, %d ones, %f entropy\n",
 		nSeen,
@@ -64,7 +81,7 @@ bool JZInfo::ShouldBlacklist()
 #endif
 
 	// We'll give 10% leeway on the 50% expectation.
-	if (fEntropy < 0.4 || fEntropy > 0.6)
+	if (fEntropy < MIN_KEY_ENTROPY || fEntropy > MAX_KEY_ENTROPY)
 	{
 		warning("[I] Entropy %f indicates this function is not obfuscated\n", fEntropy);
 		return true;
@@ -73,341 +90,727 @@ bool JZInfo::ShouldBlacklist()
 }
 
 
-// This class looks for jz/jg comparisons against constant values. For each
-// thing being compared, we use a JZInfo structure to collect the number of 
-// times it's been used in a comparison, and a list of the values it was
-// compared against.
-struct JZCollector : public minsn_visitor_t
+// Record the instructions of interest in a single block. The conditional
+// jumps, jtbl and mov instructions that we're interested in are always 
+// top-level instructions, so we don't need to descend into sub-instructions.
+void FlattenInsnIndex::ScanBlock(mblock_t *mb)
 {
-	std::vector<JZInfo> m_SeenComparisons;
-	int m_nMaxJz;
+	int i = mb->serial;
+	for (minsn_t *ins = mb->head; ins != NULL; ins = ins->next)
+	{
+		// Conditional jumps comparing something against a number. Besides the
+		// jz chains, comparison trees use any of jnz/jg/jge/jl/jle/ja/jae/
+		// jb/jbe.
+		if (is_mcode_jcond(ins->opcode))
+		{
+			if (ins->r.t == mop_n)
+				m_Comparisons.push_back(Entry(ins, i));
+			continue;
+		}
 
-	JZCollector() : m_nMaxJz(-1) {};
+		switch (ins->opcode)
+		{
+			// Jump tables, in case the dispatcher is one
+			case m_jtbl:
+				if (ins->r.t == mop_c)
+					m_Tables.push_back(Entry(ins, i));
+				break;
 
-	int visit_minsn(void)
+			// Numeric assignments, and copies of one thing into another
+			case m_mov:
+				if (ins->l.t == mop_n)
+					m_NumAssigns.push_back(Entry(ins, i));
+				else
+					m_Copies.push_back(Entry(ins, i));
+				break;
+		}
+	}
+}
+
+// Build the instruction index for a function. This is the only place where
+// the flattening detection walks all of the function's instructions; 
+// everything after this point is answered from the vectors that we fill in 
+// here. 
+void FlattenInsnIndex::Build(mbl_array_t *mba)
+{
+	Clear();
+	for (int i = 0; i < mba->qty; ++i)
+		ScanBlock(mba->get_mblock(i));
+#if UNFLATTENVERBOSE
+	debugmsg("[I] Indexed %d comparisons, %d numeric assignments, %d copies, %d jump tables in %d blocks\n",
+		m_Comparisons.size(),
+		m_NumAssigns.size(),
+		m_Copies.size(),
+		m_Tables.size(),
+		mba->qty);
+#endif
+}
+
+// Replace the entries for the blocks in "dirty" with their current contents,
+// keeping the entries in block order.
+static void RefreshEntries(ArenaVector<FlattenInsnIndex::Entry> &entries, const ArenaVector<FlattenInsnIndex::Entry> &fresh, const std::vector<bool> &dirty)
+{
+	entries.erase(std::remove_if(entries.begin(), entries.end(), 
+		[&dirty](const FlattenInsnIndex::Entry &e) { return e.iBlock < dirty.size() && dirty[e.iBlock]; }),
+		entries.end());
+	size_t nKept = entries.size();
+	entries.insert(entries.end(), fresh.begin(), fresh.end());
+	std::inplace_merge(entries.begin(), entries.begin() + nKept, entries.end(),
+		[](const FlattenInsnIndex::Entry &a, const FlattenInsnIndex::Entry &b) { return a.iBlock < b.iBlock; });
+}
+
+// After some blocks' instructions have been modified, rescan just those 
+// blocks, rather than the whole function. The block numbers must not have 
+// changed since the index was built.
+void FlattenInsnIndex::Refresh(mbl_array_t *mba, const std::vector<bool> &dirty)
+{
+	FlattenInsnIndex fresh(m_Comparisons.get_allocator().m_Arena);
+	int nDirty = 0;
+	for (int i = 0; i < dirty.size() && i < mba->qty; ++i)
 	{
-		// We're looking for jz/jg instructions...
-		if (curins->opcode != m_jz && curins->opcode != m_jg)
-			return 0;
+		if (dirty[i])
+		{
+			fresh.ScanBlock(mba->get_mblock(i));
+			++nDirty;
+		}
+	}
+	if (nDirty == 0)
+		return;
+	RefreshEntries(m_Comparisons, fresh.m_Comparisons, dirty);
+	RefreshEntries(m_NumAssigns, fresh.m_NumAssigns, dirty);
+	RefreshEntries(m_Copies, fresh.m_Copies, dirty);
+	RefreshEntries(m_Tables, fresh.m_Tables, dirty);
+#if UNFLATTENVERBOSE
+	debugmsg("[I] Rescanned %d modified blocks out of %d\n", nDirty, mba->qty);
+#endif
+}
+
+// This class looks for conditional comparisons against constant values. For
+// each thing being compared, we use a JZInfo structure to collect the number
+// of times it's been used in a comparison, and a list of the values it was
+// compared against. The compared operands are interned, so the index of an
+// operand in the intern table is also the index of its JZInfo.
+struct JZCollector
+{
+	ArenaVector<JZInfo> m_SeenComparisons;
+	MopInternTable m_Operands;
+	int m_nMaxJz;
 
-		// ... which compare something against a number ...
-		if (curins->r.t != mop_n)
-			return 0;
+	JZCollector(Arena *arena) : m_SeenComparisons(arena), m_nMaxJz(-1) {};
+
+	void Collect(const FlattenInsnIndex &idx)
+	{
+		for (auto &e : idx.m_Comparisons)
+			Visit(e.ins, e.iBlock);
+	}
 
-		int iFound = 0;
+	void Visit(minsn_t *curins, int iBlock)
+	{
 		mop_t *thisMop = &curins->l;
 
-		int idxFound = 0;
 		// Search for the comparison operand in the saved information
-		for (auto &sc : m_SeenComparisons)
-		{
-			if (equal_mops_ignore_size(*sc.op, *thisMop))
-			{
-				// If found, update the counter and save the number
-				sc.nSeen += 1;
-				sc.nums.push_back(&curins->r);
-				iFound = sc.nSeen;
-				break;
-			}
-			++idxFound;
-		}
+		bool bAdded;
+		int idxFound = m_Operands.Intern(thisMop, &bAdded);
 		
-		// If we didn't find it in the vector, create a new JZInfo structure
-		if (!iFound)
+		// If we didn't find it, create a new JZInfo structure
+		if (bAdded)
 		{
-			m_SeenComparisons.emplace_back();
+			m_SeenComparisons.emplace_back(m_SeenComparisons.get_allocator().m_Arena);
 			JZInfo &jz = m_SeenComparisons.back();
 			jz.op = thisMop;
-			jz.nSeen = 1;
-			jz.nums.push_back(&curins->r);
-			iFound = 1;
+			jz.nSeen = 0;
 		}
 
+		// Update the counter and save the number
+		JZInfo &jz = m_SeenComparisons[idxFound];
+		jz.nSeen += 1;
+		jz.nums.push_back(&curins->r);
+		jz.blocks.push_back(iBlock);
+
 		// If the variable we just saw has been used more often than the previous
 		// candidate, mark this variable as the new candidate
-		if (m_nMaxJz < 0 || iFound > m_SeenComparisons[m_nMaxJz].nSeen)
+		if (m_nMaxJz < 0 || jz.nSeen > m_SeenComparisons[m_nMaxJz].nSeen)
 			m_nMaxJz = idxFound;
-
-		return 0;
 	}
 };
 
-// This function finds the "first" block immediately before the control flow
-// flattening dispatcher begins. The logic is simple; start at the beginning
-// of the function, keep moving forward until the next block has more than one
-// predecessor. As it happens, this is where the assignment to the switch 
-// dispatch variable takes place, and that's mostly why we want it.
-// The information is recorded in the arguments iFirst and iDispatch.
-mblock_t *GetFirstBlock(mbl_array_t *mba, int &iFirst, int &iDispatch)
+// Given a block somewhere near the start of a dispatcher, find the block 
+// where the dispatcher begins, and the "first" block immediately before it. 
+// Move backwards through straight-line code until reaching a block with more
+// than one predecessor; that's the dispatcher, since it's entered both from 
+// outside and from the ends of the flattened regions. Exactly one of its 
+// predecessors must not be dominated by it, and that's the first block. As
+// it happens, this is where the assignment to the switch dispatch variable
+// takes place, and that's mostly why we want it. For the outermost 
+// dispatcher, this is the same as moving forwards from the start of the 
+// function until the next block has more than one predecessor.
+static bool FindDispatcherEntry(mbl_array_t *mba, const DominatorTree &domTree, int iBlock, int &iFirst, int &iDispatch)
 {
 	// Initialise iFirst and iDispatch to erroneous values
 	iFirst = -1, iDispatch = -1;
 
-	mblock_t *mb;
-	int iCurr = 0;
-	
-	while (true)
+	mblock_t *mb = mba->get_mblock(iBlock);
+	for (int i = 0; i < mba->qty && mb->npred() == 1; ++i)
+	{
+		mblock_t *mbPred = mba->get_mblock(mb->pred(0));
+		if (mbPred->nsucc() != 1)
+			break;
+		mb = mbPred;
+	}
+	if (mb->npred() < 2 || !domTree.IsReachable(mb->serial))
+		return false;
+
+	for (auto iPred : mb->predset)
 	{
-		// If we find a block with more than one successor, we failed.
-		mb = mba->get_mblock(iCurr);
-		if (mb->nsucc() != 1)
+		if (!domTree.IsReachable(iPred) || domTree.Dominates(mb->serial, iPred))
+			continue;
+		
+		// If there's more than one way in, we failed
+		if (iFirst >= 0)
 		{
 #if UNFLATTENVERBOSE
-			debugmsg("[E] Block %d had %d (!= 1) successors\n", iCurr, mb->nsucc());
+			debugmsg("[E] Dispatcher %d has multiple entries (%d, %d)\n", mb->serial, iFirst, iPred);
 #endif
-			return NULL;
+			iFirst = -1;
+			return false;
 		}
-		
-		// Get the successor block
-		int iSucc = mb->succ(0);
-		mblock_t *mNextBlock = mba->get_mblock(iSucc);
-		
-		// If the successor has more than one predecessor, we're done
-		if (mNextBlock->npred() != 1)
-			break;
-		
-		// Otherwise, move onto the next block
-		iCurr = iSucc;
+		iFirst = iPred;
 	}
-	// We found it; pass the information back to the caller
-	iFirst = iCurr;
-	iDispatch = mb->succ(0);
-	return mb;
+	
+	// The first block must go directly to the dispatcher
+	if (iFirst < 0 || mba->get_mblock(iFirst)->nsucc() != 1)
+	{
+		iFirst = -1;
+		return false;
+	}
+	iDispatch = mb->serial;
+	return true;
 }
 
-// This class is used to find all variables that have 32-bit numeric values 
-// assigned to them in the first block (as well as the values that are 
+// This function is used to find all variables that have 32-bit numeric 
+// values assigned to them in the first block (as well as the values that are
 // assigned to them).
-struct BlockInsnAssignNumberExtractor : public minsn_visitor_t
+static void ExtractBlockAssignments(const FlattenInsnIndex &idx, int iBlock, ArenaVector<std::pair<mop_t *, uint64> > &seenAssignments)
 {
-	std::vector<std::pair<mop_t *, uint64> > m_SeenAssignments;
-	int visit_minsn()
+	for (auto &e : idx.m_NumAssigns)
 	{
-		// We're looking for MOV(const.4,x)
-		if (curins->opcode != m_mov || curins->l.t != mop_n || curins->l.size != 4)
-			return 0;
+		// We're looking for MOV(const.4,x) in the specified block
+		if (e.iBlock != iBlock || e.ins->l.size != 4)
+			continue;
 
 		// Record all such information in the vector
-		m_SeenAssignments.push_back(std::pair<mop_t *, uint64>(&curins->d, curins->l.nnn->value));
-		return 0;
+		seenAssignments.push_back(std::pair<mop_t *, uint64>(&e.ins->d, e.ins->l.nnn->value));
 	}
-};
+}
 
 // Protected functions might use either one, or two, variables for the switch
 // dispatch number. If it uses two, one of them is the "update" variable, whose
 // contents will be copied into the "comparison" variable in the first dispatch
-// block. This class is used to locate the "update" variable, by simply looking
-// for a variable whose contents are copied into the "comparison" variable, 
-// which must have had a number assigned to it in the first block.
-struct HandoffVarFinder : public minsn_visitor_t
+// block. This function is used to locate the "update" variable, by simply 
+// looking for a variable whose contents are copied into the "comparison" 
+// variable, which must have had a number assigned to it in the first block.
+// The output is a list of variables that are seen copied into the comparison
+// variable, as well as a count of the number of times each is copied.
+static void FindHandoffVars(
+	const FlattenInsnIndex &idx,
+	mop_t *opComparisonVar,
+	ArenaVector<std::pair<mop_t *, uint64> > &seenAssignments,
+	ArenaVector<std::pair<mop_t *, int> > &seenCopies,
+	int &nComparisonsAvoided)
 {
-	// We're looking for assignments to this variable
-	mop_t *m_ComparisonVar;
-	
-	// These are the numeric assignments from the first block
-	std::vector<std::pair<mop_t *, uint64> > &m_SeenAssignments;
+	// Intern the variables that were assigned numbers in the first block. The
+	// same variable may be assigned more than once, so also count how many
+	// assignments each interned variable had.
+	MopInternTable assigned;
+	ArenaVector<int> nAssignments(seenCopies.get_allocator());
+	for (auto &as : seenAssignments)
+	{
+		bool bAdded;
+		int iAssigned = assigned.Intern(as.first, &bAdded);
+		if (bAdded)
+			nAssignments.push_back(0);
+		nAssignments[iAssigned] += 1;
+	}
 	
-	// This information is generated by this class. Namely, it's a list of 
-	// variables that are seen copied into the comparison variable, as well
-	// as a count of the number of times it is copied.
-	std::vector<std::pair<mop_t *, int> > m_SeenCopies;
-
-	HandoffVarFinder(mop_t *opMax, std::vector<std::pair<mop_t *, uint64> > &assignments) :
-		m_ComparisonVar(opMax),
-		m_SeenAssignments(assignments)
-	{};
+	// Position of each assigned variable within seenCopies, if any
+	ArenaVector<int> copyIndex(assigned.Size(), -1, seenCopies.get_allocator());
 
-	int visit_minsn(void)
+	for (auto &e : idx.m_Copies)
 	{
 		// We want copies into our comparison variable
-		if (curins->opcode != m_mov || !equal_mops_ignore_size(curins->d, *m_ComparisonVar))
-			return 0;
+		minsn_t *curins = e.ins;
+		if (!equal_mops_ignore_size(curins->d, *opComparisonVar))
+			continue;
 
-		// Iterate through the numeric assignments from the first block. These
-		// are our candidates.
-		for (auto &as : m_SeenAssignments)
+		// Is the source one of the numeric assignments from the first block?
+		// These are our candidates.
+		int iAssigned = assigned.Find(&curins->l);
+		if (iAssigned < 0)
+			continue;
+
+		// If we found a copy into our comparison variable from a variable 
+		// that was assigned to a constant in the first block, add it to the 
+		// vector (or increment its counter if it was already there). As 
+		// before, each assignment to the variable counts as one sighting.
+		if (copyIndex[iAssigned] < 0)
 		{
-			if (equal_mops_ignore_size(curins->l, *as.first))
-			{
-				// If we found a copy into our comparison variable from a 
-				// variable that was assigned to a constant in the first block,
-				// add it to the vector (or increment its counter if it was
-				// already there).
-				bool bFound = false;
-				for (auto sc : m_SeenCopies)
-				{
-					if (equal_mops_ignore_size(*as.first, *sc.first))
-					{
-						sc.second += 1;
-						bFound = true;
-					}
-				}
-				if (!bFound)
-					m_SeenCopies.push_back(std::pair<mop_t *, int>(as.first, 1));
-			}
+			copyIndex[iAssigned] = seenCopies.size();
+			seenCopies.push_back(std::pair<mop_t *, int>(const_cast<mop_t *>(assigned.m_Mops[iAssigned]), 0));
 		}
-		return 0;
+		seenCopies[copyIndex[iAssigned]].second += nAssignments[iAssigned];
 	}
-};
+	nComparisonsAvoided += assigned.m_nComparisonsAvoided;
+}
 
 // Once we know which variable is the one used for comparisons, look for all
 // jz instructions that compare a number against this variable. This then tells
 // us which number corresponds to which basic block.
-struct JZMapper : public minsn_visitor_t
+static void MapKeysToBlocks(
+	const FlattenInsnIndex &idx,
+	mop_t *opCompareVar,
+	mop_t *opAssignVar,
+	int iDispatchBlockNo,
+	KeyBlockIndex &keys)
 {
-	std::map<uint64, int> &m_KeyToBlock;
-	std::map<int, uint64> &m_BlockToKey;
-	mop_t *m_CompareVar;
-	mop_t *m_AssignVar;
-	int m_DispatchBlockNo;
-	JZMapper(mop_t *mc, mop_t *ma, int iFirst, std::map<uint64, int> &map, std::map<int, uint64> &map2) : 
-		m_CompareVar(mc), 
-		m_AssignVar(ma),
-		m_DispatchBlockNo(iFirst),
-		m_KeyToBlock(map),
-		m_BlockToKey(map2) {};
-
-	int visit_minsn(void)
+	for (auto &e : idx.m_Comparisons)
 	{
 		// We're looking for jz instructions that compare a number ...
-		if (curins->opcode != m_jz || curins->r.t != mop_n)
-			return 0;
+		minsn_t *curins = e.ins;
+		if (curins->opcode != m_jz)
+			continue;
 
 		// ... against our comparison variable ...
-		if (!equal_mops_ignore_size(*m_CompareVar, curins->l))
+		if (!equal_mops_ignore_size(*opCompareVar, curins->l))
 		{
 			// ... or, if it's the dispatch block, possibly the assignment variable ...
-			if (blk->serial != m_DispatchBlockNo || !equal_mops_ignore_size(*m_AssignVar, curins->l))
-				return 0;
+			if (e.iBlock != iDispatchBlockNo || !equal_mops_ignore_size(*opAssignVar, curins->l))
+				continue;
 		}
 
 		// ... and the destination of the jz must be a block
-		if(curins->d.t != mop_b)
-			return 0;
+		if (curins->d.t != mop_b)
+			continue;
 
 #if UNFLATTENVERBOSE
 		debugmsg("[I] Inserting %08lx->%d into map\n", (uint32)curins->r.nnn->value, curins->d.b);
 #endif
-		// Record the information in two maps
-		uint64 keyVal = curins->r.nnn->value;
-		int blockNo = curins->d.b;
-		
-		m_KeyToBlock[keyVal] = blockNo;
-		m_BlockToKey[blockNo] = keyVal;
-		return 0;
+		// Record the information in both directions
+		keys.Insert(curins->r.nnn->value, curins->d.b);
 	}
-};
+}
 
-// Compute dominator information for the function.
-array_of_bitsets *ComputeDominators(mbl_array_t *mba)
+// Sort the keys so they can be binary searched. If the same key was inserted
+// more than once, only keep the last insertion, so we need a stable sort.
+void KeyBlockIndex::Finalize()
 {
-	int iNumBlocks = mba->qty;
-	assert(iNumBlocks >= 1);
-
-	// Use Hex-Rays' handy array_of_bitsets to represent dominators
-	array_of_bitsets *domInfo = new array_of_bitsets;
-	domInfo->resize(iNumBlocks);
+	std::stable_sort(m_Keys.begin(), m_Keys.end(),
+		[](const std::pair<uint64, int> &a, const std::pair<uint64, int> &b) { return a.first < b.first; });
 	
-	// Per the algorithm, initialize each block to be dominated by every block
-	for (auto &bs : *domInfo)
-		bs.fill_with_ones(iNumBlocks - 1);
-
-	// ... except the first block, which only dominates itself
-	domInfo->front().clear();
-	domInfo->front().add(0);
-
-	// Now we've got a standard, not-especially-optimized dataflow analysis 
-	// fixedpoint computation...
-	bool bChanged;
-	do
-	{
-		bChanged = false;
-		// For every block...
-		for (int i = 1; i < iNumBlocks; ++i)
+	int iOut = 0;
+	for (int i = 0; i < m_Keys.size(); ++i)
+	{
+		// Skip this one if the next one has the same key
+		if (i + 1 < m_Keys.size() && m_Keys[i + 1].first == m_Keys[i].first)
+			continue;
+		m_Keys[iOut++] = m_Keys[i];
+	}
+	m_Keys.resize(iOut);
+
+	// The ranges come from the leaves of a comparison tree, so they don't 
+	// overlap; just sort them.
+	std::sort(m_Ranges.begin(), m_Ranges.end(),
+		[](const KeyRange &a, const KeyRange &b) { return a.lo < b.lo; });
+}
+
+// Record the cases of a jump table. If the keys are packed densely enough,
+// put them into the directly-indexed array; otherwise, treat them like any
+// other keys.
+void KeyBlockIndex::InsertTable(const ArenaVector<std::pair<uint64, int> > &cases)
+{
+	if (cases.empty())
+		return;
+
+	uint64 lo = ~0ULL, hi = 0;
+	for (auto &c : cases)
+	{
+		lo = qmin(lo, c.first & m_KeyMask);
+		hi = qmax(hi, c.first & m_KeyMask);
+	}
+
+	// Dense means no more than three holes for every key
+	uint64 span = hi - lo;
+	if (m_DenseBlocks.empty() && span < MAX_DENSE_KEYS && span < 4 * cases.size())
+	{
+		m_DenseBase = lo;
+		m_DenseBlocks.resize(span + 1, -1);
+		for (auto &c : cases)
 		{
-			// Grab its current dataflow value and copy it
-			bitset_t &bsCurr = domInfo->at(i);
-			bitset_t bsBefore(bsCurr);
-			
-			// Get that block from the graph
-			mblock_t *blockI = mba->get_mblock(i);
-			
-			// Iterate over its predecessors, intersecting their dataflow 
-			// values against this one's values
-			for (int j = 0; j < blockI->npred(); ++j)
-				bsCurr.intersect(domInfo->at(blockI->pred(j)));
-
-			// Then, re-indicate that the block dominates itself
-			bsCurr.add(i);
-
-			// If this process changed the dataflow information, we're going to
-			// need another iteration
-			bChanged |= bsBefore != bsCurr;
+			uint64 key = c.first & m_KeyMask;
+			m_DenseBlocks[key - lo] = c.second;
+			m_BlockKeys[c.second] = key;
+			m_BlockHasKey[c.second] = true;
 		}
-	} 
-	// Keep going until the dataflow information stops changing
-	while (bChanged);
-
-	// The dominator information has been computed. Now we're going to derive 
-	// some information from it. Namely, the current representation tells us,
-	// for each block, which blocks dominate it. We want to know, instead, for
-	// each block, which blocks are dominated by it. This is a simple 
-	// transformation; for each block b and dominator d, update the information
-	// for d to indicate that it dominates b.
+		return;
+	}
+	for (auto &c : cases)
+		Insert(c.first & m_KeyMask, c.second);
+}
+
+// Look up a block number by its key. Returns -1 if the key isn't present.
+int KeyBlockIndex::FindBlock(uint64 key) const
+{
+	// Try the jump table keys first. If the key is below the base, the 
+	// subtraction wraps around and the index will be out of range.
+	uint64 iDense = (key & m_KeyMask) - m_DenseBase;
+	if (iDense < m_DenseBlocks.size() && m_DenseBlocks[iDense] >= 0)
+		return m_DenseBlocks[iDense];
+
+	auto it = std::lower_bound(m_Keys.begin(), m_Keys.end(), key,
+		[](const std::pair<uint64, int> &a, uint64 k) { return a.first < k; });
+	if (it != m_Keys.end() && it->first == key)
+		return it->second;
 	
-	// Create a new array_of_bitsets
-	array_of_bitsets *domInfoOutput = new array_of_bitsets;
-	domInfoOutput->resize(iNumBlocks);
+	// Otherwise, find the last range starting at or before the key, and see
+	// whether the key is inside of it.
+	uint64 masked = key & m_KeyMask;
+	auto rt = std::upper_bound(m_Ranges.begin(), m_Ranges.end(), masked,
+		[](uint64 k, const KeyRange &r) { return k < r.lo; });
+	if (rt == m_Ranges.begin())
+		return -1;
+	--rt;
+	if (masked > rt->hi)
+		return -1;
+	return rt->iBlock;
+}
+
+// Some dispatchers aren't a linear chain of jz instructions, but rather a 
+// binary search tree of comparisons like jg/jl/ja/jb, with each leaf being a
+// flattened block. Walk down the tree starting from the dispatcher block, 
+// keeping track of the range of keys that can reach each node, and record 
+// the range for every leaf.
+//
+// A key's range is tracked both as an unsigned range and as a signed range,
+// since the tree may use either kind of comparison. Signed ranges are stored
+// with the sign bit flipped, so that they can be compared as unsigned 
+// numbers. Inequalities against jz/jnz constants leave holes in the ranges;
+// the constants themselves are recorded as single keys, which take 
+// precedence over the ranges when looking keys up. We do remember which 
+// constants were excluded along the way, so as not to record keys for paths
+// that can't be taken.
+struct DispatchTreeNode
+{
+	int iBlock;
+	uint64 ulo, uhi;
+	uint64 slo, shi;
+	ArenaVector<uint64> excluded;
+
+	bool IsExcluded(uint64 c) const { return std::find(excluded.begin(), excluded.end(), c) != excluded.end(); }
+};
+
+// Narrow the ranges in "node" to those keys for which "key OP c" is true.
+// Returns false if no keys remain.
+static bool NarrowKeyRange(DispatchTreeNode &node, mcode_t op, uint64 c, uint64 mask, uint64 signBit)
+{
+	uint64 lo = 0, hi = mask;
+	bool bSigned = false;
+	switch (op)
+	{
+		case m_jz:
+			if (node.IsExcluded(c))
+				return false;
+			node.ulo = qmax(node.ulo, c), node.uhi = qmin(node.uhi, c);
+			node.slo = qmax(node.slo, c ^ signBit), node.shi = qmin(node.shi, c ^ signBit);
+			return node.ulo <= node.uhi && node.slo <= node.shi;
+		case m_jnz:
+			node.excluded.push_back(c);
+			return true;
+		case m_jae: lo = c; break;
+		case m_ja:  if (c == mask) return false; lo = c + 1; break;
+		case m_jb:  if (c == 0) return false; hi = c - 1; break;
+		case m_jbe: hi = c; break;
+		case m_jge: bSigned = true; lo = c ^ signBit; break;
+		case m_jg:  bSigned = true; if ((c ^ signBit) == mask) return false; lo = (c ^ signBit) + 1; break;
+		case m_jl:  bSigned = true; if ((c ^ signBit) == 0) return false; hi = (c ^ signBit) - 1; break;
+		case m_jle: bSigned = true; hi = c ^ signBit; break;
+		default:
+			return false;
+	}
+	uint64 &nlo = bSigned ? node.slo : node.ulo;
+	uint64 &nhi = bSigned ? node.shi : node.uhi;
+	nlo = qmax(nlo, lo);
+	nhi = qmin(nhi, hi);
+	return nlo <= nhi;
+}
+
+// The condition under which a conditional jump is not taken
+static mcode_t NegateJcc(mcode_t op)
+{
+	switch (op)
+	{
+		case m_jz:  return m_jnz;
+		case m_jnz: return m_jz;
+		case m_jae: return m_jb;
+		case m_jb:  return m_jae;
+		case m_ja:  return m_jbe;
+		case m_jbe: return m_ja;
+		case m_jg:  return m_jle;
+		case m_jle: return m_jg;
+		case m_jge: return m_jl;
+		case m_jl:  return m_jge;
+	}
+	return m_nop;
+}
+
+// Is this block an interior node of the dispatcher's comparison tree, i.e.,
+// does it end by comparing the dispatch variable against a constant?
+static bool IsDispatchTreeNode(mblock_t *mb, mop_t *opCompareVar, mop_t *opAssignVar, int iDispatchBlockNo)
+{
+	// Every node but the root has only its parent as a predecessor
+	if (mb->serial != iDispatchBlockNo && mb->npred() != 1)
+		return false;
 	
-	// Iterate over each block
-	for (int i = 0; i < iNumBlocks; ++i)
+	minsn_t *tail = mb->tail;
+	if (tail == NULL || mb->nsucc() != 2 || NegateJcc(tail->opcode) == m_nop)
+		return false;
+	if (tail->r.t != mop_n || tail->d.t != mop_b)
+		return false;
+	if (equal_mops_ignore_size(*opCompareVar, tail->l))
+		return true;
+	return mb->serial == iDispatchBlockNo && equal_mops_ignore_size(*opAssignVar, tail->l);
+}
+
+// Record the keys that reach a leaf of the comparison tree
+static void RecordLeafKeys(const DispatchTreeNode &node, uint64 mask, uint64 signBit, KeyBlockIndex &keys)
+{
+	// A leaf reached without any inequality comparisons is the default case
+	// of the dispatcher, not a flattened block.
+	bool bUnsignedFull = node.ulo == 0 && node.uhi == mask;
+	bool bSignedFull = node.slo == 0 && node.shi == mask;
+	if (bUnsignedFull && bSignedFull)
+		return;
+
+	// Convert the signed range back into one or two unsigned ranges, then 
+	// intersect them with the unsigned range.
+	uint64 ranges[2][2];
+	int nRanges = 0;
+	if (node.slo < signBit && node.shi >= signBit)
+	{
+		ranges[0][0] = node.slo ^ signBit, ranges[0][1] = mask;
+		ranges[1][0] = 0, ranges[1][1] = node.shi ^ signBit;
+		nRanges = 2;
+	}
+	else
+	{
+		ranges[0][0] = node.slo ^ signBit, ranges[0][1] = node.shi ^ signBit;
+		nRanges = 1;
+	}
+	for (int i = 0; i < nRanges; ++i)
+	{
+		uint64 lo = qmax(ranges[i][0], node.ulo);
+		uint64 hi = qmin(ranges[i][1], node.uhi);
+		if (lo > hi || (lo == hi && node.IsExcluded(lo)))
+			continue;
+#if UNFLATTENVERBOSE
+		debugmsg("[I] Inserting [%08llx, %08llx]->%d into map\n", lo, hi, node.iBlock);
+#endif
+		if (lo == hi)
+			keys.Insert(lo, node.iBlock);
+		else
+			keys.InsertRange(lo, hi, node.iBlock);
+	}
+}
+
+static void MapKeyRangesToBlocks(
+	mbl_array_t *mba,
+	mop_t *opCompareVar,
+	mop_t *opAssignVar,
+	int iDispatchBlockNo,
+	KeyBlockIndex &keys)
+{
+	// Keys are compared at the size of the comparison variable
+	int nBits = opCompareVar->size * 8;
+	if (nBits <= 0 || nBits > 64)
+		return;
+	uint64 mask = nBits == 64 ? ~0ULL : (1ULL << nBits) - 1;
+	uint64 signBit = 1ULL << (nBits - 1);
+	keys.m_KeyMask = mask;
+
+	Arena *arena = keys.m_Keys.get_allocator().m_Arena;
+	ArenaVector<bool> visited(mba->qty, false, arena);
+	ArenaVector<DispatchTreeNode> stack(arena);
+	DispatchTreeNode root;
+	root.excluded = ArenaVector<uint64>(arena);
+	root.iBlock = iDispatchBlockNo;
+	root.ulo = root.slo = 0;
+	root.uhi = root.shi = mask;
+	stack.push_back(root);
+
+	while (!stack.empty())
 	{
-		// Get the dominator information for this block (b)
-		bitset_t &bsCurr = domInfo->at(i);
+		DispatchTreeNode node;
+		std::swap(node, stack.back());
+		stack.pop_back();
+		mblock_t *mb = mba->get_mblock(node.iBlock);
 		
-		// For each block d that dominates this one, mark that d dominates b
-		for (auto it = bsCurr.begin(); it != bsCurr.end(); bsCurr.inc(it))
-			domInfoOutput->at(*it).add(i);
+		// If we've reached a block that doesn't compare the key, it's a leaf
+		if (!IsDispatchTreeNode(mb, opCompareVar, opAssignVar, iDispatchBlockNo))
+		{
+			RecordLeafKeys(node, mask, signBit, keys);
+			continue;
+		}
+		
+		// Don't loop forever if the graph isn't really a tree
+		if (visited[node.iBlock])
+			continue;
+		visited[node.iBlock] = true;
+
+		// Narrow the key ranges for both successors. If no key can reach a 
+		// successor, don't go there.
+		minsn_t *tail = mb->tail;
+		uint64 c = tail->r.nnn->value & mask;
+		
+		DispatchTreeNode taken = node;
+		taken.iBlock = tail->d.b;
+		if (NarrowKeyRange(taken, tail->opcode, c, mask, signBit))
+			stack.push_back(taken);
+		
+		DispatchTreeNode notTaken = node;
+		notTaken.iBlock = mb->serial + 1;
+		if (NarrowKeyRange(notTaken, NegateJcc(tail->opcode), c, mask, signBit))
+			stack.push_back(notTaken);
 	}
-	
-	// Don't need the original dominator information anymore; get rid of it
-	delete domInfo;
-	
-	// Just return the inverted dominator information
-	return domInfoOutput;
 }
 
-// Convenience function to look up a block number by its key. This way, we can
-// write the iterator-end check once, so clients don't have to do it.
+// Some protected functions dispatch through an actual jump table, rather 
+// than a series of comparisons. Is this jtbl instruction one of those? It
+// must switch on a variable, with a reasonable number of cases.
+static bool IsJumpTableDispatch(minsn_t *ins)
+{
+	if (ins == NULL || ins->opcode != m_jtbl || ins->r.t != mop_c)
+		return false;
+	switch (ins->l.t)
+	{
+		case mop_r:
+		case mop_S:
+		case mop_v:
+		case mop_l:
+			break;
+		default:
+			return false;
+	}
+	return ins->r.c->size() >= MIN_NUM_COMPARISONS;
+}
+
+// Record the key for every case of a jump table dispatcher
+static void MapJumpTableKeys(minsn_t *jtbl, mop_t *opCompareVar, KeyBlockIndex &keys)
+{
+	int nBits = opCompareVar->size * 8;
+	if (nBits > 0 && nBits < 64)
+		keys.m_KeyMask = (1ULL << nBits) - 1;
+
+	ArenaVector<std::pair<uint64, int> > cases(keys.m_Keys.get_allocator());
+	mcases_t &mc = *jtbl->r.c;
+	for (int i = 0; i < mc.size(); ++i)
+	{
+		// The default case has no values
+		for (auto v : mc.values[i])
+			cases.push_back(std::pair<uint64, int>((uint64)v, mc.targets[i]));
+	}
+	keys.InsertTable(cases);
+}
+
+// Convenience function to look up a block number by its key.
 int CFFlattenInfo::FindBlockByKey(uint64 key)
 {
-	if (m_KeyToBlock.find(key) == m_KeyToBlock.end())
-		return -1;
-	return m_KeyToBlock[key];
+	return m_Keys.FindBlock(key);
 }
 
-// This function computes all of the preliminary information needed for 
-// unflattening.
-bool CFFlattenInfo::GetAssignedAndComparisonVariables(mblock_t *blk)
+// Add a dispatcher to the list, unless there's already one starting at the
+// same block.
+static void AddDispatcher(std::vector<DispatcherCandidate> &dispatchers, const DispatcherCandidate &dc)
+{
+	for (auto &other : dispatchers)
+		if (other.iDispatch == dc.iDispatch)
+			return;
+	dispatchers.push_back(dc);
+#if UNFLATTENVERBOSE
+	debugmsg("[I] Found dispatcher at block %d (first block %d, depth %d, %s)\n", dc.iDispatch, dc.iFirst, dc.iDepth, dc.iJumpTable >= 0 ? "jump table" : "comparisons");
+#endif
+}
+
+// This function finds every control flow flattening dispatcher in the 
+// function, and computes the per-function information that all of them will
+// share: the instruction index and the dominator tree. The dispatchers are
+// returned innermost-first, i.e., the deepest in the dominator tree first, 
+// so that nested dispatchers are unflattened before the ones containing them.
+bool CFFlattenInfo::FindDispatchers(mbl_array_t *mba, std::vector<DispatcherCandidate> &dispatchers)
 {
+	PhaseTimer timer(PH_FIND_DISPATCHERS);
+
 	// Erase any existing information in this structure.
 	Clear(true);
+	dispatchers.clear();
 
 	// Ensure that this function hasn't been blacklisted (e.g. because entropy
 	// calculation indicates that it isn't obfuscated).
-	mbl_array_t *mba = blk->mba;
-	if (g_BlackList.find(mba->entry_ea) != g_BlackList.end())
+	if (g_Verdicts.Get(mba->entry_ea) == VERDICT_NOT_FLATTENED)
 		return false;
 
 	// There's also a separate whitelist for functions that were previously 
 	// seen to be obfuscated.
-	bool bWasWhitelisted = g_WhiteList.find(mba->entry_ea) != g_WhiteList.end();
+	bool bWasWhitelisted = g_Verdicts.Get(mba->entry_ea) == VERDICT_FLATTENED;
+
+	// Save off the current function's starting EA
+	m_WhichFunc = mba->entry_ea;
 
-	// Look for the variable that was used in the largest number of jz/jg 
-	// comparisons against a constant. This is our "comparison" variable.
-	JZCollector jzc;
-	mba->for_all_topinsns(jzc);
-	if (jzc.m_nMaxJz < 0)
+	// Make a single pass over the function, recording the instructions that
+	// all of the analyses below are interested in.
+#if UNFLATTENVERBOSE
+	uint64 tIndex = get_nsec_stamp();
+#endif
+	m_Index.Build(mba);
+#if UNFLATTENVERBOSE
+	debugmsg("[I] Built instruction index in %llu us\n", (get_nsec_stamp() - tIndex) / 1000);
+#endif
+
+	// Compute the dominator tree for this function and stash it. It's kept 
+	// up-to-date from here on as the graph is modified.
+#if UNFLATTENVERBOSE
+	uint64 tStart = get_nsec_stamp();
+#endif
+	m_DomTree.Compute(mba);
+#if UNFLATTENVERBOSE
+	debugmsg("[I] Computed dominator tree for %d blocks in %llu us\n", mba->qty, (get_nsec_stamp() - tStart) / 1000);
+#endif
+
+	DispatcherCandidate dc;
+
+	// If a dispatcher is a jump table, the variable it switches on is its 
+	// comparison variable. The keys needn't be entropic in this case, since
+	// jump tables are only built for keys that are packed closely together.
+	for (auto &e : m_Index.m_Tables)
+	{
+		if (!IsJumpTableDispatch(e.ins))
+			continue;
+		if (!FindDispatcherEntry(mba, m_DomTree, e.iBlock, dc.iFirst, dc.iDispatch))
+			continue;
+		dc.iJumpTable = e.iBlock;
+		dc.iDepth = m_DomTree.Depth(dc.iDispatch);
+		dc.opCompared = e.ins->l;
+		AddDispatcher(dispatchers, dc);
+	}
+	bool bJumpTables = !dispatchers.empty();
+
+	// Look for the variable that was used in the largest number of conditional
+	// comparisons against a constant. This is our primary "comparison" 
+	// variable.
+	JZCollector jzc(&m_Arena);
+	jzc.Collect(m_Index);
+	m_nComparisonsAvoided = jzc.m_Operands.m_nComparisonsAvoided;
+#if UNFLATTENVERBOSE
+	debugmsg("[I] Operand interning avoided %d comparisons\n", m_nComparisonsAvoided);
+#endif
+	if (jzc.m_nMaxJz < 0 && !bJumpTables)
 	{
 		// If there were no comparisons and we haven't seen this function 
 		// before, blacklist it.
@@ -415,47 +818,125 @@ bool CFFlattenInfo::GetAssignedAndComparisonVariables(mblock_t *blk)
 		debugmsg("[I] No comparisons seen; failed\n");
 #endif
 		if (!bWasWhitelisted)
-			g_BlackList.insert(mba->entry_ea);
+			g_Verdicts.Set(mba->entry_ea, VERDICT_NOT_FLATTENED);
 		return false;
 	}
 
 	// Otherwise, we were able to find jz comparison information. Use that to
 	// determine if the constants look entropic enough. If not, blacklist this
 	// function. If so, whitelist it.
-	if (!bWasWhitelisted)
+	if (jzc.m_nMaxJz >= 0 && !bWasWhitelisted && !bJumpTables)
 	{
-		if (jzc.m_SeenComparisons[jzc.m_nMaxJz].ShouldBlacklist())
+		JZInfo &jz = jzc.m_SeenComparisons[jzc.m_nMaxJz];
+		int iNumBits, iNumOnes;
+		float fEntropy = jz.ComputeEntropy(iNumBits, iNumOnes);
+		if (jz.ShouldBlacklist())
 		{
-			g_BlackList.insert(mba->entry_ea);
+			g_Verdicts.Set(mba->entry_ea, VERDICT_NOT_FLATTENED, fEntropy);
 			return false;
 		}
-		g_WhiteList.insert(mba->entry_ea);
+		g_Verdicts.Set(mba->entry_ea, VERDICT_FLATTENED, fEntropy);
 	}
 
-	// opMax is our "comparison" variable used in the control flow switch.
-	mop_t *opMax = jzc.m_SeenComparisons[jzc.m_nMaxJz].op;
+	// Now consider every variable that was compared against constants: the
+	// primary one first, then any others that look like dispatch variables
+	// in their own right, in decreasing order of the number of comparisons.
+	ArenaVector<int> order(&m_Arena);
+	for (int i = 0; i < jzc.m_SeenComparisons.size(); ++i)
+	{
+		if (i == jzc.m_nMaxJz || jzc.m_SeenComparisons[i].LooksLikeDispatchVar())
+			order.push_back(i);
+	}
+	std::stable_sort(order.begin(), order.end(), [&jzc](int a, int b) 
+	{ 
+		if (a == jzc.m_nMaxJz || b == jzc.m_nMaxJz)
+			return a == jzc.m_nMaxJz && b != jzc.m_nMaxJz;
+		return jzc.m_SeenComparisons[a].nSeen > jzc.m_SeenComparisons[b].nSeen;
+	});
+
+	for (auto i : order)
+	{
+		// The same variable might be used by several separate dispatchers.
+		// Each dispatcher begins at a comparison block that isn't dominated 
+		// by any other comparison block on the same variable. Visiting the 
+		// blocks in preorder over the dominator tree, a block is dominated by
+		// an earlier such block only if it's dominated by the latest one.
+		JZInfo &jz = jzc.m_SeenComparisons[i];
+		ArenaVector<int> blocks(&m_Arena);
+		for (auto iBlock : jz.blocks)
+			if (m_DomTree.IsReachable(iBlock))
+				blocks.push_back(iBlock);
+		std::sort(blocks.begin(), blocks.end(), [this](int a, int b) { return m_DomTree.m_Pre[a] < m_DomTree.m_Pre[b]; });
 
-	// Find the "first" block in the function, the one immediately before the
-	// control flow switch.
-	mblock_t *first = GetFirstBlock(mba, this->iFirst, this->iDispatch);
-	if (first == NULL)
+		int iLastRoot = -1;
+		for (auto iBlock : blocks)
+		{
+			if (iLastRoot >= 0 && m_DomTree.Dominates(iLastRoot, iBlock))
+				continue;
+			iLastRoot = iBlock;
+			if (!FindDispatcherEntry(mba, m_DomTree, iBlock, dc.iFirst, dc.iDispatch))
+				continue;
+			dc.iJumpTable = -1;
+			dc.iDepth = m_DomTree.Depth(dc.iDispatch);
+			dc.opCompared = *jz.op;
+			AddDispatcher(dispatchers, dc);
+		}
+	}
+
+	if (dispatchers.empty())
 	{
 #if UNFLATTENVERBOSE
-		debugmsg("[E] Can't find top-level block in function\n");
+		debugmsg("[E] Can't find any dispatchers in function\n");
 #endif
 		return false;
 	}
 
+	// Innermost first
+	std::stable_sort(dispatchers.begin(), dispatchers.end(), 
+		[](const DispatcherCandidate &a, const DispatcherCandidate &b) { return a.iDepth > b.iDepth; });
+	return true;
+}
+
+// This function computes all of the preliminary information needed for 
+// unflattening one dispatcher. FindDispatchers must have been called first,
+// and the graph may have been modified since then, so long as the dominator
+// tree and instruction index were kept up-to-date and no blocks were 
+// renumbered.
+bool CFFlattenInfo::AnalyzeDispatcher(mbl_array_t *mba, const DispatcherCandidate &dc)
+{
+	PhaseTimer timer(PH_ANALYZE_DISPATCHER);
+
+	// Erase any information about the previous dispatcher
+	ClearDispatcher();
+
+	// Unflattening a nested dispatcher may have left this one unreachable 
+	if (!m_DomTree.IsValidFor(mba) || !m_DomTree.IsReachable(dc.iDispatch) || !m_DomTree.IsReachable(dc.iFirst))
+		return false;
+	this->iFirst = dc.iFirst;
+	this->iDispatch = dc.iDispatch;
+	
+	// Make sure the jump table is still there
+	minsn_t *jtbl = NULL;
+	if (dc.iJumpTable >= 0)
+	{
+		jtbl = mba->get_mblock(dc.iJumpTable)->tail;
+		if (!IsJumpTableDispatch(jtbl))
+			return false;
+	}
+
+	// opMax is our "comparison" variable used in the control flow switch.
+	mop_t *opMax = const_cast<mop_t *>(&dc.opCompared);
+
 	// Get all variables assigned to numbers in the first block. If we find the
 	// comparison variable in there, then the assignment and comparison 
 	// variables are the same. If we don't, then there are two separate 
 	// variables.
-	BlockInsnAssignNumberExtractor fbe;
-	first->for_all_insns(fbe);
+	ArenaVector<std::pair<mop_t *, uint64> > seenAssignments(&m_Arena);
+	ExtractBlockAssignments(m_Index, iFirst, seenAssignments);
 
 	// Was the comparison variable assigned a number in the first block?
 	bool bFound = false;
-	for (auto as : fbe.m_SeenAssignments)
+	for (auto as : seenAssignments)
 	{
 		if (equal_mops_ignore_size(*as.first, *opMax))
 		{
@@ -479,15 +960,15 @@ bool CFFlattenInfo::GetAssignedAndComparisonVariables(mblock_t *blk)
 	{
 		// For all variables assigned a number in the first block, find all
 		// assignments throughout the function to the comparison variable
-		HandoffVarFinder hvf(opMax, fbe.m_SeenAssignments);
-		mba->for_all_topinsns(hvf);
+		ArenaVector<std::pair<mop_t *, int> > seenCopies(&m_Arena);
+		FindHandoffVars(m_Index, opMax, seenAssignments, seenCopies, m_nComparisonsAvoided);
 
 		// There should have only been one of them; is that true?
-		if (hvf.m_SeenCopies.size() != 1)
+		if (seenCopies.size() != 1)
 		{
 #if UNFLATTENVERBOSE
-			debugmsg("[E] Comparison var was copied from %d assigned-to-constant variables, not 1 as expected\n", hvf.m_SeenCopies.size());
-			for (auto sc : hvf.m_SeenCopies)
+			debugmsg("[E] Comparison var was copied from %d assigned-to-constant variables, not 1 as expected\n", seenCopies.size());
+			for (auto sc : seenCopies)
 				debugmsg("\t%s (%d copies)\n", mopt_t_to_string(sc.first->t), sc.second);
 #endif
 			return false;
@@ -496,12 +977,12 @@ bool CFFlattenInfo::GetAssignedAndComparisonVariables(mblock_t *blk)
 		// If only one variable (X) assigned a number in the first block was 
 		// ever copied into the comparison variable, then X is our "assignment"
 		// variable.
-		localOpAssigned = hvf.m_SeenCopies[0].first;
+		localOpAssigned = seenCopies[0].first;
 
 		// Find the number that was assigned to the assignment variable in the
 		// first block.
 		bool bFound = false;
-		for (auto as : fbe.m_SeenAssignments)
+		for (auto as : seenAssignments)
 		{
 			if (equal_mops_ignore_size(*as.first, *localOpAssigned))
 			{
@@ -517,21 +998,28 @@ bool CFFlattenInfo::GetAssignedAndComparisonVariables(mblock_t *blk)
 		}
 	}
 	// Make copies of the comparison and assignment variables so we don't run
-	// into liveness issues
-	this->opCompared = new mop_t(*opMax);
-	this->opAssigned = new mop_t(*localOpAssigned);
+	// into liveness issues. The arena destroys them once we're done with this
+	// function.
+	this->opCompared = m_Arena.New<mop_t>(*opMax);
+	this->opAssigned = m_Arena.New<mop_t>(*localOpAssigned);
 
 	// Extract the key-to-block mapping for each JZ against the comparison
 	// variable
-	JZMapper jzm(opCompared, localOpAssigned, iDispatch, m_KeyToBlock, m_BlockToKey);
-	mba->for_all_topinsns(jzm);
-
-	// Save off the current function's starting EA
-	m_WhichFunc = mba->entry_ea;
-
-	// Compute the dominator information for this function and stash it
-	array_of_bitsets *ab = ComputeDominators(mba);
-	m_DomInfo = ab;
+#if UNFLATTENVERBOSE
+	uint64 tKeys = get_nsec_stamp();
+#endif
+	m_Keys.Reset(mba->qty);
+	MapKeysToBlocks(m_Index, opCompared, localOpAssigned, iDispatch, m_Keys);
+	
+	// Also extract key ranges, in case the dispatcher is a comparison tree,
+	// or the jump table keys, if it's a jump table
+	MapKeyRangesToBlocks(mba, opCompared, localOpAssigned, iDispatch, m_Keys);
+	if (jtbl != NULL)
+		MapJumpTableKeys(jtbl, opCompared, m_Keys);
+	m_Keys.Finalize();
+#if UNFLATTENVERBOSE
+	debugmsg("[I] Indexed %d dispatcher keys, %d key ranges and %d jump table slots in %llu us\n", m_Keys.NumKeys(), m_Keys.NumRanges(), m_Keys.NumDense(), (get_nsec_stamp() - tKeys) / 1000);
+#endif
 	
 	// Compute some more information from the dominators. Basically, once the
 	// control flow dispatch switch has transferred control to the function's 
@@ -541,24 +1029,23 @@ bool CFFlattenInfo::GetAssignedAndComparisonVariables(mblock_t *blk)
 	// i.e., the one targeted by a jump out of the control flow dispatch 
 	// switch.
 	
-	// Allocate an array mapping each basic block to the block that dominates
-	// it and was targeted by the control flow switch.
-	int *DominatedClusters = new int[mba->qty];
-	memset(DominatedClusters, 0xFF, sizeof(int)*mba->qty);
+	// Map each basic block to the block that dominates it and was targeted by
+	// the control flow switch. This is one integer per block.
+	m_DominatedClusters.resize(mba->qty, -1);
 	
-	// For each block/key pair (the targets of the control flow switch)
-	for (auto bk : m_BlockToKey)
+	// Visit the blocks in preorder over the dominator tree, so that each 
+	// block's immediate dominator has been visited before it. A control flow
+	// switch target begins its own cluster; every other block belongs to the
+	// same cluster as its immediate dominator. This is linear in the number 
+	// of blocks.
+	for (auto i : m_DomTree.m_Preorder)
 	{
-		int i = bk.first;
-		// For each block dominated by this control flow switch target, mark 
-		// that this block its the beginning of its cluster.
-		for (auto it = ab->at(i).begin(); it != ab->at(i).end(); ab->at(i).inc(it))
-			DominatedClusters[*it] = i;
+		if (m_Keys.HasKey(i))
+			m_DominatedClusters[i] = i;
+		else if (m_DomTree.m_Idom[i] >= 0)
+			m_DominatedClusters[i] = m_DominatedClusters[m_DomTree.m_Idom[i]];
 	}
 	
-	// Save that information off.
-	m_DominatedClusters = DominatedClusters;
-	
 	// Ready to go!
 	return true;
 }
@@ -1,55 +1,236 @@
 #pragma once
 #include <hexrays.hpp>
+#include "Arena.hpp"
+#include "DominatorTree.hpp"
+
+// A function must compare its dispatch variable against at least this many
+// constants, whose proportion of 1-bits is within these bounds, to be
+// considered obfuscated.
+#define MIN_NUM_COMPARISONS 2
+#define MIN_KEY_ENTROPY 0.4
+#define MAX_KEY_ENTROPY 0.6
 
 struct JZInfo
 {
-	JZInfo() : op(NULL) {};
+	JZInfo(Arena *arena = NULL) : op(NULL), nSeen(0), nums(arena), blocks(arena) {};
 
 	mop_t *op;
 	int nSeen;
-	std::vector<mop_t *> nums;
+	ArenaVector<mop_t *> nums;
+	ArenaVector<int> blocks;
 
+	float ComputeEntropy(int &iNumBits, int &iNumOnes) const;
+	bool LooksLikeDispatchVar() const;
 	bool ShouldBlacklist();
 };
 
+// A compact index of the instructions in a function that the flattening
+// detection cares about: conditional comparisons against constants, 
+// assignments of constants, and copies of one operand into another. Each 
+// entry is just the instruction and the number of the block that contains 
+// it, so the index remains valid until the function's instructions are 
+// modified.
+struct FlattenInsnIndex
+{
+	struct Entry
+	{
+		Entry(minsn_t *i, int b) : ins(i), iBlock(b) {};
+		minsn_t *ins;
+		int iBlock;
+	};
+
+	// jz/jnz/jg/jl/ja/jb/... x, #const
+	ArenaVector<Entry> m_Comparisons;
+	// mov #const, x
+	ArenaVector<Entry> m_NumAssigns;
+	// mov y, x
+	ArenaVector<Entry> m_Copies;
+	// jtbl x, cases
+	ArenaVector<Entry> m_Tables;
+
+	FlattenInsnIndex(Arena *arena = NULL) : m_Comparisons(arena), m_NumAssigns(arena), m_Copies(arena), m_Tables(arena) {};
+
+	void Build(mbl_array_t *mba);
+	void Refresh(mbl_array_t *mba, const std::vector<bool> &dirty);
+	void ScanBlock(mblock_t *mb);
+	void Clear()
+	{
+		m_Comparisons.clear();
+		m_NumAssigns.clear();
+		m_Copies.clear();
+		m_Tables.clear();
+	}
+	void Release()
+	{
+		ArenaRelease(m_Comparisons);
+		ArenaRelease(m_NumAssigns);
+		ArenaRelease(m_Copies);
+		ArenaRelease(m_Tables);
+	}
+};
+
+// Two-way mapping between switch dispatch keys and the blocks that they 
+// select. Keys are kept in a sorted array and looked up by binary search;
+// blocks map to keys through a dense vector indexed by block number. As with
+// the maps this replaced, later insertions win over earlier ones in both 
+// directions. The storage comes from the function's analysis arena.
+//
+// Dispatchers that are compiled into trees of jg/jl-style comparisons select
+// a block for a whole range of keys, rather than for a single key. Those are
+// kept in a second sorted array of disjoint ranges. Single keys take 
+// precedence over ranges.
+//
+// Dispatchers that are jump tables usually have densely-packed keys. If so,
+// the keys are stored in an array indexed by the key minus the lowest key,
+// which is consulted before anything else.
+struct KeyBlockIndex
+{
+	struct KeyRange
+	{
+		KeyRange(uint64 l, uint64 h, int b) : lo(l), hi(h), iBlock(b) {};
+		uint64 lo, hi;
+		int iBlock;
+	};
+
+	// (key, block) pairs; sorted by key and unique once Finalize() is called
+	ArenaVector<std::pair<uint64, int> > m_Keys;
+	
+	// Key ranges; sorted by lower bound once Finalize() is called.
+	ArenaVector<KeyRange> m_Ranges;
+	
+	// Block for each key from m_DenseBase onwards, or -1 if there is none
+	uint64 m_DenseBase;
+	ArenaVector<int> m_DenseBlocks;
+	
+	// Keys are masked to the size of the comparison variable before looking 
+	// them up in the ranges or the dense array.
+	uint64 m_KeyMask;
+	
+	// The key (or lowest key in the range) for each block, and whether each 
+	// block has one
+	ArenaVector<uint64> m_BlockKeys;
+	ArenaVector<bool> m_BlockHasKey;
+
+	KeyBlockIndex(Arena *arena = NULL) : m_Keys(arena), m_Ranges(arena), m_DenseBlocks(arena), m_BlockKeys(arena), m_BlockHasKey(arena) { Reset(0); };
+
+	void Reset(int nBlocks)
+	{
+		m_Keys.clear();
+		m_Ranges.clear();
+		m_DenseBase = 0;
+		m_DenseBlocks.clear();
+		m_KeyMask = ~0ULL;
+		m_BlockKeys.assign(nBlocks, 0);
+		m_BlockHasKey.assign(nBlocks, false);
+	}
+	void Release()
+	{
+		Reset(0);
+		ArenaRelease(m_Keys);
+		ArenaRelease(m_Ranges);
+		ArenaRelease(m_DenseBlocks);
+		ArenaRelease(m_BlockKeys);
+		ArenaRelease(m_BlockHasKey);
+	}
+	void Insert(uint64 key, int iBlock)
+	{
+		m_Keys.push_back(std::pair<uint64, int>(key, iBlock));
+		m_BlockKeys[iBlock] = key;
+		m_BlockHasKey[iBlock] = true;
+	}
+	void InsertRange(uint64 lo, uint64 hi, int iBlock)
+	{
+		m_Ranges.push_back(KeyRange(lo, hi, iBlock));
+		m_BlockKeys[iBlock] = lo;
+		m_BlockHasKey[iBlock] = true;
+	}
+	void InsertTable(const ArenaVector<std::pair<uint64, int> > &cases);
+	void Finalize();
+	int FindBlock(uint64 key) const;
+	bool HasKey(int iBlock) const { return iBlock >= 0 && iBlock < m_BlockHasKey.size() && m_BlockHasKey[iBlock]; }
+	int NumKeys() const { return m_Keys.size(); }
+	int NumRanges() const { return m_Ranges.size(); }
+	int NumDense() const { return m_DenseBlocks.size(); }
+};
+
+// A control flow flattening dispatcher within a function. Functions may 
+// contain several of them, either one after another or nested inside of one
+// another's flattened regions.
+struct DispatcherCandidate
+{
+	// The block where the dispatcher begins, and the one that enters it
+	int iDispatch;
+	int iFirst;
+	
+	// The block ending in the jtbl instruction, if it's a jump table
+	int iJumpTable;
+	
+	// Depth of iDispatch in the dominator tree
+	int iDepth;
+	
+	// The variable compared against the keys
+	mop_t opCompared;
+};
+
 struct CFFlattenInfo
 {
+	// Owns all of the analysis data for the current function, and is reset
+	// each time a new function is analyzed. It's declared first so that it's
+	// constructed before, and destroyed after, the containers that use it.
+	Arena m_Arena;
+
+	// These are allocated from the arena, and destroyed when it's reset
 	mop_t *opAssigned, *opCompared;
 	uint64 uFirst;
 	int iFirst, iDispatch;
-	std::map<uint64, int> m_KeyToBlock;
-	std::map<int, uint64> m_BlockToKey;
+	KeyBlockIndex m_Keys;
 	ea_t m_WhichFunc;
-	array_of_bitsets *m_DomInfo;
-	int *m_DominatedClusters;
+	DominatorTree m_DomTree;
+	ArenaVector<int> m_DominatedClusters;
+	FlattenInsnIndex m_Index;
+	
+	// Number of operand comparisons that hashing saved during detection
+	int m_nComparisonsAvoided;
 
 	int FindBlockByKey(uint64 key);
-	void Clear(bool bFree)
+	
+	// Clear the information about the current dispatcher, but not the 
+	// information shared by all dispatchers in the function
+	void ClearDispatcher()
 	{
-		if (bFree && opAssigned != NULL)
-			delete opAssigned;
 		opAssigned = NULL;
-
-		if (bFree && opCompared != NULL)
-			delete opCompared;
 		opCompared = NULL;
 
 		iFirst = -1;
 		iDispatch = -1;
 		uFirst = 0LL;
+		m_DominatedClusters.clear();
+		m_Keys.Reset(0);
+	}
+	
+	// Clear everything. If bFree is set, also give all of the memory back to
+	// the arena and destroy the objects allocated from it. 
+	void Clear(bool bFree)
+	{
+		ClearDispatcher();
 		m_WhichFunc = BADADDR;
-		if (bFree && m_DomInfo != NULL)
-			delete m_DomInfo;
-		m_DomInfo = NULL;
-
-		if (bFree && m_DominatedClusters != NULL)
-			delete m_DominatedClusters;
-		m_DominatedClusters = NULL;
-
-		m_KeyToBlock.clear();
-		m_BlockToKey.clear();
+		m_nComparisonsAvoided = 0;
+		m_DomTree.Release();
+		m_Index.Release();
+		m_Keys.Release();
+		ArenaRelease(m_DominatedClusters);
+		if (bFree)
+			m_Arena.Reset();
 	};
-	CFFlattenInfo() { Clear(false); }
+	CFFlattenInfo() : 
+		m_Keys(&m_Arena), 
+		m_DomTree(&m_Arena), 
+		m_DominatedClusters(&m_Arena), 
+		m_Index(&m_Arena) 
+	{ 
+		Clear(false); 
+	}
 	~CFFlattenInfo() { Clear(true); }
-	bool GetAssignedAndComparisonVariables(mblock_t *blk);
+	bool FindDispatchers(mbl_array_t *mba, std::vector<DispatcherCandidate> &dispatchers);
+	bool AnalyzeDispatcher(mbl_array_t *mba, const DispatcherCandidate &dc);
 };
@@ -5,3 +5,68 @@
 #define OPTVERBOSE 0
 #define UNFLATTENVERBOSE 0
 #define UNFLATTENDEBUG 0
+#define DOMVERIFY 0
+#define CLASSIFYVERBOSE 0
+
+// Predecessors of a dispatcher that can't be resolved at MMAT_LOCOPT are 
+// retried after local optimization, and at later maturity levels up to this
+// one. Retrying stops after this many rounds, this much time, or after 
+// rounds that have looked at this many instructions in total, whichever 
+// comes first.
+#define UNFLATTEN_LAST_MATURITY MMAT_GLBOPT1
+#define UNFLATTEN_MAX_ROUNDS 8
+#define UNFLATTEN_BUDGET_MS 5000
+#define UNFLATTEN_BUDGET_INSNS 2000000
+
+// Per-function budgets for each pass, per decompilation. A pass that spends
+// more than GOVERNOR_BUDGET_MS, or looks at more than GOVERNOR_BUDGET_INSNS
+// instructions, switches to a cheaper mode; one that spends more than 
+// GOVERNOR_SKIP_MS stops working on the function. Functions that went over
+// budget start out in the cheaper mode the next time they're decompiled, and
+// are skipped once they've done so GOVERNOR_SKIP_STRIKES times.
+#define GOVERNOR_BUDGET_MS 2000
+#define GOVERNOR_BUDGET_INSNS 5000000
+#define GOVERNOR_SKIP_MS 10000
+#define GOVERNOR_SKIP_STRIKES 3
+
+// Fold the chains of straight-line blocks left behind by unflattening into
+// single blocks
+#define MERGE_BLOCK_CHAINS 1
+
+// Remove writes to registers and stack variables that are never read, once
+// unflattening is done. At most DSE_MAX_VARS distinct destinations are 
+// considered, and the analysis is repeated at most DSE_MAX_ROUNDS times.
+#define DEAD_STORE_ELIM 1
+#define DSE_MAX_VARS 8192
+#define DSE_MAX_ROUNDS 4
+
+// Remember what the unflattener did to each function, and do the same again
+// without any analysis when the function is decompiled again and its 
+// microcode hasn't changed
+#define PLAN_CACHE 1
+
+// Time each phase of the deobfuscation passes, per function and maturity
+// level, for exporting from the plugin
+#define PHASE_TIMERS 1
+
+// When unflattening an if-statement, the instructions shared by both of its
+// paths are copied onto one path if there are at most this many of them, and
+// otherwise kept in place with a branch after them
+#define TWOWAY_COPY_MAX_INSNS 4
+
+// Bounds on what's remembered about functions for the rest of the session: 
+// the governor's history holds at most SESSION_MAX_FUNCTIONS functions, and 
+// at most SESSION_MAX_XFORMS transformations are blacklisted. Past that, the
+// oldest entries are forgotten, which only costs the time to learn them 
+// again. (The flattening verdicts are stored in the IDB, and hold at most one
+// entry per function in it.) The plan cache holds the unflattener's work for
+// the SESSION_MAX_PLANS functions used most recently, and the phase timers
+// for the SESSION_MAX_TIMINGS most recent. Per-decompilation
+// state is normally freed when the decompilation finishes; at most 
+// SESSION_MAX_DECOMPILATIONS are kept, for decompilations that failed 
+// before they could be cleaned up after.
+#define SESSION_MAX_FUNCTIONS 65536
+#define SESSION_MAX_XFORMS 4096
+#define SESSION_MAX_PLANS 1024
+#define SESSION_MAX_TIMINGS 1024
+#define SESSION_MAX_DECOMPILATIONS 64
@@ -0,0 +1,463 @@
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <hexrays.hpp>
+#include "HexRaysUtil.hpp"
+#include "DeadStoreElim.hpp"
+#include "PhaseTimer.hpp"
+#include "Config.hpp"
+
+static int debugmsg(const char *fmt, ...)
+{
+#if UNFLATTENVERBOSE
+	va_list va;
+	va_start(va, fmt);
+	return vmsg(fmt, va);
+#endif
+	return 0;
+}
+
+// The registers and stack variables that are the destinations of removable
+// instructions, each of which gets a bit in the liveness sets. Registers and
+// stack variables are both byte ranges, in separate spaces, so uses of
+// partially-overlapping locations can be found by looking up their ranges.
+struct DSEVar
+{
+	int iSpace;
+	sval_t start;
+	int size;
+	bool bEscaped;
+};
+
+struct DSEVarTable
+{
+	enum { SPACE_REG, SPACE_STACK, NUM_SPACES };
+
+	std::vector<DSEVar> m_Vars;
+	std::map<std::tuple<int, sval_t, int>, int> m_Exact;
+	std::vector<int> m_ByStart[NUM_SPACES];
+	int m_MaxSize[NUM_SPACES];
+
+	static bool GetExtent(const mop_t &op, int &iSpace, sval_t &start, int &size)
+	{
+		if (op.t == mop_r)
+		{
+			iSpace = SPACE_REG;
+			start = op.r;
+		}
+		else if (op.t == mop_S)
+		{
+			iSpace = SPACE_STACK;
+			start = op.s->off;
+		}
+		else
+			return false;
+		size = op.size > 0 ? op.size : 1;
+		return true;
+	}
+
+	void Intern(const mop_t &op)
+	{
+		DSEVar v;
+		if (!GetExtent(op, v.iSpace, v.start, v.size))
+			return;
+		auto key = std::make_tuple(v.iSpace, v.start, v.size);
+		if (m_Exact.find(key) != m_Exact.end())
+			return;
+		v.bEscaped = false;
+		m_Exact[key] = m_Vars.size();
+		m_Vars.push_back(v);
+	}
+
+	int Find(const mop_t &op) const
+	{
+		int iSpace, size;
+		sval_t start;
+		if (!GetExtent(op, iSpace, start, size))
+			return -1;
+		auto it = m_Exact.find(std::make_tuple(iSpace, start, size));
+		return it == m_Exact.end() ? -1 : it->second;
+	}
+
+	// Sort the variables by where they start, once they've all been added
+	void Finish()
+	{
+		for (int s = 0; s < NUM_SPACES; ++s)
+		{
+			m_ByStart[s].clear();
+			m_MaxSize[s] = 0;
+		}
+		for (int i = 0; i < m_Vars.size(); ++i)
+		{
+			const DSEVar &v = m_Vars[i];
+			m_ByStart[v.iSpace].push_back(i);
+			m_MaxSize[v.iSpace] = std::max(m_MaxSize[v.iSpace], v.size);
+		}
+		for (int s = 0; s < NUM_SPACES; ++s)
+		{
+			std::sort(m_ByStart[s].begin(), m_ByStart[s].end(), [this](int a, int b)
+			{
+				return m_Vars[a].start < m_Vars[b].start;
+			});
+		}
+	}
+
+	// Call fn(i) for every variable i that overlaps the location op
+	template <typename F>
+	void ForEachOverlap(const mop_t &op, F fn) const
+	{
+		int iSpace, size;
+		sval_t start;
+		if (!GetExtent(op, iSpace, start, size))
+			return;
+		const std::vector<int> &byStart = m_ByStart[iSpace];
+		sval_t lo = start - m_MaxSize[iSpace];
+		auto it = std::lower_bound(byStart.begin(), byStart.end(), lo, [this](int a, sval_t v)
+		{
+			return m_Vars[a].start < v;
+		});
+		for (; it != byStart.end() && m_Vars[*it].start < start + size; ++it)
+		{
+			const DSEVar &v = m_Vars[*it];
+			if (v.start + v.size > start)
+				fn(*it);
+		}
+	}
+};
+
+// Sets of variables, one bit each
+typedef std::vector<uint64> LiveBits;
+
+static inline void SetLiveBit(LiveBits &bits, int i)
+{
+	bits[i >> 6] |= 1ULL << (i & 63);
+}
+
+static inline void ClearLiveBit(LiveBits &bits, int i)
+{
+	bits[i >> 6] &= ~(1ULL << (i & 63));
+}
+
+static inline bool HasLiveBit(const LiveBits &bits, int i)
+{
+	return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+// Instructions that might read anything at all, as far as we can tell. Calls
+// haven't been analyzed yet at the maturity levels that we run at, so we
+// don't know which registers and memory they use.
+static bool ReadsEverything(const minsn_t *ins)
+{
+	switch (ins->opcode)
+	{
+		case m_call:
+		case m_icall:
+		case m_ext:
+		case m_ijmp:
+		case m_ret:
+		case m_push:
+		case m_pop:
+			return true;
+	}
+	return false;
+}
+
+// Is the top-level instruction something we could delete if nothing reads
+// what it writes? Assertions don't actually write anything, so they're
+// neither removable, nor do they overwrite anything.
+static bool WritesTrackedDest(const minsn_t *ins)
+{
+	if (ins->opcode == m_nop || ins->opcode == m_und || ReadsEverything(ins))
+		return false;
+	if (ins->d.t != mop_r && ins->d.t != mop_S)
+		return false;
+	return ins->modifies_d() && !ins->is_assert();
+}
+
+static bool IsRemovable(const minsn_t *ins)
+{
+	return WritesTrackedDest(ins) && !ins->has_side_effects(true) && !ins->contains_call(true);
+}
+
+// What one instruction reads: the tracked variables that overlap its
+// operands, plus whether it reads everything, or all of the stack (as loads
+// through pointers might).
+struct DSEUses
+{
+	const DSEVarTable &m_Vars;
+	std::vector<int> m_Uses;
+	bool m_bAll;
+	bool m_bAllStack;
+
+	DSEUses(const DSEVarTable &vars) : m_Vars(vars) {}
+
+	void Collect(const minsn_t *ins)
+	{
+		m_Uses.clear();
+		m_bAll = false;
+		m_bAllStack = false;
+		CollectInsn(ins, true);
+	}
+
+	void CollectInsn(const minsn_t *ins, bool bTop)
+	{
+		if (ReadsEverything(ins))
+			m_bAll = true;
+		if (ins->opcode == m_ldx)
+			m_bAllStack = true;
+		CollectOp(ins->l);
+		CollectOp(ins->r);
+
+		// The destination is read, not written, by stx and jumps
+		if (!bTop || !ins->modifies_d())
+			CollectOp(ins->d);
+	}
+
+	void CollectOp(const mop_t &op)
+	{
+		switch (op.t)
+		{
+			case mop_r:
+			case mop_S:
+				m_Vars.ForEachOverlap(op, [this](int i) { m_Uses.push_back(i); });
+				break;
+			case mop_d:
+				CollectInsn(op.d, false);
+				break;
+			case mop_p:
+				CollectOp(op.pair->lop);
+				CollectOp(op.pair->hop);
+				break;
+			case mop_a:
+				CollectOp(*op.a);
+				break;
+			case mop_f:
+				m_bAll = true;
+				break;
+		}
+	}
+};
+
+// Anything whose address is taken might be read through a pointer later, so
+// never consider it dead.
+static void MarkEscapes(DSEVarTable &vars, const mop_t &op, bool bAddr)
+{
+	switch (op.t)
+	{
+		case mop_r:
+		case mop_S:
+			if (bAddr)
+				vars.ForEachOverlap(op, [&vars](int i) { vars.m_Vars[i].bEscaped = true; });
+			break;
+		case mop_d:
+			MarkEscapes(vars, op.d->l, false);
+			MarkEscapes(vars, op.d->r, false);
+			MarkEscapes(vars, op.d->d, false);
+			break;
+		case mop_p:
+			MarkEscapes(vars, op.pair->lop, bAddr);
+			MarkEscapes(vars, op.pair->hop, bAddr);
+			break;
+		case mop_a:
+			MarkEscapes(vars, *op.a, true);
+			break;
+	}
+}
+
+// One round of liveness analysis and removal. Returns the number of
+// instructions removed.
+static int EliminateDeadStoresOnce(mbl_array_t *mba, const intvec_t &rpo, DeadStoreStats &stats, EditJournal *journal)
+{
+	// Find the variables written by removable instructions
+	DSEVarTable vars;
+	for (int i = 0; i < mba->qty && vars.m_Vars.size() < DSE_MAX_VARS; ++i)
+		for (minsn_t *ins = mba->get_mblock(i)->head; ins != NULL; ins = ins->next)
+			if (IsRemovable(ins))
+				vars.Intern(ins->d);
+	int nVars = vars.m_Vars.size();
+	if (nVars == 0)
+		return 0;
+	vars.Finish();
+
+	for (int i = 0; i < mba->qty; ++i)
+	{
+		for (minsn_t *ins = mba->get_mblock(i)->head; ins != NULL; ins = ins->next)
+		{
+			MarkEscapes(vars, ins->l, false);
+			MarkEscapes(vars, ins->r, false);
+			MarkEscapes(vars, ins->d, false);
+		}
+	}
+
+	int nWords = (nVars + 63) / 64;
+	LiveBits allVars(nWords, ~0ULL), stackVars(nWords, 0);
+	if (nVars & 63)
+		allVars[nWords - 1] = (1ULL << (nVars & 63)) - 1;
+	for (int i = 0; i < nVars; ++i)
+		if (vars.m_Vars[i].iSpace == DSEVarTable::SPACE_STACK)
+			SetLiveBit(stackVars, i);
+
+	// On the way out of the function, everything but the local variables
+	// might be read by the caller.
+	LiveBits exitVars = allVars;
+	for (int i = 0; i < nVars; ++i)
+	{
+		const DSEVar &v = vars.m_Vars[i];
+		if (v.iSpace == DSEVarTable::SPACE_STACK && v.start + v.size <= mba->inargoff)
+			ClearLiveBit(exitVars, i);
+	}
+
+	// Summarize each block as the variables it reads before writing them,
+	// and the ones it overwrites.
+	DSEUses uses(vars);
+	std::vector<LiveBits> use(mba->qty, LiveBits(nWords, 0)), def(mba->qty, LiveBits(nWords, 0));
+	for (auto iBlock : rpo)
+	{
+		LiveBits &u = use[iBlock], &d = def[iBlock];
+		for (minsn_t *ins = mba->get_mblock(iBlock)->tail; ins != NULL; ins = ins->prev)
+		{
+			int iDef = WritesTrackedDest(ins) ? vars.Find(ins->d) : -1;
+			if (iDef >= 0)
+			{
+				ClearLiveBit(u, iDef);
+				SetLiveBit(d, iDef);
+			}
+			uses.Collect(ins);
+			if (uses.m_bAll)
+				u = allVars;
+			else if (uses.m_bAllStack)
+				for (int w = 0; w < nWords; ++w)
+					u[w] |= stackVars[w];
+			for (auto i : uses.m_Uses)
+				SetLiveBit(u, i);
+		}
+	}
+
+	// Solve for the variables live at the start of each block, visiting the
+	// blocks in postorder until nothing changes.
+	std::vector<LiveBits> liveIn(mba->qty, LiveBits(nWords, 0));
+	auto LiveOut = [&](mblock_t *mb, LiveBits &out)
+	{
+		if (mb->nsucc() == 0)
+		{
+			out = exitVars;
+			return;
+		}
+		out.assign(nWords, 0);
+		for (auto iSucc : mb->succset)
+			for (int w = 0; w < nWords; ++w)
+				out[w] |= liveIn[iSucc][w];
+	};
+
+	LiveBits out(nWords);
+	bool bChanged = true;
+	while (bChanged)
+	{
+		bChanged = false;
+		for (int i = rpo.size() - 1; i >= 0; --i)
+		{
+			int iBlock = rpo[i];
+			LiveOut(mba->get_mblock(iBlock), out);
+			LiveBits &in = liveIn[iBlock];
+			for (int w = 0; w < nWords; ++w)
+			{
+				uint64 v = use[iBlock][w] | (out[w] & ~def[iBlock][w]);
+				if (v != in[w])
+				{
+					in[w] = v;
+					bChanged = true;
+				}
+			}
+		}
+		++stats.nPasses;
+	}
+
+	// Walk backwards through each block, removing the writes to variables
+	// that aren't live afterwards. Removing one can make the writes that
+	// fed it dead too, which is picked up right away within the block.
+	int nRemoved = 0;
+	for (auto iBlock : rpo)
+	{
+		mblock_t *mb = mba->get_mblock(iBlock);
+		LiveBits live(nWords);
+		LiveOut(mb, live);
+		bool bRemoved = false;
+		for (minsn_t *ins = mb->tail, *prev; ins != NULL; ins = prev)
+		{
+			prev = ins->prev;
+			int iDef = WritesTrackedDest(ins) ? vars.Find(ins->d) : -1;
+			if (iDef >= 0 && !HasLiveBit(live, iDef) && !vars.m_Vars[iDef].bEscaped && IsRemovable(ins))
+			{
+#if UNFLATTENVERBOSE
+				qstring qs;
+				ins->print(&qs);
+				tag_remove(&qs);
+				debugmsg("[I] Dead store %a: %s\n", ins->ea, qs.c_str());
+#endif
+				if (journal != NULL)
+					journal->SaveInsn(mb, ins);
+				mb->make_nop(ins);
+				bRemoved = true;
+				++nRemoved;
+				continue;
+			}
+			if (iDef >= 0)
+				ClearLiveBit(live, iDef);
+			uses.Collect(ins);
+			if (uses.m_bAll)
+				live = allVars;
+			else if (uses.m_bAllStack)
+				for (int w = 0; w < nWords; ++w)
+					live[w] |= stackVars[w];
+			for (auto i : uses.m_Uses)
+				SetLiveBit(live, i);
+		}
+		if (bRemoved)
+			mb->mark_lists_dirty();
+	}
+
+	stats.nVars += nVars;
+	for (auto &v : vars.m_Vars)
+		if (v.bEscaped)
+			++stats.nEscaped;
+	return nRemoved;
+}
+
+// Remove every instruction that writes a register or stack variable which is
+// never read afterwards, and has no other effect. After unflattening, that
+// covers most of the writes to the state variables, along with the junk
+// computations that the obfuscator mixed in with them. Removing some writes
+// can make others dead, so this repeats a few times, as long as it finds
+// something to remove.
+int EliminateDeadStores(mbl_array_t *mba, DeadStoreStats *stats, EditJournal *journal)
+{
+	PhaseTimer timer(PH_DEAD_STORES);
+	DeadStoreStats localStats;
+	if (stats == NULL)
+		stats = &localStats;
+	*stats = DeadStoreStats();
+	uint64 nsStart = get_nsec_stamp();
+
+	intvec_t rpo;
+	ComputeRPO(mba, rpo);
+
+	for (int i = 0; i < DSE_MAX_ROUNDS; ++i)
+	{
+		int nRemoved = EliminateDeadStoresOnce(mba, rpo, *stats, journal);
+		stats->nRemoved += nRemoved;
+		if (nRemoved == 0)
+			break;
+	}
+
+	if (stats->nRemoved != 0)
+	{
+#if IDA_SDK_VERSION == 710
+		mba->make_chains_dirty();
+#elif IDA_SDK_VERSION >= 720
+		mba->mark_chains_dirty();
+#endif
+	}
+
+	stats->nsElapsed = get_nsec_stamp() - nsStart;
+	return stats->nRemoved;
+}
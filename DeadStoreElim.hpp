@@ -0,0 +1,18 @@
+#pragma once
+#include <hexrays.hpp>
+#include "EditJournal.hpp"
+
+// Statistics about one run of EliminateDeadStores
+struct DeadStoreStats
+{
+	int nVars;
+	int nEscaped;
+	int nPasses;
+	int nRemoved;
+	uint64 nsElapsed;
+
+	DeadStoreStats() : nVars(0), nEscaped(0), nPasses(0), nRemoved(0), nsElapsed(0) {}
+};
+
+// The removals are recorded in the journal, if one is given
+int EliminateDeadStores(mbl_array_t *mba, DeadStoreStats *stats = NULL, EditJournal *journal = NULL);
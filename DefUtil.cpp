@@ -68,6 +68,106 @@ minsn_t *my_find_def_forwards(mblock_t *mb, mlist_t &ml, minsn_t *start)
 
 }
 
+// The starting points of a search are keyed on the variable being tracked,
+// which is always a register or a stack variable (see InsertOp).
+bool DefChainCache::MakeKey(mblock_t *blk, const mop_t *op, const minsn_t *start, bool bRecursive, int iBlockStop, Key &key)
+{
+	if (op->t == mop_r)
+		key.value = op->r;
+	else if (op->t == mop_S)
+		key.value = op->s->off;
+	else
+		return false;
+	key.t = op->t;
+	key.size = op->size;
+	key.start = start;
+	key.iBlock = blk->serial;
+	key.iBlockStop = iBlockStop;
+	key.bRecursive = bRecursive;
+	return true;
+}
+
+bool DefChainCache::Lookup(const Key &key, bool bAllowMultiSuccs, Entry &hit)
+{
+	auto it = m_Entries.find(key);
+	if (it == m_Entries.end())
+	{
+		++m_nMisses;
+		return false;
+	}
+
+	// If any of the blocks that were looked at have been modified since, the
+	// entry is no good anymore.
+	Entry &e = it->second;
+	for (auto iBlock : e.walked)
+	{
+		if (iBlock < m_BlockStamps.size() && m_BlockStamps[iBlock] > e.stamp)
+		{
+			m_Entries.erase(it);
+			++m_nStale;
+			++m_nMisses;
+			return false;
+		}
+	}
+
+	// The search might have stopped at, or gone through, a block with more
+	// than one successor, in which case the answer only holds for the same
+	// setting of bAllowMultiSuccs.
+	if (e.bSensitive && e.bAllowMultiSuccs != bAllowMultiSuccs)
+	{
+		++m_nMisses;
+		return false;
+	}
+	++m_nHits;
+	hit = e;
+	return true;
+}
+
+void DefChainCache::Insert(const Key &key, Entry &e)
+{
+	e.stamp = m_nStamp;
+	m_Entries[key] = std::move(e);
+}
+
+void DefChainCache::Invalidate(int iBlock)
+{
+	if (iBlock >= m_BlockStamps.size())
+		m_BlockStamps.resize(iBlock + 1, 0);
+	m_BlockStamps[iBlock] = ++m_nStamp;
+}
+
+void DefChainCache::Flush()
+{
+	m_Entries.clear();
+	m_BlockStamps.clear();
+	m_nStamp = 0;
+}
+
+// Like Flush, but also give back the memory that the cache has grown into
+void DefChainCache::Release()
+{
+	std::unordered_map<Key, Entry, KeyHash>().swap(m_Entries);
+	std::vector<uint64>().swap(m_BlockStamps);
+	m_nStamp = 0;
+}
+
+size_t DefChainCache::BytesUsed()
+{
+	size_t nBytes = NodeBytes<std::pair<Key, Entry> >(m_Entries.size()) + m_Entries.bucket_count() * sizeof(void *) + m_BlockStamps.capacity() * sizeof(uint64);
+	for (auto &kv : m_Entries)
+		nBytes += kv.second.chain.capacity() * sizeof(MovInfo) + kv.second.walked.capacity() * sizeof(int);
+	return nBytes;
+}
+
+// A point in the search whose outcome will be put in the cache once it's
+// known, along with how much of the chain and the block list came before it.
+struct PendingDef
+{
+	DefChainCache::Key key;
+	size_t iChain;
+	size_t iWalked;
+};
+
 // This function has way too many arguments. Basically, it's a wrapper around
 // my_find_def_backwards from above. It is extended in the following ways:
 // * If my_find_def_backwards identifies a definition of the variable "op"
@@ -81,7 +181,9 @@ minsn_t *my_find_def_forwards(mblock_t *mb, mlist_t &ml, minsn_t *start)
 //   than one successor if bAllowMultiSuccs is false. In any case, it will 
 //   never traverse past the block numbered iBlockStop, if that parameter is
 //   non-negative.
-bool FindNumericDefBackwards(mblock_t *blk, mop_t *op, mop_t *&opNum, MovChain &chain, bool bRecursive, bool bAllowMultiSuccs, int iBlockStop)
+// * If "cache" is non-NULL, every step of the search first checks whether the
+//   rest of it is already known, and afterwards records what happened.
+bool FindNumericDefBackwards(mblock_t *blk, mop_t *op, mop_t *&opNum, MovChain &chain, bool bRecursive, bool bAllowMultiSuccs, int iBlockStop, DefChainCache *cache)
 {
 	mbl_array_t *mba = blk->mba;
 
@@ -91,11 +193,40 @@ bool FindNumericDefBackwards(mblock_t *blk, mop_t *op, mop_t *&opNum, MovChain &
 	if (!InsertOp(blk, ml, op))
 		return false;
 
+	// The blocks we've looked at, and the steps of the search whose outcome
+	// we will remember. iSensitive is the position in "walked" of the last
+	// block at which bAllowMultiSuccs made a difference.
+	std::vector<int> walked;
+	std::vector<PendingDef> pending;
+	int iSensitive = -1;
+	bool bFound = false;
+	walked.push_back(blk->serial);
+
 	// Start from the end of the block. This variable gets updated when a copy
 	// is encountered, so that subsequent searches start from the right place.
 	minsn_t *mStart = NULL;
+	mop_t *opTracked = op;
 	do
 	{
+		// See if we've been here before
+		DefChainCache::Key key;
+		if (cache != NULL && DefChainCache::MakeKey(blk, opTracked, mStart, bRecursive, iBlockStop, key))
+		{
+			DefChainCache::Entry hit;
+			if (cache->Lookup(key, bAllowMultiSuccs, hit))
+			{
+				chain.insert(chain.end(), hit.chain.begin(), hit.chain.end());
+				walked.insert(walked.end(), hit.walked.begin() + 1, hit.walked.end());
+				if (hit.bSensitive)
+					iSensitive = walked.size() - 1;
+				if (hit.bFound)
+					opNum = hit.opNum;
+				bFound = hit.bFound;
+				break;
+			}
+			pending.push_back({ key, chain.size(), walked.size() - 1 });
+		}
+
 		// Told you this function was just a wrapper around 
 		// my_find_def_backwards.
 		minsn_t *mDef = my_find_def_backwards(blk, ml, mStart);
@@ -112,7 +243,7 @@ bool FindNumericDefBackwards(mblock_t *blk, mop_t *op, mop_t *&opNum, MovChain &
 #if UNFLATTENVERBOSE
 				debugmsg("[E] FindNumericDef: found %s\n", buf);
 #endif
-				return false;
+				break;
 			}
 
 			// Now that we found a mov, add it to the chain.
@@ -127,7 +258,8 @@ bool FindNumericDefBackwards(mblock_t *blk, mop_t *op, mop_t *&opNum, MovChain &
 			{
 				// Great! We're done.
 				opNum = &mDef->l;
-				return true;
+				bFound = true;
+				break;
 			}
 
 			// Otherwise, if it was not a numeric assignment, then try to track
@@ -143,11 +275,12 @@ bool FindNumericDefBackwards(mblock_t *blk, mop_t *op, mop_t *&opNum, MovChain &
 			// Try to start tracking the other thing...
 			ml.clear();
 			if (!InsertOp(blk, ml, &mDef->l))
-				return false;
-			
+				break;
+
 			// Resume the search from the assignment instruction we just 
 			// processed.
 			mStart = mDef;
+			opTracked = &mDef->l;
 		}
 
 		// Otherwise, we did not find a definition of the currently-tracked 
@@ -157,27 +290,46 @@ bool FindNumericDefBackwards(mblock_t *blk, mop_t *op, mop_t *&opNum, MovChain &
 			// If recursion was disallowed, or we reached the topmost legal 
 			// block, then quit.
 			if (!bRecursive || blk->serial == iBlockStop)
-				return false;
-			
+				break;
+
 			// If there is more than one predecessor for this block, we don't
 			// know which one to follow, so stop.
 			if (blk->npred() != 1)
-				return false;
-			
+				break;
+
 			// Recurse into sole predecessor block
 			int iPred = blk->pred(0);
 			blk = mba->get_mblock(iPred);
-			
+
 			// If the predecessor has more than one successor, check to see
 			// whether the arguments allow that.
-			if (!bAllowMultiSuccs && blk->nsucc() != 1)
-				return false;
-			
+			if (blk->nsucc() != 1)
+			{
+				iSensitive = walked.size() - 1;
+				if (!bAllowMultiSuccs)
+					break;
+			}
+
 			// Resume the search at the end of the new block.
 			mStart = NULL;
+			walked.push_back(iPred);
 		}
 	} while (true);
-	return false;
+
+	// Remember how each step of the search turned out
+	for (auto &p : pending)
+	{
+		DefChainCache::Entry e;
+		e.bFound = bFound;
+		e.opNum = bFound ? opNum : NULL;
+		e.chain.assign(chain.begin() + p.iChain, chain.end());
+		e.walked.assign(walked.begin() + p.iWalked, walked.end());
+		e.bSensitive = iSensitive >= (int)p.iWalked;
+		e.bAllowMultiSuccs = bAllowMultiSuccs;
+		cache->Insert(p.key, e);
+	}
+
+	return bFound;
 }
 
 // This function finds a numeric definition by searching in the forward 
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <unordered_map>
+#include <vector>
 #include <hexrays.hpp>
+#include "Arena.hpp"
 
 struct MovInfo
 {
@@ -9,7 +12,84 @@ struct MovInfo
 	int iBlock;
 };
 
-typedef std::vector<MovInfo> MovChain;
+typedef ArenaVector<MovInfo> MovChain;
 
-bool FindNumericDefBackwards(mblock_t *blk, mop_t *op, mop_t *&opNum, MovChain &chain, bool bRecursive, bool bAllowMultiSuccs, int iBlockStop = -1);
+// Remembers where FindNumericDefBackwards ended up when it searched from a 
+// given starting point: a block, the variable being tracked, and the 
+// instruction to start before (NULL for the end of the block). Searches for
+// different predecessors of a dispatcher tend to walk through the same blocks
+// looking for the same variables, so later searches can pick up the rest of 
+// the answer from the table instead of scanning the instructions again.
+//
+// Entries remember which blocks they looked at. Call Invalidate when a block's
+// instructions are changed, which makes the entries that looked at it stale,
+// and Flush when the graph's edges change.
+struct DefChainCache
+{
+	struct Key
+	{
+		const minsn_t *start;
+		uint64 value;
+		int iBlock;
+		int iBlockStop;
+		int size;
+		mopt_t t;
+		bool bRecursive;
+		bool operator==(const Key &rhs) const
+		{
+			return start == rhs.start && value == rhs.value && iBlock == rhs.iBlock && iBlockStop == rhs.iBlockStop && size == rhs.size && t == rhs.t && bRecursive == rhs.bRecursive;
+		}
+	};
+	struct KeyHash
+	{
+		size_t operator()(const Key &k) const
+		{
+			uint64 h = (uint64)(size_t)k.start;
+			h = h * 0x9E3779B97F4A7C15ULL ^ k.value;
+			h = h * 0x9E3779B97F4A7C15ULL ^ (((uint64)k.iBlock << 32) | (uint32)k.iBlockStop);
+			h = h * 0x9E3779B97F4A7C15ULL ^ (((uint64)k.size << 16) | ((uint64)k.t << 1) | k.bRecursive);
+			return (size_t)(h ^ (h >> 29));
+		}
+	};
+	struct Entry
+	{
+		bool bFound;
+		mop_t *opNum;
+		std::vector<MovInfo> chain;
+		
+		// The blocks that were looked at, starting with the key's block
+		std::vector<int> walked;
+
+		// Whether the outcome depended on the bAllowMultiSuccs argument, and
+		// if so, what it was
+		bool bSensitive;
+		bool bAllowMultiSuccs;
+		uint64 stamp;
+	};
+
+	std::unordered_map<Key, Entry, KeyHash> m_Entries;
+	std::vector<uint64> m_BlockStamps;
+	uint64 m_nStamp;
+
+	int m_nHits;
+	int m_nMisses;
+	int m_nStale;
+
+	DefChainCache() { Clear(); }
+	static bool MakeKey(mblock_t *blk, const mop_t *op, const minsn_t *start, bool bRecursive, int iBlockStop, Key &key);
+	bool Lookup(const Key &key, bool bAllowMultiSuccs, Entry &hit);
+	void Insert(const Key &key, Entry &e);
+	void Invalidate(int iBlock);
+	void Flush();
+	void Release();
+	size_t BytesUsed();
+	void Clear()
+	{
+		Flush();
+		m_nHits = m_nMisses = m_nStale = 0;
+	}
+};
+
+bool InsertOp(mblock_t *mb, mlist_t &ml, mop_t *op);
+bool FindNumericDefBackwards(mblock_t *blk, mop_t *op, mop_t *&opNum, MovChain &chain, bool bRecursive, bool bAllowMultiSuccs, int iBlockStop = -1, DefChainCache *cache = NULL);
 mop_t *FindForwardStackVarDef(mblock_t *mbClusterHead, mop_t *opCopy, MovChain &chain);
\ No newline at end of file
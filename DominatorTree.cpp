@@ -0,0 +1,355 @@
+#include <vector>
+#include <hexrays.hpp>
+#include "DominatorTree.hpp"
+#include "PhaseTimer.hpp"
+#include "Config.hpp"
+
+static int debugmsg(const char *fmt, ...)
+{
+#if UNFLATTENVERBOSE
+	va_list va;
+	va_start(va, fmt);
+	return vmsg(fmt, va);
+#endif
+	return 0;
+}
+
+// Number the blocks reachable from iRoot in reverse postorder. If "region" is
+// non-NULL, the search does not leave the blocks marked in it. The search is
+// iterative rather than recursive, since flattened functions can have tens of
+// thousands of blocks, and that would be enough to blow the stack.
+void DominatorTree::ComputeReversePostorder(mbl_array_t *mba, int iRoot, const std::vector<bool> *region, intvec_t &rpo)
+{
+	int iNumBlocks = mba->qty;
+	std::vector<bool> visited(iNumBlocks, false);
+	intvec_t postorder;
+
+	// Each stack entry holds a block number and the index of the next
+	// successor of that block that has yet to be explored.
+	std::vector<std::pair<int, int> > stack;
+	stack.push_back(std::pair<int, int>(iRoot, 0));
+	visited[iRoot] = true;
+
+	while (!stack.empty())
+	{
+		std::pair<int, int> &top = stack.back();
+		mblock_t *mb = mba->get_mblock(top.first);
+
+		// If there are unexplored successors, descend into the next one
+		if (top.second < mb->nsucc())
+		{
+			int iSucc = mb->succ(top.second++);
+			if (!visited[iSucc] && (region == NULL || (*region)[iSucc]))
+			{
+				visited[iSucc] = true;
+				stack.push_back(std::pair<int, int>(iSucc, 0));
+			}
+			continue;
+		}
+
+		// Otherwise, every successor is finished, so this block is, too
+		postorder.push_back(top.first);
+		stack.pop_back();
+	}
+
+	// Reverse the postorder, and record each block's position within it
+	rpo.resize(postorder.size());
+	for (size_t i = 0; i < postorder.size(); ++i)
+	{
+		int iBlock = postorder[postorder.size() - 1 - i];
+		rpo[i] = iBlock;
+		m_RPONum[iBlock] = i;
+	}
+}
+
+// Walk up the (partially-computed) dominator tree from two blocks until the
+// paths meet. The result is the nearest common dominator of both blocks.
+int DominatorTree::Intersect(int b1, int b2) const
+{
+	while (b1 != b2)
+	{
+		while (m_RPONum[b1] > m_RPONum[b2])
+			b1 = m_Idom[b1];
+		while (m_RPONum[b2] > m_RPONum[b1])
+			b2 = m_Idom[b2];
+	}
+	return b1;
+}
+
+// The same thing as Intersect, but on a finished tree, where the interval
+// numbering answers dominance queries directly. Both blocks must be
+// reachable.
+int DominatorTree::NearestCommonDominator(int b1, int b2) const
+{
+	while (!Dominates(b1, b2))
+		b1 = m_Idom[b1];
+	return b1;
+}
+
+// Compute the immediate dominators using the algorithm from Cooper, Harvey,
+// and Kennedy's "A Simple, Fast Dominance Algorithm". Each block's immediate
+// dominator is the intersection of its already-processed predecessors. On
+// reducible graphs, visiting blocks in reverse postorder means that this
+// converges after a single pass (plus one more to notice that nothing
+// changed).
+//
+// If "region" is non-NULL, only the blocks marked in it are (re)computed, and
+// iRoot is treated as the root; its own immediate dominator is left alone.
+// The caller is responsible for ensuring that the region is a subtree of the
+// dominator tree, rooted at iRoot.
+void DominatorTree::ComputeIdoms(mbl_array_t *mba, int iRoot, const std::vector<bool> *region)
+{
+	intvec_t rpo;
+	ComputeReversePostorder(mba, iRoot, region, rpo);
+
+	// The root temporarily dominates itself, so that Intersect terminates
+	int iRootIdom = m_Idom[iRoot];
+	m_Idom[iRoot] = iRoot;
+
+	bool bChanged;
+	do
+	{
+		bChanged = false;
+
+		// For every reachable block except the root, in reverse postorder...
+		for (size_t i = 1; i < rpo.size(); ++i)
+		{
+			int iBlock = rpo[i];
+			mblock_t *mb = mba->get_mblock(iBlock);
+
+			// ... intersect the dominators of every predecessor that has
+			// already been assigned one. Unreachable predecessors never are.
+			int iNewIdom = -1;
+			for (auto iPred : mb->predset)
+			{
+				if (m_Idom[iPred] < 0 || (region != NULL && !(*region)[iPred]))
+					continue;
+				iNewIdom = iNewIdom < 0 ? iPred : Intersect(iPred, iNewIdom);
+			}
+
+			if (m_Idom[iBlock] != iNewIdom)
+			{
+				m_Idom[iBlock] = iNewIdom;
+				bChanged = true;
+			}
+		}
+	}
+	while (bChanged);
+
+	m_Idom[iRoot] = iRootIdom;
+	m_nBlocksRecomputed += rpo.size();
+}
+
+// Compute the dominator tree for the whole function from scratch. This
+// replaces the old bitset fixpoint, which needed O(n^2) memory and, on large
+// flattened functions, many passes of O(n^2) work apiece.
+void DominatorTree::Compute(mbl_array_t *mba)
+{
+	PhaseTimer timer(PH_DOMINATORS);
+	int iNumBlocks = mba->qty;
+	assert(iNumBlocks >= 1);
+
+	m_Idom.clear();
+	m_RPONum.clear();
+	m_Idom.resize(iNumBlocks, -1);
+	m_RPONum.resize(iNumBlocks, -1);
+	ComputeIdoms(mba, 0, NULL);
+
+	// Number the tree so that dominance queries take constant time
+	ComputeIntervals();
+	++m_nFullComputations;
+}
+
+// Assign preorder and postorder numbers to each block by walking the
+// dominator tree depth-first from the root. The children of every block are
+// first gathered into one flat array (indexed by per-block offsets), so the
+// walk needs no per-block allocations.
+void DominatorTree::ComputeIntervals()
+{
+	int iNumBlocks = m_Idom.size();
+	m_Pre.clear();
+	m_Post.clear();
+	m_Preorder.clear();
+	m_Pre.resize(iNumBlocks, -1);
+	m_Post.resize(iNumBlocks, -1);
+
+	// Count the children of each block, then turn the counts into offsets
+	intvec_t childStart;
+	childStart.resize(iNumBlocks + 1, 0);
+	for (int i = 0; i < iNumBlocks; ++i)
+		if (m_Idom[i] >= 0)
+			++childStart[m_Idom[i] + 1];
+	for (int i = 0; i < iNumBlocks; ++i)
+		childStart[i + 1] += childStart[i];
+
+	// Fill in the children themselves
+	intvec_t children, fill;
+	children.resize(childStart[iNumBlocks]);
+	fill = childStart;
+	for (int i = 0; i < iNumBlocks; ++i)
+		if (m_Idom[i] >= 0)
+			children[fill[m_Idom[i]]++] = i;
+
+	// Iterative depth-first walk. Each stack entry holds a block number and
+	// the offset of the next child of that block to visit.
+	int iPre = 0, iPost = 0;
+	std::vector<std::pair<int, int> > stack;
+	stack.push_back(std::pair<int, int>(0, childStart[0]));
+	m_Pre[0] = iPre++;
+	m_Preorder.push_back(0);
+
+	while (!stack.empty())
+	{
+		std::pair<int, int> &top = stack.back();
+		if (top.second < childStart[top.first + 1])
+		{
+			int iChild = children[top.second++];
+			m_Pre[iChild] = iPre++;
+			m_Preorder.push_back(iChild);
+			stack.push_back(std::pair<int, int>(iChild, childStart[iChild]));
+			continue;
+		}
+		m_Post[top.first] = iPost++;
+		stack.pop_back();
+	}
+}
+
+// Update the tree after the edges in "removed" and "added" have been removed
+// from and added to the graph (which must already reflect the changes).
+//
+// The key fact is that adding or deleting an edge x->y can only change the
+// immediate dominators of blocks within the dominator subtree rooted at the
+// nearest common dominator of x and y. Furthermore, no edge enters that
+// subtree anywhere but its root. So, we find the nearest common dominator D
+// of all of the modified edges, and recompute the immediate dominators only
+// within D's subtree, treating D as the root.
+//
+// Deleting an edge can also make blocks unreachable, which implicitly deletes
+// their outgoing edges as well; those are handled by widening the subtree.
+// The one thing this can't handle is an added edge that makes a previously
+// unreachable block reachable, since that block is not in any subtree. In
+// that case, we recompute the whole tree. Returns true if the update was
+// performed incrementally.
+bool DominatorTree::ApplyEdits(mbl_array_t *mba, const EdgeVec &removed, const EdgeVec &added)
+{
+	if (!IsValidFor(mba))
+	{
+		Compute(mba);
+		return false;
+	}
+
+	// Find the nearest common dominator of the endpoints of every edit. Edges
+	// leaving unreachable blocks don't matter one way or the other.
+	int iRoot = -1;
+	for (int i = 0; i < 2; ++i)
+	{
+		for (auto e : i == 0 ? removed : added)
+		{
+			if (!IsReachable(e.first))
+				continue;
+			if (!IsReachable(e.second))
+			{
+				// A removed edge into an unreachable block changes nothing,
+				// but an added one makes that block reachable.
+				if (i == 0)
+					continue;
+				debugmsg("[I] Edge %d->%d reaches unreachable block; recomputing dominators\n", e.first, e.second);
+				Compute(mba);
+				return false;
+			}
+			int d = NearestCommonDominator(e.first, e.second);
+			iRoot = iRoot < 0 ? d : NearestCommonDominator(iRoot, d);
+		}
+	}
+
+	// If nothing reachable was touched, there is nothing to do
+	if (iRoot < 0)
+		return true;
+
+	// Recompute the immediate dominators within the affected subtree only.
+	std::vector<bool> region;
+	int nRegion;
+	while (true)
+	{
+		// Mark the blocks in the affected subtree, and forget what we knew 
+		// about them (other than the root of the subtree). The interval 
+		// numbering still describes the tree before the edits.
+		region.assign(m_Idom.size(), false);
+		nRegion = 0;
+		for (int i = 0; i < m_Idom.size(); ++i)
+		{
+			if (!Dominates(iRoot, i))
+				continue;
+			region[i] = true;
+			++nRegion;
+			if (i != iRoot)
+				m_Idom[i] = -1;
+			m_RPONum[i] = -1;
+		}
+
+		// Blocks in the region that are no longer reachable from its root are
+		// no longer reachable at all, and are left without a dominator.
+		ComputeIdoms(mba, iRoot, &region);
+
+		// A block that became unreachable effectively loses its outgoing 
+		// edges, too. Those that leave the region are further deletions that
+		// the region might not account for, so widen the region to include
+		// their targets, and try again.
+		int iNewRoot = iRoot;
+		for (int i = 0; i < m_Idom.size(); ++i)
+		{
+			if (!region[i] || i == iRoot || m_Idom[i] >= 0)
+				continue;
+			for (auto iSucc : mba->get_mblock(i)->succset)
+				if (!region[iSucc] && IsReachable(iSucc))
+					iNewRoot = NearestCommonDominator(iNewRoot, iSucc);
+		}
+		if (iNewRoot == iRoot)
+			break;
+		iRoot = iNewRoot;
+	}
+
+	// Renumber the tree. This is a linear walk over integers, and is cheap
+	// compared to the fixpoint above.
+	ComputeIntervals();
+	++m_nIncrementalUpdates;
+
+#if UNFLATTENVERBOSE
+	debugmsg("[I] Incremental dominator update: %d edits, recomputed subtree of %d with %d/%d blocks\n", removed.size() + added.size(), iRoot, nRegion, mba->qty);
+#endif
+	return true;
+}
+
+// Update the tree after the blocks of the graph have been renumbered, e.g.
+// by mbl_array_t::remove_empty_blocks. oldToNew maps each old block number to
+// its new one, or -1 if the block was removed. If only unreachable blocks
+// were removed, the tree's shape is unchanged, and we can simply renumber it.
+// Otherwise, we recompute it. Returns true if the tree was renumbered.
+bool DominatorTree::RemapBlocks(mbl_array_t *mba, const intvec_t &oldToNew)
+{
+	bool bRemapped = oldToNew.size() == m_Idom.size();
+	for (int i = 0; bRemapped && i < oldToNew.size(); ++i)
+		if (oldToNew[i] < 0 && IsReachable(i))
+			bRemapped = false;
+
+	if (!bRemapped)
+	{
+		Compute(mba);
+		return false;
+	}
+
+	ArenaVector<int> newIdom(m_Idom.get_allocator()), newRPONum(m_RPONum.get_allocator());
+	newIdom.resize(mba->qty, -1);
+	newRPONum.resize(mba->qty, -1);
+	for (int i = 0; i < oldToNew.size(); ++i)
+	{
+		if (oldToNew[i] < 0)
+			continue;
+		newIdom[oldToNew[i]] = m_Idom[i] < 0 ? -1 : oldToNew[m_Idom[i]];
+		newRPONum[oldToNew[i]] = m_RPONum[i];
+	}
+	m_Idom.swap(newIdom);
+	m_RPONum.swap(newRPONum);
+	ComputeIntervals();
+	return true;
+}
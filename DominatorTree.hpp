@@ -0,0 +1,95 @@
+#pragma once
+#include <vector>
+#include <hexrays.hpp>
+#include "Arena.hpp"
+
+// Immediate-dominator tree for an mbl_array_t. Block #0 is the root. Blocks
+// that are unreachable from block #0 have no immediate dominator (-1), and
+// neither does the root itself.
+//
+// In addition to the tree itself, every block gets a preorder and a postorder
+// number from a depth-first walk over the tree. A block A dominates a block B
+// exactly when B's interval lies within A's, so dominance queries are two
+// integer comparisons, and the whole index is O(n) in the number of blocks.
+//
+// The tree can be kept up-to-date as edges are added to and removed from the
+// graph (see ApplyEdits), and as blocks are renumbered (see RemapBlocks),
+// rather than being recomputed from scratch after every modification.
+struct DominatorTree
+{
+	typedef std::vector<std::pair<int, int> > EdgeVec;
+
+	// Immediate dominator of each block
+	ArenaVector<int> m_Idom;
+
+	// Preorder and postorder numbers of each block within the dominator tree
+	// (-1 for unreachable blocks), and the reachable blocks in preorder.
+	ArenaVector<int> m_Pre;
+	ArenaVector<int> m_Post;
+	ArenaVector<int> m_Preorder;
+
+	// Reverse postorder position of each block, as of the last time its
+	// immediate dominator was computed. This is only meaningful for comparing
+	// blocks within a single computation.
+	ArenaVector<int> m_RPONum;
+
+	// Statistics about how the tree has been maintained
+	int m_nFullComputations;
+	int m_nIncrementalUpdates;
+	int m_nBlocksRecomputed;
+
+	DominatorTree(Arena *arena = NULL) : m_Idom(arena), m_Pre(arena), m_Post(arena), m_Preorder(arena), m_RPONum(arena) { Clear(); }
+	void Compute(mbl_array_t *mba);
+	bool ApplyEdits(mbl_array_t *mba, const EdgeVec &removed, const EdgeVec &added);
+	bool RemapBlocks(mbl_array_t *mba, const intvec_t &oldToNew);
+	int Intersect(int b1, int b2) const;
+	int NearestCommonDominator(int b1, int b2) const;
+	bool IsReachable(int iBlock) const { return m_Pre[iBlock] >= 0; }
+	bool IsValidFor(mbl_array_t *mba) const { return !m_Idom.empty() && m_Idom.size() == mba->qty; }
+
+	// Does block a dominate block b? Every block dominates itself.
+	bool Dominates(int a, int b) const
+	{
+		if (m_Pre[a] < 0 || m_Pre[b] < 0)
+			return false;
+		return m_Pre[a] <= m_Pre[b] && m_Post[b] <= m_Post[a];
+	}
+	int NumBlocks() const { return m_Idom.size(); }
+	
+	// Number of strict dominators of a block
+	int Depth(int iBlock) const
+	{
+		int iDepth = 0;
+		for (int i = m_Idom[iBlock]; i >= 0; i = m_Idom[i])
+			++iDepth;
+		return iDepth;
+	}
+	bool operator==(const DominatorTree &rhs) const { return m_Idom == rhs.m_Idom; }
+	void Clear()
+	{
+		m_Idom.clear();
+		m_RPONum.clear();
+		m_Pre.clear();
+		m_Post.clear();
+		m_Preorder.clear();
+		m_nFullComputations = 0;
+		m_nIncrementalUpdates = 0;
+		m_nBlocksRecomputed = 0;
+	}
+	
+	// Give up the storage, which must be done before resetting the arena
+	void Release()
+	{
+		Clear();
+		ArenaRelease(m_Idom);
+		ArenaRelease(m_RPONum);
+		ArenaRelease(m_Pre);
+		ArenaRelease(m_Post);
+		ArenaRelease(m_Preorder);
+	}
+
+private:
+	void ComputeReversePostorder(mbl_array_t *mba, int iRoot, const std::vector<bool> *region, intvec_t &rpo);
+	void ComputeIdoms(mbl_array_t *mba, int iRoot, const std::vector<bool> *region);
+	void ComputeIntervals();
+};
@@ -0,0 +1,273 @@
+#include <set>
+#include <hexrays.hpp>
+#include "HexRaysUtil.hpp"
+#include "EditJournal.hpp"
+#include "PhaseTimer.hpp"
+#include "Config.hpp"
+
+TransformBlackList g_XformBlackList(SESSION_MAX_XFORMS);
+
+static int debugmsg(const char *fmt, ...)
+{
+#if UNFLATTENVERBOSE
+	va_list va;
+	va_start(va, fmt);
+	return vmsg(fmt, va);
+#endif
+	return 0;
+}
+
+static const char *TransformationToString(Transformation xf)
+{
+	switch (xf)
+	{
+		case XF_SINGLE_GOTOS: return "goto-to-goto removal";
+		case XF_DISPATCHER:   return "unflattening of dispatcher";
+		case XF_MERGE_CHAINS: return "block chain merging";
+		case XF_DEAD_STORES:  return "dead store elimination";
+		case XF_PATTERN:      return "pattern rewrite of";
+	}
+	return "?";
+}
+
+void EditJournal::SaveInsn(mblock_t *blk, minsn_t *ins)
+{
+	Entry e;
+	e.iKind = EJ_INSN;
+	e.blk = blk;
+	e.blkFrom = NULL;
+	e.ins = ins;
+	e.other = new minsn_t(*ins);
+	m_Entries.push_back(e);
+}
+
+void EditJournal::SaveBlock(mblock_t *blk)
+{
+	Entry e;
+	e.iKind = EJ_BLOCK;
+	e.blk = blk;
+	e.blkFrom = NULL;
+	e.ins = NULL;
+	e.other = NULL;
+	e.succs = blk->succset;
+	e.preds = blk->predset;
+	e.type = blk->type;
+	e.end = blk->end;
+	m_Entries.push_back(e);
+}
+
+void EditJournal::Inserted(mblock_t *blk, minsn_t *ins)
+{
+	Entry e;
+	e.iKind = EJ_INSERT;
+	e.blk = blk;
+	e.blkFrom = NULL;
+	e.ins = ins;
+	e.other = NULL;
+	m_Entries.push_back(e);
+}
+
+void EditJournal::Removed(mblock_t *blk, minsn_t *ins, minsn_t *prev)
+{
+	Entry e;
+	e.iKind = EJ_REMOVE;
+	e.blk = blk;
+	e.blkFrom = NULL;
+	e.ins = ins;
+	e.other = prev;
+	m_Entries.push_back(e);
+}
+
+void EditJournal::Moved(mblock_t *from, minsn_t *prev, mblock_t *to, minsn_t *ins)
+{
+	Entry e;
+	e.iKind = EJ_MOVE;
+	e.blk = to;
+	e.blkFrom = from;
+	e.ins = ins;
+	e.other = prev;
+	m_Entries.push_back(e);
+}
+
+// The changes are here to stay. Free the saved copies, and the instructions
+// that were removed.
+void EditJournal::Commit()
+{
+	for (auto &e : m_Entries)
+	{
+		if (e.iKind == EJ_INSN)
+			delete e.other;
+		else if (e.iKind == EJ_REMOVE)
+			delete e.ins;
+	}
+	if (!m_Entries.empty())
+		++m_nCommits;
+	m_Entries.clear();
+}
+
+// Undo the changes, newest first, so that each entry sees the mba the way it
+// was right after the change it recorded.
+void EditJournal::Rollback()
+{
+	std::set<mblock_t *> touched;
+	for (auto it = m_Entries.rbegin(); it != m_Entries.rend(); ++it)
+	{
+		Entry &e = *it;
+		touched.insert(e.blk);
+		switch (e.iKind)
+		{
+			// swap leaves the instruction's links alone
+			case EJ_INSN:
+				e.ins->swap(*e.other);
+				delete e.other;
+				break;
+			case EJ_INSERT:
+				e.blk->remove_from_block(e.ins);
+				delete e.ins;
+				break;
+			case EJ_REMOVE:
+				e.blk->insert_into_block(e.ins, e.other);
+				break;
+			case EJ_MOVE:
+				e.blk->remove_from_block(e.ins);
+				e.blkFrom->insert_into_block(e.ins, e.other);
+				touched.insert(e.blkFrom);
+				break;
+			case EJ_BLOCK:
+				e.blk->succset = e.succs;
+				e.blk->predset = e.preds;
+				e.blk->type = (mblock_type_t)e.type;
+				e.blk->end = e.end;
+				break;
+		}
+	}
+	m_Entries.clear();
+	++m_nRollbacks;
+
+	for (auto blk : touched)
+		blk->mark_lists_dirty();
+	if (!touched.empty())
+	{
+		mbl_array_t *mba = (*touched.begin())->mba;
+#if IDA_SDK_VERSION == 710
+		mba->make_chains_dirty();
+#elif IDA_SDK_VERSION >= 720
+		mba->mark_chains_dirty();
+#endif
+	}
+}
+
+// The block that a block falls through to, skipping over the ones that are
+// about to be removed if bSkipDetached is true
+static int NextBlock(mbl_array_t *mba, int iBlock, bool bSkipDetached)
+{
+	int iNext = iBlock + 1;
+	while (bSkipDetached && iNext < mba->qty)
+	{
+		mblock_t *blk = mba->get_mblock(iNext);
+		if (blk->head != NULL || blk->nsucc() != 0 || blk->npred() != 0)
+			break;
+		++iNext;
+	}
+	return iNext;
+}
+
+bool CheckGraphStructure(mbl_array_t *mba, bool bSkipDetached)
+{
+	for (int i = 0; i < mba->qty; ++i)
+	{
+		mblock_t *blk = mba->get_mblock(i);
+		if (bSkipDetached && blk->head == NULL && blk->nsucc() == 0 && blk->npred() == 0)
+			continue;
+
+		// Every edge has to be recorded at both of its ends
+		for (auto iSucc : blk->succset)
+		{
+			if (iSucc < 0 || iSucc >= mba->qty || !mba->get_mblock(iSucc)->predset.has(i))
+			{
+				debugmsg("[E] Block %d has successor %d, which doesn't have it as a predecessor\n", i, iSucc);
+				return false;
+			}
+		}
+		for (auto iPred : blk->predset)
+		{
+			if (iPred < 0 || iPred >= mba->qty || !mba->get_mblock(iPred)->succset.has(i))
+			{
+				debugmsg("[E] Block %d has predecessor %d, which doesn't have it as a successor\n", i, iPred);
+				return false;
+			}
+		}
+
+		// The instruction at the end of the block has to agree with the
+		// successors
+		minsn_t *tail = blk->tail;
+		int iNext = NextBlock(mba, i, bSkipDetached);
+		bool bOk = true;
+		if (tail != NULL && tail->opcode == m_goto && tail->l.t == mop_b)
+			bOk = blk->nsucc() == 1 && blk->succ(0) == tail->l.b;
+		else if (tail != NULL && is_mcode_jcond(tail->opcode))
+		{
+			bOk = tail->d.t == mop_b && blk->succset.has(tail->d.b) && blk->nsucc() <= 2;
+			if (bOk && blk->nsucc() == 2)
+				bOk = blk->succset.has(iNext);
+		}
+		else if (tail != NULL && tail->opcode == m_jtbl)
+		{
+			bOk = tail->r.t == mop_c;
+			if (bOk)
+				for (auto iTarget : tail->r.c->targets)
+					bOk &= (bool)blk->succset.has(iTarget);
+		}
+		else if (blk->type == BLT_1WAY && (tail == NULL || (tail->opcode != m_goto && tail->opcode != m_ijmp)))
+			bOk = blk->nsucc() == 1 && blk->succ(0) == iNext;
+
+		if (!bOk)
+		{
+			debugmsg("[E] The instruction at the end of block %d doesn't match its %d successors\n", i, blk->nsucc());
+			return false;
+		}
+	}
+	return true;
+}
+
+bool VerifyNoThrow(mbl_array_t *mba)
+{
+	PhaseTimer timer(PH_VERIFY);
+	try
+	{
+		mba->verify(true);
+	}
+	catch (const vd_failure_t &e)
+	{
+		msg("[E] %a: verification failed: %s\n", mba->entry_ea, e.hf.desc().c_str());
+		return false;
+	}
+	return true;
+}
+
+// This is reported in the output window, since it changes what the user sees
+void BlacklistTransformation(mbl_array_t *mba, Transformation xf, ea_t where)
+{
+	g_XformBlackList.Insert(mba->entry_ea, xf, where);
+	if (where != BADADDR)
+		msg("[E] %a: %s %a broke the graph; undid it, and blacklisted it for this function\n", mba->entry_ea, TransformationToString(xf), where);
+	else
+		msg("[E] %a: %s broke the graph; undid it, and blacklisted it for this function\n", mba->entry_ea, TransformationToString(xf));
+}
+
+bool CommitOrRollback(mbl_array_t *mba, EditJournal &journal, bool bVerify, Transformation xf, ea_t where)
+{
+	if (journal.Empty())
+		return true;
+
+	if (CheckGraphStructure(mba) && (!bVerify || VerifyNoThrow(mba)))
+	{
+		journal.Commit();
+		return true;
+	}
+
+	// Put things back the way they were, and don't try this again
+	journal.Rollback();
+	BlacklistTransformation(mba, xf, where);
+	return false;
+}
@@ -0,0 +1,148 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <set>
+#include <shared_mutex>
+#include <tuple>
+#include <vector>
+#include <hexrays.hpp>
+#include "HexRaysUtil.hpp"
+
+// Records every change that a transformation makes to an mba, so that they
+// can all be undone if the result turns out to be broken. Call the methods
+// below around each change: SaveInsn and SaveBlock before modifying an
+// instruction or a block's edges in place, and the others after inserting,
+// removing or moving an instruction. Removed instructions are kept alive
+// until Commit, which also throws the saved copies away. Rollback restores
+// everything in the reverse order, and leaves the journal empty.
+//
+// Instructions stay at the same addresses throughout, so anything that
+// points at them (such as erasure chains) is still valid after a rollback.
+// Blocks can't be renumbered within a transaction, so remove_empty_blocks
+// has to wait until it has been committed.
+struct EditJournal
+{
+	enum { EJ_INSN, EJ_INSERT, EJ_REMOVE, EJ_MOVE, EJ_BLOCK };
+	struct Entry
+	{
+		int iKind;
+		mblock_t *blk;
+
+		// EJ_MOVE: the block the instruction was moved out of
+		mblock_t *blkFrom;
+		minsn_t *ins;
+
+		// EJ_INSN: the saved copy. EJ_REMOVE and EJ_MOVE: the instruction
+		// that preceded it.
+		minsn_t *other;
+
+		// EJ_BLOCK: the saved edges, type and end address
+		intvec_t succs;
+		intvec_t preds;
+		int type;
+		ea_t end;
+	};
+
+	std::vector<Entry> m_Entries;
+	int m_nCommits;
+	int m_nRollbacks;
+
+	EditJournal() : m_nCommits(0), m_nRollbacks(0) {};
+	~EditJournal() { Commit(); }
+	void SaveInsn(mblock_t *blk, minsn_t *ins);
+	void SaveBlock(mblock_t *blk);
+	void Inserted(mblock_t *blk, minsn_t *ins);
+	void Removed(mblock_t *blk, minsn_t *ins, minsn_t *prev);
+	void Moved(mblock_t *from, minsn_t *prev, mblock_t *to, minsn_t *ins);
+	bool Empty() const { return m_Entries.empty(); }
+	size_t BytesUsed() const { return m_Entries.capacity() * sizeof(Entry); }
+	void Release() { Commit(); std::vector<Entry>().swap(m_Entries); }
+	void Commit();
+	void Rollback();
+};
+
+// The transformations that can be blacklisted individually when they break a
+// function. For some, the blacklist also records where they went wrong,
+// e.g., the dispatcher block's address; the others use BADADDR.
+enum Transformation
+{
+	XF_SINGLE_GOTOS,
+	XF_DISPATCHER,
+	XF_MERGE_CHAINS,
+	XF_DEAD_STORES,
+	XF_PATTERN,
+};
+
+// The transformations that were rolled back, which aren't tried again on the
+// same function. Lookups are made for every instruction the pattern
+// optimizer sees, so they don't take the lock while the set is empty. If nMax
+// is non-zero, the oldest entries are forgotten to keep it to that size; a 
+// forgotten transformation is just tried, and undone, again.
+struct TransformBlackList
+{
+	typedef std::tuple<ea_t, int, ea_t> Key;
+
+	TransformBlackList(size_t nMax = 0) : m_nEntries(0), m_nMax(nMax) {};
+	bool Has(ea_t func, Transformation xf, ea_t where = BADADDR) const
+	{
+		if (m_nEntries == 0)
+			return false;
+		std::shared_lock<std::shared_timed_mutex> lock(m_Mutex);
+		return m_Set.find(Key(func, (int)xf, where)) != m_Set.end();
+	}
+	bool Insert(ea_t func, Transformation xf, ea_t where = BADADDR)
+	{
+		std::unique_lock<std::shared_timed_mutex> lock(m_Mutex);
+		Key key(func, (int)xf, where);
+		if (!m_Set.insert(key).second)
+			return false;
+		m_Order.push_back(key);
+		while (m_nMax != 0 && m_Order.size() > m_nMax)
+		{
+			m_Set.erase(m_Order.front());
+			m_Order.pop_front();
+		}
+		m_nEntries = m_Set.size();
+		return true;
+	}
+	void Clear()
+	{
+		std::unique_lock<std::shared_timed_mutex> lock(m_Mutex);
+		m_Set.clear();
+		m_Order.clear();
+		m_nEntries = 0;
+	}
+	size_t Size() const { return m_nEntries; }
+	size_t BytesUsed() const
+	{
+		std::shared_lock<std::shared_timed_mutex> lock(m_Mutex);
+		return NodeBytes<Key>(m_Set.size()) + m_Order.size() * sizeof(Key);
+	}
+
+private:
+	mutable std::shared_timed_mutex m_Mutex;
+	std::set<Key> m_Set;
+	std::deque<Key> m_Order;
+	std::atomic<size_t> m_nEntries;
+	size_t m_nMax;
+};
+
+extern TransformBlackList g_XformBlackList;
+
+// Cheap checks that the edges of the graph are consistent with each other and
+// with the instructions that end the blocks. If bSkipDetached is true, empty
+// blocks without any edges are ignored, as if remove_empty_blocks had
+// already gotten rid of them.
+bool CheckGraphStructure(mbl_array_t *mba, bool bSkipDetached = false);
+
+// mba->verify(true), except that a failure is reported and returned rather
+// than passed on to Hex-Rays
+bool VerifyNoThrow(mbl_array_t *mba);
+
+// Blacklist a transformation for a function, and say so in the output window
+void BlacklistTransformation(mbl_array_t *mba, Transformation xf, ea_t where = BADADDR);
+
+// Check the changes recorded in the journal, and commit them if they pass or
+// roll them back and blacklist the transformation if they don't. verify is
+// only run if bVerify is true. Returns whether the changes were kept.
+bool CommitOrRollback(mbl_array_t *mba, EditJournal &journal, bool bVerify, Transformation xf, ea_t where = BADADDR);
@@ -0,0 +1,156 @@
+// This file contains a quick pre-screen that runs before the control flow 
+// unflattening analysis. Most functions in a typical binary aren't flattened,
+// and the full analysis (removing single gotos, indexing every instruction, 
+// computing dominators) is wasted on them. The check here only looks at the
+// last instruction of each block -- conditional jumps always end a
+// block -- and at the number of predecessors of each block.
+//
+// It rejects a function only when the full analysis would also have failed:
+// too few comparisons against constants, or constants whose proportion of 
+// one-bits is outside of the acceptable range for every single constant (in
+// which case, whichever variable the full analysis picks, the average over 
+// its constants will be out of range too). As soon as the function looks 
+// flattened with reasonable confidence, or it finds a jump table that could
+// be a dispatcher, it stops looking and lets the full analysis take over.
+
+#include <hexrays.hpp>
+#include "HexRaysUtil.hpp"
+#include "CFFlattenInfo.hpp"
+#include "FlattenClassifier.hpp"
+#include "PhaseTimer.hpp"
+#include "Config.hpp"
+
+// Once we've seen this many comparisons with acceptable overall entropy, and
+// a block with this many predecessors, stop looking.
+#define EARLY_ACCEPT_COMPARISONS 16
+#define EARLY_ACCEPT_IN_DEGREE 8
+
+static int debugmsg(const char *fmt, ...)
+{
+#if CLASSIFYVERBOSE
+	va_list va;
+	va_start(va, fmt);
+	return vmsg(fmt, va);
+#endif
+	return 0;
+}
+
+static bool EntropyInRange(float fEntropy)
+{
+	return fEntropy >= MIN_KEY_ENTROPY && fEntropy <= MAX_KEY_ENTROPY;
+}
+
+static bool Classify(mbl_array_t *mba, FlattenClassification &fc)
+{
+	for (int i = 0; i < mba->qty; ++i)
+	{
+		mblock_t *mb = mba->get_mblock(i);
+		++fc.nBlocksScanned;
+
+		// Keep track of the block with the most predecessors
+		int nPred = mb->npred();
+		if (nPred > fc.nMaxInDegree)
+		{
+			fc.nMaxInDegree = nPred;
+			fc.iMaxInDegree = i;
+		}
+
+		// A jump table with many cases, entered from more than one place, 
+		// might be a dispatcher that switches on the key directly. Let the 
+		// full analysis decide.
+		minsn_t *tail = mb->tail;
+		if (tail != NULL && tail->opcode == m_jtbl && tail->r.t == mop_c && tail->r.c->size() >= MIN_NUM_COMPARISONS)
+		{
+			if (nPred >= 2 || (nPred == 1 && mba->get_mblock(mb->pred(0))->npred() >= 2))
+			{
+				fc.bEarlyExit = true;
+				fc.reason = "jump table";
+				return true;
+			}
+		}
+
+		// We're looking for blocks ending in a conditional jump against a 
+		// number; comparison trees use the whole range of them, not just jz
+		if (tail == NULL || !is_mcode_jcond(tail->opcode) || tail->r.t != mop_n)
+			continue;
+
+		// Count the 1-bits in the constant
+		int nBits = tail->r.size * 8;
+		uint64 v = tail->r.nnn->value;
+		if (nBits < 64)
+			v &= (1ULL << nBits) - 1;
+		int nOnes = popcount64(v);
+		
+		++fc.nComparisons;
+		fc.nBits += nBits;
+		fc.nOnes += nOnes;
+		
+		float fConst = nBits == 0 ? 0.0 : (float)nOnes / (float)nBits;
+		fc.fMinConstEntropy = qmin(fc.fMinConstEntropy, fConst);
+		fc.fMaxConstEntropy = qmax(fc.fMaxConstEntropy, fConst);
+
+		// If we've seen enough, don't bother with the rest of the function
+		if (fc.nComparisons >= EARLY_ACCEPT_COMPARISONS && 
+			fc.nMaxInDegree >= EARLY_ACCEPT_IN_DEGREE &&
+			EntropyInRange(fc.Entropy()))
+		{
+			fc.bEarlyExit = true;
+			fc.reason = "confident";
+			return true;
+		}
+	}
+
+	// Not enough comparisons for the full analysis to accept the function
+	if (fc.nComparisons < MIN_NUM_COMPARISONS)
+	{
+		fc.reason = "too few comparisons";
+		fc.bBlacklist = true;
+		return false;
+	}
+
+	// Every constant has too few, or every constant has too many, 1-bits
+	if (fc.fMaxConstEntropy < MIN_KEY_ENTROPY || fc.fMinConstEntropy > MAX_KEY_ENTROPY)
+	{
+		fc.reason = "low entropy constants";
+		fc.bBlacklist = true;
+		return false;
+	}
+
+	// A dispatcher is entered from the first block and from the end of every
+	// flattened region, so something must have multiple predecessors. Don't
+	// blacklist the function in this case, since the full analysis wouldn't
+	// have either.
+	if (fc.nMaxInDegree < 2)
+	{
+		fc.reason = "no join points";
+		return false;
+	}
+
+	fc.reason = "inconclusive";
+	return true;
+}
+
+// Decide whether the function might be flattened. Returns true if it might 
+// be, in which case the full analysis should run.
+bool ClassifyFlattening(mbl_array_t *mba, FlattenClassification &fc)
+{
+	PhaseTimer timer(PH_CLASSIFY);
+	uint64 tStart = get_nsec_stamp();
+	fc.Clear();
+	fc.bFlattened = Classify(mba, fc);
+	fc.nsElapsed = get_nsec_stamp() - tStart;
+
+	debugmsg("[I] %a: %s (%s) after %d/%d blocks in %llu us: %d comparisons (%.2f per block), max in-degree %d (block %d), entropy %f\n",
+		mba->entry_ea,
+		fc.bFlattened ? "possibly flattened" : "not flattened",
+		fc.reason,
+		fc.nBlocksScanned,
+		mba->qty,
+		fc.nsElapsed / 1000,
+		fc.nComparisons,
+		fc.nBlocksScanned == 0 ? 0.0 : (float)fc.nComparisons / (float)fc.nBlocksScanned,
+		fc.nMaxInDegree,
+		fc.iMaxInDegree,
+		fc.Entropy());
+	return fc.bFlattened;
+}
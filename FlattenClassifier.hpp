@@ -0,0 +1,64 @@
+#pragma once
+#include <hexrays.hpp>
+
+// The verdicts stored in the IDB (see VerdictStore) are only good for as long
+// as the rules that reached them stay the same. Bump this whenever the rules
+// here, or the full analysis's rules for giving up on a function in 
+// CFFlattenInfo, change; the verdicts from earlier versions are then thrown
+// away when they're loaded.
+//  1: jz/jg comparisons only
+//  2: every conditional jump against a constant counts as a comparison
+#define FLATTEN_CLASSIFIER_VERSION 2
+
+// Results of the quick check that decides whether a function is worth 
+// running the full control flow unflattening analysis upon.
+struct FlattenClassification
+{
+	// Did the function look flattened? If not, should it be blacklisted, i.e.
+	// would the full analysis have come to the same conclusion?
+	bool bFlattened;
+	bool bBlacklist;
+	
+	// Did we stop before looking at every block?
+	bool bEarlyExit;
+	const char *reason;
+
+	// Block with the most predecessors, which is usually the dispatcher
+	int iMaxInDegree;
+	int nMaxInDegree;
+
+	// Number of blocks looked at, and how many of them ended with a 
+	// conditional jump against a constant
+	int nBlocksScanned;
+	int nComparisons;
+
+	// Total bits and one-bits in the constants. Also the lowest and highest
+	// proportion of one-bits in any single constant.
+	int nBits;
+	int nOnes;
+	float fMinConstEntropy;
+	float fMaxConstEntropy;
+
+	uint64 nsElapsed;
+
+	FlattenClassification() { Clear(); }
+	float Entropy() const { return nBits == 0 ? 0.0 : (float)nOnes / (float)nBits; }
+	void Clear()
+	{
+		bFlattened = false;
+		bBlacklist = false;
+		bEarlyExit = false;
+		reason = "";
+		iMaxInDegree = -1;
+		nMaxInDegree = 0;
+		nBlocksScanned = 0;
+		nComparisons = 0;
+		nBits = 0;
+		nOnes = 0;
+		fMinConstEntropy = 1.0;
+		fMaxConstEntropy = 0.0;
+		nsElapsed = 0;
+	}
+};
+
+bool ClassifyFlattening(mbl_array_t *mba, FlattenClassification &fc);
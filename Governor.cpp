@@ -0,0 +1,231 @@
+#include <hexrays.hpp>
+#include "Governor.hpp"
+#include "HexRaysUtil.hpp"
+#include "Config.hpp"
+
+CostGovernor g_Governor;
+
+static const char *PassToString(GovernorPass pass)
+{
+	switch (pass)
+	{
+		case GOV_UNFLATTEN: return "unflattener";
+		case GOV_PATTERN:   return "pattern optimizer";
+	}
+	return "?";
+}
+
+GovernorSession::GovernorSession(ea_t ea, GovernorMode mode, uint64 nLastUsed) : m_Ea(ea), m_nLastUsed(nLastUsed), m_bOverBudget(false)
+{
+	for (int i = 0; i < GOV_NUM_PASSES; ++i)
+	{
+		m_Mode[i] = mode;
+		m_nsSpent[i] = 0;
+		m_nInsnsSpent[i] = 0;
+	}
+}
+
+// Add to what a pass has spent on this function, and make it do less from
+// now on if that puts it over budget. The decisions are reported in the
+// output window, since they change what the user sees.
+void GovernorSession::Charge(GovernorPass pass, uint64 ns, uint64 nInsns)
+{
+	m_nsSpent[pass] += ns;
+	m_nInsnsSpent[pass] += nInsns;
+
+	if (m_Mode[pass] != GOV_SKIP && m_nsSpent[pass] >= (uint64)GOVERNOR_SKIP_MS * 1000000)
+	{
+		m_Mode[pass] = GOV_SKIP;
+		m_bOverBudget = true;
+		msg("[I] Governor: %a: %s has spent %.3fms, skipping the rest of this function\n", m_Ea, PassToString(pass), m_nsSpent[pass] / 1e6);
+		return;
+	}
+	if (m_Mode[pass] == GOV_FULL && (m_nsSpent[pass] >= (uint64)GOVERNOR_BUDGET_MS * 1000000 || m_nInsnsSpent[pass] >= (uint64)GOVERNOR_BUDGET_INSNS))
+	{
+		m_Mode[pass] = GOV_CHEAP;
+		m_bOverBudget = true;
+		msg("[I] Governor: %a: %s has spent %.3fms on %llu instructions, switching to cheap mode\n", m_Ea, PassToString(pass), m_nsSpent[pass] / 1e6, m_nInsnsSpent[pass]);
+	}
+}
+
+// The mode a function starts out in depends on how its previous
+// decompilations went.
+GovernorSession *CostGovernor::NewSession(mbl_array_t *mba)
+{
+	GovernorMode mode = GOV_FULL;
+	auto it = m_History.find(mba->entry_ea);
+	if (it != m_History.end())
+	{
+		GovernorHistory &h = it->second;
+		if (h.nStrikes >= GOVERNOR_SKIP_STRIKES)
+			mode = GOV_SKIP;
+		else if (h.nStrikes > 0)
+			mode = GOV_CHEAP;
+		if (mode != GOV_FULL)
+			msg("[I] Governor: %a: over budget in %d of %d decompilations (worst %.3fms), %s\n", mba->entry_ea, h.nStrikes, h.nDecompiles, h.nsWorst / 1e6, mode == GOV_SKIP ? "skipping it" : "starting in cheap mode");
+	}
+	EvictStaleSessions();
+	return new GovernorSession(mba->entry_ea, mode, ++m_nTicks);
+}
+
+// Sessions normally end when the ctree is finalized. Decompilations that 
+// fail never get that far, so make room for a new session by throwing away
+// the least recently used ones, which belong to such decompilations. One 
+// that's in progress uses its session all the time.
+void CostGovernor::EvictStaleSessions()
+{
+	while (m_Sessions.size() >= SESSION_MAX_DECOMPILATIONS)
+	{
+		auto oldest = m_Sessions.begin();
+		for (auto it = m_Sessions.begin(); it != m_Sessions.end(); ++it)
+			if (it->second->m_nLastUsed < oldest->second->m_nLastUsed)
+				oldest = it;
+		delete oldest->second;
+		m_Sessions.erase(oldest);
+		++m_nGeneration;
+	}
+}
+
+// Forget the functions whose history makes the least difference. Those that
+// have never gone over budget start out the same as ones we've never seen,
+// so they go first, then those with one strike, and so on.
+void CostGovernor::CompactHistory()
+{
+	for (int nStrikes = 0; m_History.size() > SESSION_MAX_FUNCTIONS && nStrikes <= GOVERNOR_SKIP_STRIKES; ++nStrikes)
+	{
+		for (auto it = m_History.begin(); it != m_History.end(); )
+		{
+			if (it->second.nStrikes <= nStrikes)
+				it = m_History.erase(it);
+			else
+				++it;
+		}
+	}
+}
+
+// Start afresh for a newly-generated graph. If one with the same address
+// was still being tracked (because its decompilation failed before we could
+// finish it), throw that one away.
+void CostGovernor::Begin(mbl_array_t *mba)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	auto it = m_Sessions.find(mba);
+	if (it != m_Sessions.end())
+	{
+		delete it->second;
+		m_Sessions.erase(it);
+		++m_nGeneration;
+	}
+	GovernorSession *gs = NewSession(mba);
+	m_Sessions[mba] = gs;
+}
+
+// The decompilation is over; remember how expensive it was.
+void CostGovernor::End(mbl_array_t *mba)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	auto it = m_Sessions.find(mba);
+	if (it == m_Sessions.end())
+		return;
+	GovernorSession *gs = it->second;
+	m_Sessions.erase(it);
+	++m_nGeneration;
+
+	uint64 nsTotal = 0;
+	for (int i = 0; i < GOV_NUM_PASSES; ++i)
+		nsTotal += gs->m_nsSpent[i];
+
+	GovernorHistory &h = m_History[gs->m_Ea];
+	++h.nDecompiles;
+	if (nsTotal > h.nsWorst)
+		h.nsWorst = nsTotal;
+	if (gs->m_bOverBudget)
+		++h.nStrikes;
+	delete gs;
+
+	if (m_History.size() > SESSION_MAX_FUNCTIONS)
+		CompactHistory();
+}
+
+GovernorSession *CostGovernor::Find(mbl_array_t *mba)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	auto it = m_Sessions.find(mba);
+	if (it != m_Sessions.end())
+	{
+		it->second->m_nLastUsed = ++m_nTicks;
+		return it->second;
+	}
+
+	// We weren't told about this graph being created, e.g. because the plugin
+	// was loaded in the middle of a decompilation. Start tracking it now.
+	GovernorSession *gs = NewSession(mba);
+	m_Sessions[mba] = gs;
+	return gs;
+}
+
+// The last session that FindCached returned on this thread, the graph it was
+// for, and the generation it was found in
+struct CachedSession
+{
+	mbl_array_t *mba;
+	GovernorSession *gs;
+	uint64 nGeneration;
+};
+
+static thread_local CachedSession t_LastSession = { NULL, NULL, 0 };
+
+GovernorSession *CostGovernor::FindCached(mbl_array_t *mba)
+{
+	CachedSession &cs = t_LastSession;
+	uint64 nGeneration = m_nGeneration.load();
+	if (cs.mba == mba && cs.gs != NULL && cs.nGeneration == nGeneration)
+		return cs.gs;
+	cs.mba = mba;
+	cs.gs = Find(mba);
+	cs.nGeneration = nGeneration;
+	return cs.gs;
+}
+
+void CostGovernor::Clear()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	for (auto &kv : m_Sessions)
+		delete kv.second;
+	m_Sessions.clear();
+	++m_nGeneration;
+	m_History.clear();
+}
+
+size_t CostGovernor::BytesUsed(int &nSessions, int &nFunctions)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	nSessions = m_Sessions.size();
+	nFunctions = m_History.size();
+	return NodeBytes<std::pair<mbl_array_t *, GovernorSession *> >(m_Sessions.size())
+		+ m_Sessions.size() * sizeof(GovernorSession)
+		+ NodeBytes<std::pair<ea_t, GovernorHistory> >(m_History.size());
+}
+
+ssize_t idaapi CostGovernor::HexRaysCallback(void *ud, hexrays_event_t event, va_list va)
+{
+	CostGovernor *gov = (CostGovernor *)ud;
+	switch (event)
+	{
+		case hxe_microcode:
+		{
+			mbl_array_t *mba = va_arg(va, mbl_array_t *);
+			gov->Begin(mba);
+			break;
+		}
+		case hxe_maturity:
+		{
+			cfunc_t *cfunc = va_arg(va, cfunc_t *);
+			ctree_maturity_t new_maturity = (ctree_maturity_t)va_arg(va, int);
+			if (new_maturity == CMAT_FINAL)
+				gov->End(cfunc->mba);
+			break;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <hexrays.hpp>
+
+// How much effort a pass should put into a function. In GOV_CHEAP mode, the
+// passes skip the work that only makes the result better or safer to debug,
+// such as verifying the graph after every change, retrying at later maturity
+// levels, and solving for the state variables over the whole function.
+enum GovernorMode
+{
+	GOV_FULL,
+	GOV_CHEAP,
+	GOV_SKIP,
+};
+
+// The passes whose costs are tracked separately. The unflattener's costs
+// include those of the instruction optimizer calls caused by its own calls
+// to optimize_local.
+enum GovernorPass
+{
+	GOV_UNFLATTEN,
+	GOV_PATTERN,
+	GOV_NUM_PASSES,
+};
+
+// What one decompilation of a function has cost so far. A function is only
+// ever decompiled on one thread at a time, so the session isn't locked.
+struct GovernorSession
+{
+	ea_t m_Ea;
+	uint64 m_nLastUsed;
+	GovernorMode m_Mode[GOV_NUM_PASSES];
+	uint64 m_nsSpent[GOV_NUM_PASSES];
+	uint64 m_nInsnsSpent[GOV_NUM_PASSES];
+	bool m_bOverBudget;
+
+	GovernorSession(ea_t ea, GovernorMode mode, uint64 nLastUsed);
+	GovernorMode Mode(GovernorPass pass) const { return m_Mode[pass]; }
+	void Charge(GovernorPass pass, uint64 ns, uint64 nInsns);
+};
+
+// What previous decompilations of a function cost. Every decompilation that
+// goes over budget is a strike against the function; with one strike, it
+// starts out in GOV_CHEAP mode next time, and with GOVERNOR_SKIP_STRIKES, the
+// passes leave it alone altogether.
+struct GovernorHistory
+{
+	int nDecompiles;
+	int nStrikes;
+	uint64 nsWorst;
+
+	GovernorHistory() : nDecompiles(0), nStrikes(0), nsWorst(0) {}
+};
+
+// Keeps the passes from spending too long on any one function, so that a
+// pathological function can't stall IDA's UI. Sessions are started when
+// microcode is generated and finished once the ctree is final, which is when
+// the history is updated; HexRaysCallback must be installed for that to
+// happen. Sessions left behind by failed decompilations (the least recently
+// used ones), and the history of the functions that matter least, are 
+// forgotten to keep within the bounds in Config.hpp.
+//
+// FindCached is for callers that run for every instruction: it remembers the
+// last session found on each thread, and only takes the lock when the graph
+// changes, or when a session has been thrown away since (which m_nGeneration
+// counts). Cached lookups don't count as uses for choosing which sessions to
+// evict, but the unflattener's lookups for the same graph do.
+struct CostGovernor
+{
+	std::map<mbl_array_t *, GovernorSession *> m_Sessions;
+	std::map<ea_t, GovernorHistory> m_History;
+	uint64 m_nTicks;
+	std::atomic<uint64> m_nGeneration;
+	std::mutex m_Mutex;
+
+	CostGovernor() : m_nTicks(0), m_nGeneration(0) {};
+	~CostGovernor() { Clear(); }
+	void Begin(mbl_array_t *mba);
+	void End(mbl_array_t *mba);
+	GovernorSession *Find(mbl_array_t *mba);
+	GovernorSession *FindCached(mbl_array_t *mba);
+	void Clear();
+	size_t BytesUsed(int &nSessions, int &nFunctions);
+	static ssize_t idaapi HexRaysCallback(void *ud, hexrays_event_t event, va_list va);
+
+private:
+	GovernorSession *NewSession(mbl_array_t *mba);
+	void EvictStaleSessions();
+	void CompactHistory();
+};
+
+extern CostGovernor g_Governor;
@@ -1,5 +1,6 @@
 #define USE_DANGEROUS_FUNCTIONS 
 #include <hexrays.hpp>
+#include "HexRaysUtil.hpp"
 
 // Produce a string for an operand type
 const char *mopt_t_to_string(mopt_t t)
@@ -182,3 +183,199 @@ bool equal_mops_ignore_size(const mop_t &lo, const mop_t &ro)
 	}
 	return false;
 }
+
+// Mix a value into a running hash
+static inline uint64 hash_combine(uint64 h, uint64 v)
+{
+	v *= 0x9E3779B97F4A7C15ULL;
+	v ^= v >> 29;
+	return (h ^ v) * 0xBF58476D1CE4E5B9ULL;
+}
+
+static uint64 hash_string(const char *s)
+{
+	uint64 h = 0xCBF29CE484222325ULL;
+	if (s != NULL)
+		while (*s)
+			h = (h ^ (uint8)*s++) * 0x100000001B3ULL;
+	return h;
+}
+
+// Hash a mop_t such that any two operands for which equal_mops_ignore_size
+// returns true also hash to the same value. Whatever that function compares
+// loosely (or not at all) contributes only the operand type to the hash.
+uint64 hash_mop_ignore_size(const mop_t &op)
+{
+	uint64 h = hash_combine(0, op.t);
+	switch (op.t)
+	{
+	case mop_n:
+		// Immediates are compared after truncating both to the smaller of
+		// the two sizes, which can be as small as a single byte.
+		return hash_combine(h, op.nnn->value & 0xFF);
+	case mop_S:
+		return hash_combine(h, op.s->off);
+	case mop_v:
+		return hash_combine(h, op.g);
+	case mop_b:
+		return hash_combine(h, op.b);
+	case mop_r:
+		return hash_combine(h, op.r);
+	case mop_l:
+		return hash_combine(hash_combine(h, op.l->idx), op.l->off);
+	case mop_a:
+		h = hash_combine(h, op.a->insize);
+		h = hash_combine(h, op.a->outsize);
+		return hash_combine(h, hash_mop_ignore_size(*op.a));
+	case mop_h:
+		return hash_combine(h, hash_string(op.helper));
+	case mop_str:
+		return hash_combine(h, hash_string(op.cstr));
+	case mop_p:
+		h = hash_combine(h, hash_mop_ignore_size(op.pair->lop));
+		return hash_combine(h, hash_mop_ignore_size(op.pair->hop));
+	
+	// mop_d is compared with equal_insns, which ignores opcodes and sizes;
+	// mop_fn and mop_c are compared in their entirety; mop_f and mop_sc are
+	// never equal to anything. Just use the type for all of these.
+	default:
+		return h;
+	}
+}
+
+static uint64 hash_insn_exact(const minsn_t *ins);
+
+// Hash a mop_t exactly, sizes and all, so that operands that differ in any
+// way that matters to the unflattener hash differently (barring collisions)
+static uint64 hash_mop_exact(const mop_t &op)
+{
+	uint64 h = hash_combine(hash_combine(0, op.t), op.size);
+	switch (op.t)
+	{
+	case mop_n:
+		return hash_combine(h, op.nnn->value);
+	case mop_d:
+		return hash_combine(h, hash_insn_exact(op.d));
+	case mop_f:
+		h = hash_combine(h, op.f->args.size());
+		for (auto &arg : op.f->args)
+			h = hash_combine(h, hash_mop_exact(arg));
+		return h;
+	case mop_c:
+		for (size_t i = 0; i < op.c->targets.size(); ++i)
+		{
+			h = hash_combine(h, op.c->targets[i]);
+			for (auto v : op.c->values[i])
+				h = hash_combine(h, v);
+		}
+		return h;
+	case mop_a:
+		h = hash_combine(h, op.a->insize);
+		h = hash_combine(h, op.a->outsize);
+		return hash_combine(h, hash_mop_exact(*op.a));
+	case mop_p:
+		h = hash_combine(h, hash_mop_exact(op.pair->lop));
+		return hash_combine(h, hash_mop_exact(op.pair->hop));
+	default:
+		return hash_combine(h, hash_mop_ignore_size(op));
+	}
+}
+
+static uint64 hash_insn_exact(const minsn_t *ins)
+{
+	uint64 h = hash_combine(hash_combine(0, ins->opcode), ins->ea);
+	h = hash_combine(h, hash_mop_exact(ins->l));
+	h = hash_combine(h, hash_mop_exact(ins->r));
+	return hash_combine(h, hash_mop_exact(ins->d));
+}
+
+// Hash the whole graph: every block's type, address and edges, and every 
+// instruction in it
+uint64 hash_mba(mbl_array_t *mba)
+{
+	uint64 h = hash_combine(hash_combine(0, mba->entry_ea), mba->qty);
+	for (int i = 0; i < mba->qty; ++i)
+	{
+		mblock_t *blk = mba->get_mblock(i);
+		h = hash_combine(hash_combine(h, blk->type), blk->start);
+		for (auto iSucc : blk->succset)
+			h = hash_combine(h, iSucc);
+		for (minsn_t *ins = blk->head; ins != NULL; ins = ins->next)
+			h = hash_combine(h, hash_insn_exact(ins));
+	}
+	return h;
+}
+
+// Look up an operand, adding it to the table if it wasn't already there.
+// Returns the operand's index within the table.
+int MopInternTable::Intern(const mop_t *op, bool *pbAdded)
+{
+	int iFound = Find(op);
+	if (pbAdded != NULL)
+		*pbAdded = iFound < 0;
+	if (iFound >= 0)
+		return iFound;
+
+	int idx = m_Mops.size();
+	m_Mops.push_back(op);
+	m_Buckets.insert(std::make_pair(hash_mop_ignore_size(*op), idx));
+	return idx;
+}
+
+// Look up an operand without adding it. Returns -1 if it isn't there.
+int MopInternTable::Find(const mop_t *op)
+{
+	auto range = m_Buckets.equal_range(hash_mop_ignore_size(*op));
+	
+	// A linear search would have compared against every entry that came
+	// before the one we find, or every entry if we don't find one. Keep track
+	// of how many of those comparisons the hashing saved us.
+	int iFound = -1;
+	int nCompared = 0;
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		++nCompared;
+		if (equal_mops_ignore_size(*m_Mops[it->second], *op))
+		{
+			// Buckets aren't ordered, so find the earliest match for parity 
+			// with a linear search.
+			if (iFound < 0 || it->second < iFound)
+				iFound = it->second;
+		}
+	}
+	int nLinear = iFound >= 0 ? iFound + 1 : m_Mops.size();
+	m_nComparisons += nCompared;
+	if (nLinear > nCompared)
+		m_nComparisonsAvoided += nLinear - nCompared;
+	return iFound;
+}
+
+// Reverse postorder of the blocks reachable from block #0
+void ComputeRPO(mbl_array_t *mba, intvec_t &rpo)
+{
+	std::vector<bool> seen(mba->qty, false);
+	std::vector<std::pair<int, int> > stack;
+	intvec_t post;
+	seen[0] = true;
+	stack.push_back(std::pair<int, int>(0, 0));
+	while (!stack.empty())
+	{
+		mblock_t *mb = mba->get_mblock(stack.back().first);
+		int &iSucc = stack.back().second;
+		if (iSucc < mb->nsucc())
+		{
+			int iNext = mb->succ(iSucc++);
+			if (!seen[iNext])
+			{
+				seen[iNext] = true;
+				stack.push_back(std::pair<int, int>(iNext, 0));
+			}
+			continue;
+		}
+		post.push_back(mb->serial);
+		stack.pop_back();
+	}
+	rpo.clear();
+	for (int i = post.size() - 1; i >= 0; --i)
+		rpo.push_back(post[i]);
+}
@@ -2,7 +2,16 @@
 
 #pragma once
 
+#include <deque>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
 #include <hexrays.hpp>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 // Produce strings for various objects in the Hex-Rays ecosystem (for 
 // debugging / informational purposes)
@@ -14,3 +23,71 @@ const char *MicroMaturityToString(mba_maturity_t mmt);
 // microcode API in the future, so we won't have to implement it ourselves.
 bool equal_mops_ignore_size(const mop_t &lo, const mop_t &ro);
 
+// Reverse postorder of the blocks reachable from block #0
+void ComputeRPO(mbl_array_t *mba, intvec_t &rpo);
+
+
+// Count the 1-bits in a number. The popcnt instruction is only used when the
+// compiler has been told that the target has it (/arch:AVX and up for MSVC, 
+// -mpopcnt or an -march that includes it for GCC and Clang), since it faults
+// on processors without it. Otherwise, GCC and Clang call a library routine,
+// and MSVC uses the bit-twiddling version below.
+inline int popcount64(uint64 v)
+{
+#if defined(_MSC_VER) && defined(__AVX__) && defined(_M_X64)
+	return (int)__popcnt64(v);
+#elif defined(_MSC_VER) && defined(__AVX__)
+	return (int)(__popcnt((uint32)v) + __popcnt((uint32)(v >> 32)));
+#elif defined(__GNUC__)
+	return __builtin_popcountll(v);
+#else
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Rough number of bytes that a node-based container (std::set, std::map,
+// std::unordered_map) takes up for n elements of type T, counting the 
+// allocator's and the container's overhead for each node
+template <class T>
+size_t NodeBytes(size_t n)
+{
+	return n * (sizeof(T) + 4 * sizeof(void *));
+}
+
+// Hash a mop_t consistently with equal_mops_ignore_size, i.e., operands that
+// compare equal always hash equally.
+uint64 hash_mop_ignore_size(const mop_t &op);
+
+// Hash a function's microcode exactly, for telling whether two graphs are the
+// same without keeping a copy of one of them around
+uint64 hash_mba(mbl_array_t *mba);
+
+// Maps operands to small integer indices, using the hash above to avoid
+// comparing each new operand against every operand seen so far. Indices are
+// assigned in the order operands are first added. The table only holds 
+// pointers, so the operands must outlive it.
+struct MopInternTable
+{
+	std::vector<const mop_t *> m_Mops;
+	std::unordered_multimap<uint64, int> m_Buckets;
+
+	// How many equal_mops_ignore_size calls were made, and how many a linear
+	// search over m_Mops would have made in addition
+	int m_nComparisons;
+	int m_nComparisonsAvoided;
+
+	MopInternTable() : m_nComparisons(0), m_nComparisonsAvoided(0) {};
+	int Intern(const mop_t *op, bool *pbAdded = NULL);
+	int Find(const mop_t *op);
+	int Size() const { return m_Mops.size(); }
+	void Clear()
+	{
+		m_Mops.clear();
+		m_Buckets.clear();
+		m_nComparisons = 0;
+		m_nComparisonsAvoided = 0;
+	}
+};
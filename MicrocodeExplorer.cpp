@@ -5,6 +5,46 @@
 
 typedef std::shared_ptr<mbl_array_t *> shared_mbl_array_t;
 
+// How many mbl_array_ts the listings and graphs are holding onto, and roughly
+// how much memory they and the listings' text take up. Only touched from the
+// UI thread.
+static int g_nExplorerMbas = 0;
+static size_t g_nExplorerBytes = 0;
+
+// The instructions' operands aren't counted, so this is a lower bound
+static size_t MbaBytes(mbl_array_t *mba)
+{
+	size_t nBytes = sizeof(mbl_array_t);
+	for (int i = 0; i < mba->qty; ++i)
+	{
+		nBytes += sizeof(mblock_t);
+		for (minsn_t *ins = mba->get_mblock(i)->head; ins != NULL; ins = ins->next)
+			nBytes += sizeof(minsn_t);
+	}
+	return nBytes;
+}
+
+// The microcode is freed when the last window showing it is closed
+static shared_mbl_array_t ShareMba(mbl_array_t *mba)
+{
+	size_t nBytes = MbaBytes(mba);
+	++g_nExplorerMbas;
+	g_nExplorerBytes += nBytes;
+	return shared_mbl_array_t(new mbl_array_t *(mba), [nBytes](mbl_array_t **p)
+	{
+		--g_nExplorerMbas;
+		g_nExplorerBytes -= nBytes;
+		delete *p;
+		delete p;
+	});
+}
+
+size_t ExplorerBytesUsed(int &nListings)
+{
+	nListings = g_nExplorerMbas;
+	return g_nExplorerBytes;
+}
+
 struct mblock_virtual_dumper_t : public vd_printer_t
 {
 	int nline;
@@ -58,7 +98,9 @@ struct sample_info_t
 	mblock_dumper_t md;
 	shared_mbl_array_t mba;
 	mba_maturity_t mat;
-	sample_info_t() : cv(NULL), mba(NULL) {}
+	size_t nTextBytes;
+	sample_info_t() : cv(NULL), mba(NULL), nTextBytes(0) {}
+	~sample_info_t() { g_nExplorerBytes -= nTextBytes; }
 };
 
 #include <graph.hpp>
@@ -253,6 +295,12 @@ static ssize_t idaapi migr_callback(void *ud, int code, va_list va)
 		result = true;
 	}
 	break;
+
+	// The window was closed, so nothing will call us with this container
+	// anymore
+	case grcode_destroyed:
+		delete gcont;
+		break;
 	}
 	return (int)result;
 }
@@ -342,6 +390,11 @@ static ssize_t idaapi mgr_callback(void *ud, int code, va_list va)
 		result = true;
 	}
 	break;
+
+	// The window was closed; let go of the microcode
+	case grcode_destroyed:
+		delete gcont;
+		break;
 	}
 	return (int)result;
 }
@@ -504,10 +557,13 @@ void ShowMicrocodeExplorer()
 	}
 
 	sample_info_t *si = new sample_info_t;
-	si->mba = std::make_shared<mbl_array_t *>(mba);
+	si->mba = ShareMba(mba);
 	si->mat = mmat;
 	// Dump the microcode to the output window
 	mba->print(si->md);
+	for (auto &line : si->md.lines)
+		si->nTextBytes += sizeof(line) + line.line.size();
+	g_nExplorerBytes += si->nTextBytes;
 
 	simpleline_place_t s1;
 	simpleline_place_t s2(si->md.lines.size() - 1);
@@ -1,3 +1,6 @@
 #pragma once
 
 void ShowMicrocodeExplorer();
+
+// Roughly how much memory the open microcode listings and graphs hold onto
+size_t ExplorerBytesUsed(int &nListings);
@@ -1,8 +1,34 @@
 #include <hexrays.hpp>
 #include "HexRaysUtil.hpp"
 #include "PatternDeobfuscateUtil.hpp"
+#include "Governor.hpp"
+#include "EditJournal.hpp"
+#include "PhaseTimer.hpp"
 #include "Config.hpp"
 
+// The instruction that func is working on, and the journal to save it into
+// if the result is going to be verified. Copying every instruction that comes
+// through just in case would be a waste, so the patterns call SaveForRollback
+// once they've matched, just before they change anything. Only the first
+// call does anything.
+struct PendingSave
+{
+	EditJournal *journal;
+	mblock_t *blk;
+	minsn_t *ins;
+};
+
+static thread_local PendingSave t_PendingSave = { NULL, NULL, NULL };
+
+static void SaveForRollback()
+{
+	PendingSave &ps = t_PendingSave;
+	if (ps.journal == NULL)
+		return;
+	ps.journal->SaveInsn(ps.blk, ps.ins);
+	ps.journal = NULL;
+}
+
 // Our pattern-based deobfuscation is implemented as an optinsn_t structure,
 // which allows us to hook directly into the microcode generation phase and
 // perform optimizations automatically, whenever code is decompiled.
@@ -43,6 +69,7 @@ struct ObfCompilerOptimizer : public optinsn_t
 		// If we get here, then the pattern matched.
 		// Move the logical operation (OR or XOR) to the left-hand side,
 		// with the operands that have the &1 removed.
+		SaveForRollback();
 		ins->l.d->opcode = ins->opcode;
 		ins->l.d->l.swap(*opLeft);
 		ins->l.d->r.swap(*opRight);
@@ -166,6 +193,7 @@ struct ObfCompilerOptimizer : public optinsn_t
 
 		// If we get here, the pattern matched.
 		// Replace the whole multiplication instruction by 0.
+		SaveForRollback();
 		ins->l.make_number(0, ins->l.size);
 #if IDA_SDK_VERSION == 710
 		andIns->optimize_flat();
@@ -210,6 +238,7 @@ struct ObfCompilerOptimizer : public optinsn_t
 			return 0;
 
 		// Move the operands up to the top-level OR instruction
+		SaveForRollback();
 		ins->l.swap(*xorOp1);
 		ins->r.swap(*xorOp2);
 #if IDA_SDK_VERSION == 710
@@ -246,6 +275,7 @@ struct ObfCompilerOptimizer : public optinsn_t
 			
 		// If we get here, the pattern matched. Replace both sides of OR with
 		// 1, and then call optimize_flat to fold the constants.
+		SaveForRollback();
 		ins->l.make_number(1, 1);
 		ins->r.make_number(1, 1);
 #if IDA_SDK_VERSION == 710
@@ -334,6 +364,7 @@ struct ObfCompilerOptimizer : public optinsn_t
 			return 0;
 
 		// Okay, all of our conditions matched. Make an XOR(x,d) instruction
+		SaveForRollback();
 		ins->opcode = m_xor;
 		ins->l.swap(*nonNottedInsn);
 		ins->r.swap(*nottedNum);
@@ -355,8 +386,11 @@ struct ObfCompilerOptimizer : public optinsn_t
 
 		// Automagically find duplicated expressions and erase them
 		XorSimplifier xs;
-		if (!xs.Simplify(ins))
+		xs.Insert(ins);
+		if (!xs.DidSimplify())
 			return 0;
+		SaveForRollback();
+		xs.Cancel(ins);
 
 #if OPTVERBOSE
 		ins->print(&qInsAfter);
@@ -486,6 +520,7 @@ struct ObfCompilerOptimizer : public optinsn_t
 			return 0;
 
 		// Invert the non-common number and truncate it down to its proper size
+		SaveForRollback();
 		noMatch->nnn->update_value(~noMatch->nnn->value & ((1ULL << (noMatch->size * 8)) - 1));
 		
 		// Replace the larger XOR construct with the now-inverted value
@@ -518,6 +553,7 @@ struct ObfCompilerOptimizer : public optinsn_t
 			return 0;
 
 		// If we're here, the pattern matched. Make the AND.
+		SaveForRollback();
 		ins->opcode = m_and;
 		ins->l.swap(*opLeft);
 		ins->r.swap(*opRight);
@@ -547,6 +583,7 @@ struct ObfCompilerOptimizer : public optinsn_t
 			return 0;
 
 		// Once we found it, rewrite the top-level BNOT with an AND
+		SaveForRollback();
 		ins->opcode = m_and;
 		ins->l.swap(orNonNum->d->l);
 
@@ -557,41 +594,52 @@ struct ObfCompilerOptimizer : public optinsn_t
 		return 1;
 	}
 	
+	// Run one of the pattern-replacement functions above, timing each one
+	// separately unless bTimed is false
+	typedef int (ObfCompilerOptimizer::*Pattern)(minsn_t *);
+	int Timed(Phase ph, Pattern pat, minsn_t *ins, bool bTimed)
+	{
+		if (!bTimed)
+			return (this->*pat)(ins);
+		PhaseTimer timer(ph);
+		return (this->*pat)(ins);
+	}
+
 	// This function just inspects the instruction and calls the 
 	// pattern-replacement functions above to perform deobfuscation.
-	int Optimize(minsn_t *ins)
+	int Optimize(minsn_t *ins, bool bTimed = true)
 	{
 		int iLocalRetVal = 0;
 
 		switch (ins->opcode)
 		{
 		case m_bnot:
-			iLocalRetVal = pat_BnotOrBnotConst(ins);
+			iLocalRetVal = Timed(PH_PAT_BNOT_OR_BNOT_CONST, &ObfCompilerOptimizer::pat_BnotOrBnotConst, ins, bTimed);
 			break;
 		case m_or:
-			iLocalRetVal = pat_OrAndNot(ins);
+			iLocalRetVal = Timed(PH_PAT_OR_AND_NOT, &ObfCompilerOptimizer::pat_OrAndNot, ins, bTimed);
 			if (!iLocalRetVal)
-				iLocalRetVal = pat_OrViaXorAnd(ins);
+				iLocalRetVal = Timed(PH_PAT_OR_VIA_XOR_AND, &ObfCompilerOptimizer::pat_OrViaXorAnd, ins, bTimed);
 			if (!iLocalRetVal)
-				iLocalRetVal = pat_OrNegatedSameCondition(ins);
+				iLocalRetVal = Timed(PH_PAT_OR_NEGATED_SAME_CONDITION, &ObfCompilerOptimizer::pat_OrNegatedSameCondition, ins, bTimed);
 			if (!iLocalRetVal)
-				iLocalRetVal = pat_LogicAnd1(ins);
+				iLocalRetVal = Timed(PH_PAT_LOGIC_AND1, &ObfCompilerOptimizer::pat_LogicAnd1, ins, bTimed);
 
 			break;
 		case m_and:
-			iLocalRetVal = pat_AndXor(ins);
+			iLocalRetVal = Timed(PH_PAT_AND_XOR, &ObfCompilerOptimizer::pat_AndXor, ins, bTimed);
 			if (!iLocalRetVal)
-				iLocalRetVal = pat_MulSub(ins);
+				iLocalRetVal = Timed(PH_PAT_MUL_SUB, &ObfCompilerOptimizer::pat_MulSub, ins, bTimed);
 			break;
 		case m_xor:
-			iLocalRetVal = pat_XorChain(ins);
+			iLocalRetVal = Timed(PH_PAT_XOR_CHAIN, &ObfCompilerOptimizer::pat_XorChain, ins, bTimed);
 			if(!iLocalRetVal)
-				iLocalRetVal = pat_LnotOrLnotLnot(ins);
+				iLocalRetVal = Timed(PH_PAT_LNOT_OR_LNOT_LNOT, &ObfCompilerOptimizer::pat_LnotOrLnotLnot, ins, bTimed);
 			if (!iLocalRetVal)
-				iLocalRetVal = pat_LogicAnd1(ins);
+				iLocalRetVal = Timed(PH_PAT_LOGIC_AND1, &ObfCompilerOptimizer::pat_LogicAnd1, ins, bTimed);
 			break;
 		case m_lnot:
-			iLocalRetVal = pat_LnotOrLnotLnot(ins);
+			iLocalRetVal = Timed(PH_PAT_LNOT_OR_LNOT_LNOT, &ObfCompilerOptimizer::pat_LnotOrLnotLnot, ins, bTimed);
 			break;
 		}
 		return iLocalRetVal;
@@ -600,10 +648,13 @@ struct ObfCompilerOptimizer : public optinsn_t
 	// This is the virtual function dictated by the optinsn_t interface. This
 	// function gets called by the Hex-Rays kernel; we optimize the microcode.
 	int func(mblock_t *blk, minsn_t *ins);
+	int OptimizeWithConditions(minsn_t *ins, bool bTimed = true);
 };
 
-// Callback function. Do pattern-deobfuscation.
-int ObfCompilerOptimizer::func(mblock_t *blk, minsn_t *ins)
+// Runs the patterns over an instruction, and over the subinstructions of its
+// condition if it's a conditional, and tidies up the result if anything
+// changed.
+int ObfCompilerOptimizer::OptimizeWithConditions(minsn_t *ins, bool bTimed)
 {
 #if OPTVERBOSE
 	char buf[1000];
@@ -611,7 +662,7 @@ int ObfCompilerOptimizer::func(mblock_t *blk, minsn_t *ins)
 	msg("ObfCompilerOptimizer: %a %s\n", ins->ea, buf);
 #endif
 
-	int retVal = Optimize(ins);
+	int retVal = Optimize(ins, bTimed);
 	int iLocalRetVal = 0;
 	
 	// This callback doesn't seem to get called for subinstructions of 
@@ -628,13 +679,14 @@ int ObfCompilerOptimizer::func(mblock_t *blk, minsn_t *ins)
 		{
 			int visit_minsn()
 			{
-				return othis->Optimize(this->curins);
+				return othis->Optimize(this->curins, bTimed);
 			}
 			ObfCompilerOptimizer *othis;
-			Blah(ObfCompilerOptimizer *o) : othis(o) { };
+			bool bTimed;
+			Blah(ObfCompilerOptimizer *o, bool b) : othis(o), bTimed(b) { };
 		};
 		
-		Blah b(this);
+		Blah b(this, bTimed);
 		
 		// Optimize all subinstructions of the JCC conditional
 		iLocalRetVal += ins->for_all_insns(b);
@@ -657,13 +709,61 @@ int ObfCompilerOptimizer::func(mblock_t *blk, minsn_t *ins)
 #elif IDA_SDK_VERSION >= 720
 		ins->optimize_solo();
 #endif
+	}
+	return retVal;
+}
+
+// Callback function. Do pattern-deobfuscation.
+int ObfCompilerOptimizer::func(mblock_t *blk, minsn_t *ins)
+{
+	// The kernel sometimes hands us an instruction that isn't in a block yet,
+	// in which case there's no function to look anything up for, charge the
+	// time to, or verify the result against. Just apply the patterns.
+	if (blk == NULL)
+		return OptimizeWithConditions(ins, false);
+
+	// Leave functions that we've already spent too long on alone
+	GovernorSession *gs = g_Governor.FindCached(blk->mba);
+	GovernorMode mode = gs->Mode(GOV_PATTERN);
+	if (mode == GOV_SKIP)
+		return 0;
+
+	// Also leave alone the instructions whose rewrites had to be undone
+	if (g_XformBlackList.Has(blk->mba->entry_ea, XF_PATTERN, ins->ea))
+		return 0;
+	uint64 nsStart = get_nsec_stamp();
+	PhaseTimer timer(PH_PATTERN, blk->mba, nsStart);
+
+	// If we're going to verify the result, have the patterns hang onto the
+	// instruction as it was, so the rewrite can be undone if it doesn't pass.
+	// Optimizing might call back into here, so put back whatever was pending
+	// before.
+	EditJournal journal;
+	PendingSave psOuter = t_PendingSave;
+	t_PendingSave.journal = mode == GOV_FULL ? &journal : NULL;
+	t_PendingSave.blk = blk;
+	t_PendingSave.ins = ins;
+	int retVal = OptimizeWithConditions(ins);
+	t_PendingSave = psOuter;
+
+	// If any optimizations were performed...
+	if (retVal)
+	{
 		// I got an INTERR if I optimized jcc conditionals without marking the lists dirty.
 		blk->mark_lists_dirty();
-		blk->mba->verify(true);
+
+		// Verifying the whole graph after every rewrite is what makes big
+		// functions slow, so that's the first thing to go. If the rewrite
+		// broke something, put the instruction back the way it was.
+		if (mode == GOV_FULL && !CommitOrRollback(blk->mba, journal, true, XF_PATTERN, ins->ea))
+			retVal = 0;
 		//blk->mba->optimize_local(0);
 		// ... verify we haven't corrupted anything 
 		//blk->mba->verify(true);
 	}
+	uint64 nsEnd = get_nsec_stamp();
+	timer.Finish(nsEnd);
+	gs->Charge(GOV_PATTERN, nsEnd - nsStart, 1);
 	return retVal;
 }
 
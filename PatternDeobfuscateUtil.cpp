@@ -351,16 +351,24 @@ bool XorSimplifier::Simplify(minsn_t *insn)
 	if (!DidSimplify())
 		return false;
 
+	Cancel(insn);
+	return true;
+}
+
+// The second half of Simplify, for callers that want to look at whether the
+// chain can be simplified before changing anything: perform the cancellations
+// that DidSimplify found.
+void XorSimplifier::Cancel(minsn_t *insn)
+{
 	// Perform the cancellations by zeroing out the common micro-operands
 	for (auto zo : m_ZeroOut)
 		zo->make_number(0, zo->size);
 
 	// Trigger Hex-Rays' ordinary optimizations, which will remove the 
-	// XOR 0 terms. Return true.
+	// XOR 0 terms.
 #if IDA_SDK_VERSION == 710
 	insn->optimize_flat();
 #elif IDA_SDK_VERSION >= 720
 	insn->optimize_solo();
 #endif
-	return true;
 }
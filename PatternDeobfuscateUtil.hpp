@@ -35,4 +35,5 @@ public:
 	void Insert(minsn_t *insn);
 	bool DidSimplify();
 	bool Simplify(minsn_t *insn);
+	void Cancel(minsn_t *insn);
 };
\ No newline at end of file
@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <hexrays.hpp>
+#include "HexRaysUtil.hpp"
+#include "PhaseTimer.hpp"
+#include "Config.hpp"
+
+PhaseTimes g_PhaseTimes;
+
+static const char *PhaseToString(int ph)
+{
+	switch (ph)
+	{
+		case PH_UNFLATTEN:                     return "unflatten";
+		case PH_CLASSIFY:                      return "classify";
+		case PH_SINGLE_GOTOS:                  return "remove_single_gotos";
+		case PH_FIND_DISPATCHERS:              return "find_dispatchers";
+		case PH_ANALYZE_DISPATCHER:            return "analyze_dispatcher";
+		case PH_DOMINATORS:                    return "dominators";
+		case PH_STATE_VARS:                    return "solve_state_vars";
+		case PH_RESOLVE:                       return "resolve_predecessor";
+		case PH_ERASURES:                      return "process_erasures";
+		case PH_GRAPH_APPLY:                   return "apply_graph_changes";
+		case PH_PRUNE:                         return "prune_unreachable";
+		case PH_MERGE_CHAINS:                  return "merge_block_chains";
+		case PH_DEAD_STORES:                   return "dead_stores";
+		case PH_REPLAY:                        return "replay_cached_round";
+		case PH_OPTIMIZE_LOCAL:                return "optimize_local";
+		case PH_VERIFY:                        return "verify";
+		case PH_PATTERN:                       return "pattern";
+		case PH_PAT_BNOT_OR_BNOT_CONST:        return "pat_BnotOrBnotConst";
+		case PH_PAT_OR_AND_NOT:                return "pat_OrAndNot";
+		case PH_PAT_OR_VIA_XOR_AND:            return "pat_OrViaXorAnd";
+		case PH_PAT_OR_NEGATED_SAME_CONDITION: return "pat_OrNegatedSameCondition";
+		case PH_PAT_LOGIC_AND1:                return "pat_LogicAnd1";
+		case PH_PAT_AND_XOR:                   return "pat_AndXor";
+		case PH_PAT_MUL_SUB:                   return "pat_MulSub";
+		case PH_PAT_XOR_CHAIN:                 return "pat_XorChain";
+		case PH_PAT_LNOT_OR_LNOT_LNOT:         return "pat_LnotOrLnotLnot";
+	}
+	return "?";
+}
+
+// The phases in a chain, outermost first, separated by sep
+static qstring PathToString(PhasePath path, char sep)
+{
+	qstring s;
+	for (int iShift = (PHASE_PATH_MAX_DEPTH - 1) * PHASE_PATH_BITS; iShift >= 0; iShift -= PHASE_PATH_BITS)
+	{
+		int id = (int)(path >> iShift) & ((1 << PHASE_PATH_BITS) - 1);
+		if (id == 0)
+			continue;
+		if (!s.empty())
+			s += sep;
+		s += PhaseToString(id - 1);
+	}
+	return s;
+}
+
+static qstring FuncName(ea_t ea)
+{
+	qstring name;
+	if (ea == BADADDR)
+		name = "(none)";
+	else if (!get_func_name(&name, ea) || name.empty())
+		name.sprnt("sub_%a", ea);
+	return name;
+}
+
+// Function names can contain nearly anything once the user has renamed them,
+// so they have to be escaped before going into a JSON string ...
+static qstring JsonEscape(const qstring &s)
+{
+	qstring out;
+	for (size_t i = 0; i < s.length(); ++i)
+	{
+		uchar c = s[i];
+		if (c == '"' || c == '\\')
+		{
+			out.append('\\');
+			out.append(c);
+		}
+		else if (c < 0x20)
+			out.cat_sprnt("\\u%04x", c);
+		else
+			out.append(c);
+	}
+	return out;
+}
+
+// ... or a quoted CSV field, where a quote is written twice
+static qstring CsvEscape(const qstring &s)
+{
+	qstring out;
+	for (size_t i = 0; i < s.length(); ++i)
+	{
+		if (s[i] == '"')
+			out.append('"');
+		out.append(s[i]);
+	}
+	return out;
+}
+
+#if PHASE_TIMERS
+// What's been timed on this thread for one function at one maturity level.
+// Adding the times to g_PhaseTimes means taking its lock and searching its
+// maps, which is too much to do every time the instruction optimizer is
+// called, so they're only added once the thread moves on to another function
+// or maturity level, or when the decompilation is finished.
+struct ThreadTimes
+{
+	int nDepth;
+	PhasePath path;
+	ea_t ea;
+	int maturity;
+	std::vector<std::pair<PhasePath, PhaseStats> > times;
+
+	ThreadTimes() : nDepth(0), path(0), ea(BADADDR), maturity(MMAT_ZERO) {};
+	void Record(PhasePath p, uint64 ns, int n)
+	{
+		for (auto &t : times)
+		{
+			if (t.first == p)
+			{
+				t.second.Add(ns, n);
+				return;
+			}
+		}
+		times.emplace_back(p, PhaseStats());
+		times.back().second.Add(ns, n);
+	}
+	void Switch(ea_t newEa, int newMaturity)
+	{
+		if (newEa == ea && newMaturity == maturity)
+			return;
+		Flush();
+		ea = newEa;
+		maturity = newMaturity;
+	}
+	void Flush()
+	{
+		if (times.empty())
+			return;
+		g_PhaseTimes.Add(ea, maturity, times);
+		times.clear();
+	}
+};
+
+static thread_local ThreadTimes t_Times;
+
+void PhaseTimer::Start(Phase ph, mbl_array_t *mba)
+{
+	ThreadTimes &tt = t_Times;
+	if (tt.nDepth == 0)
+		tt.Switch(mba != NULL ? mba->entry_ea : BADADDR, mba != NULL ? mba->maturity : MMAT_ZERO);
+
+	// Anything nested deeper than a path can hold isn't recorded
+	m_bNested = tt.nDepth < PHASE_PATH_MAX_DEPTH;
+	if (m_bNested)
+		tt.path = (tt.path << PHASE_PATH_BITS) | (PhasePath)(ph + 1);
+	++tt.nDepth;
+	m_bFinished = false;
+}
+
+PhaseTimer::PhaseTimer(Phase ph, mbl_array_t *mba)
+{
+	Start(ph, mba);
+	m_nsStart = get_nsec_stamp();
+}
+
+PhaseTimer::PhaseTimer(Phase ph, mbl_array_t *mba, uint64 nsStart)
+{
+	Start(ph, mba);
+	m_nsStart = nsStart;
+}
+
+void PhaseTimer::Finish(uint64 nsEnd)
+{
+	if (m_bFinished)
+		return;
+	m_bFinished = true;
+	ThreadTimes &tt = t_Times;
+	if (m_bNested)
+	{
+		tt.Record(tt.path, nsEnd - m_nsStart, 1);
+		tt.path >>= PHASE_PATH_BITS;
+	}
+	--tt.nDepth;
+}
+
+PhaseTimer::~PhaseTimer()
+{
+	if (!m_bFinished)
+		Finish(get_nsec_stamp());
+}
+
+void PhaseTimer::Flush()
+{
+	t_Times.Flush();
+}
+#endif
+
+// Add the times that one thread collected. If this is a function we
+// haven't timed before, forget the least recently timed one to make room.
+void PhaseTimes::Add(ea_t ea, int maturity, const std::vector<std::pair<PhasePath, PhaseStats> > &times)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	auto it = m_Functions.find(ea);
+	if (it == m_Functions.end())
+	{
+		while (m_Functions.size() >= SESSION_MAX_TIMINGS)
+		{
+			auto oldest = m_Functions.begin();
+			for (auto jt = m_Functions.begin(); jt != m_Functions.end(); ++jt)
+				if (jt->second.nLastUsed < oldest->second.nLastUsed)
+					oldest = jt;
+			m_Functions.erase(oldest);
+		}
+		it = m_Functions.insert(std::make_pair(ea, FunctionTimes())).first;
+	}
+	it->second.nLastUsed = ++m_nTicks;
+	for (auto &t : times)
+	{
+		PhaseStats &ps = it->second.phases[Key(maturity, t.first)];
+		ps.nCalls += t.second.nCalls;
+		ps.nsTotal += t.second.nsTotal;
+		if (t.second.nsMax > ps.nsMax)
+			ps.nsMax = t.second.nsMax;
+	}
+}
+
+void PhaseTimes::WriteJson(FILE *fp)
+{
+	qfprintf(fp, "{\n  \"functions\": [");
+	bool bFirstGroup = true;
+	for (auto &kv : m_Functions)
+	{
+		qstring name = JsonEscape(FuncName(kv.first));
+		int iMaturity = -1;
+		for (auto &ph : kv.second.phases)
+		{
+			// A new object for each maturity level; the phases are sorted by
+			// maturity first
+			if (ph.first.first != iMaturity)
+			{
+				if (iMaturity != -1)
+					qfprintf(fp, "\n      ]\n    }");
+				iMaturity = ph.first.first;
+				qfprintf(fp, "%s\n    {\n      \"ea\": \"%a\",\n      \"name\": \"%s\",\n      \"maturity\": \"%s\",\n      \"phases\": [", bFirstGroup ? "" : ",", kv.first, name.c_str(), MicroMaturityToString((mba_maturity_t)iMaturity));
+				bFirstGroup = false;
+				qfprintf(fp, "\n");
+			}
+			else
+				qfprintf(fp, ",\n");
+			qfprintf(fp, "        { \"path\": \"%s\", \"calls\": %llu, \"total_ns\": %llu, \"max_ns\": %llu }", PathToString(ph.first.second, ';').c_str(), ph.second.nCalls, ph.second.nsTotal, ph.second.nsMax);
+		}
+		if (iMaturity != -1)
+			qfprintf(fp, "\n      ]\n    }");
+	}
+	qfprintf(fp, "\n  ]\n}\n");
+}
+
+void PhaseTimes::WriteCsv(FILE *fp)
+{
+	qfprintf(fp, "ea,name,maturity,path,calls,total_ns,max_ns\n");
+	for (auto &kv : m_Functions)
+	{
+		qstring name = CsvEscape(FuncName(kv.first));
+		for (auto &ph : kv.second.phases)
+			qfprintf(fp, "%a,\"%s\",%s,%s,%llu,%llu,%llu\n", kv.first, name.c_str(), MicroMaturityToString((mba_maturity_t)ph.first.first), PathToString(ph.first.second, ';').c_str(), ph.second.nCalls, ph.second.nsTotal, ph.second.nsMax);
+	}
+}
+
+// Folded stacks want the time spent in each phase itself, i.e., not in the
+// phases nested within it, which is what's left after taking away the time
+// recorded for the chains one phase longer.
+void PhaseTimes::WriteFolded(FILE *fp)
+{
+	for (auto &kv : m_Functions)
+	{
+		std::map<Key, uint64> self;
+		for (auto &ph : kv.second.phases)
+			self[ph.first] += ph.second.nsTotal;
+		for (auto &ph : kv.second.phases)
+		{
+			Key parent(ph.first.first, ph.first.second >> PHASE_PATH_BITS);
+			auto it = self.find(parent);
+			if (parent.second != 0 && it != self.end())
+				it->second -= std::min(it->second, ph.second.nsTotal);
+		}
+
+		qstring name = FuncName(kv.first);
+		for (auto &s : self)
+		{
+			if (s.second < 1000)
+				continue;
+			qfprintf(fp, "%s;%s;%s %llu\n", name.c_str(), MicroMaturityToString((mba_maturity_t)s.first.first), PathToString(s.first.second, ';').c_str(), s.second / 1000);
+		}
+	}
+}
+
+// Write path as JSON, and alongside it, the same with .csv and .folded in
+// place of its extension
+bool PhaseTimes::Export(const char *path)
+{
+	qstring base(path);
+	const char *dot = strrchr(path, '.');
+	if (dot != NULL && strpbrk(dot, "/\\") == NULL)
+		base.resize(dot - path);
+
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	qstring names[3] = { base, base, base };
+	names[0] += ".json";
+	names[1] += ".csv";
+	names[2] += ".folded";
+	for (int i = 0; i < 3; ++i)
+	{
+		FILE *fp = qfopen(names[i].c_str(), "w");
+		if (fp == NULL)
+		{
+			msg("[E] Couldn't open %s for writing\n", names[i].c_str());
+			return false;
+		}
+		if (i == 0)
+			WriteJson(fp);
+		else if (i == 1)
+			WriteCsv(fp);
+		else
+			WriteFolded(fp);
+		qfclose(fp);
+	}
+	msg("[I] Wrote the phase timings for %d functions to %s, %s and %s\n", (int)m_Functions.size(), names[0].c_str(), names[1].c_str(), names[2].c_str());
+	return true;
+}
+
+void PhaseTimes::Clear()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_Functions.clear();
+}
+
+size_t PhaseTimes::Size()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	return m_Functions.size();
+}
+
+size_t PhaseTimes::BytesUsed()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	size_t nBytes = NodeBytes<std::pair<ea_t, FunctionTimes> >(m_Functions.size());
+	for (auto &kv : m_Functions)
+		nBytes += NodeBytes<std::pair<Key, PhaseStats> >(kv.second.phases.size());
+	return nBytes;
+}
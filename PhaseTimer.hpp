@@ -0,0 +1,131 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <hexrays.hpp>
+#include "Config.hpp"
+
+// The parts of the deobfuscation passes whose time is measured separately.
+// The PH_PAT_* phases are the individual patterns of the instruction
+// optimizer.
+enum Phase
+{
+	PH_UNFLATTEN,
+	PH_CLASSIFY,
+	PH_SINGLE_GOTOS,
+	PH_FIND_DISPATCHERS,
+	PH_ANALYZE_DISPATCHER,
+	PH_DOMINATORS,
+	PH_STATE_VARS,
+	PH_RESOLVE,
+	PH_ERASURES,
+	PH_GRAPH_APPLY,
+	PH_PRUNE,
+	PH_MERGE_CHAINS,
+	PH_DEAD_STORES,
+	PH_REPLAY,
+	PH_OPTIMIZE_LOCAL,
+	PH_VERIFY,
+	PH_PATTERN,
+	PH_PAT_BNOT_OR_BNOT_CONST,
+	PH_PAT_OR_AND_NOT,
+	PH_PAT_OR_VIA_XOR_AND,
+	PH_PAT_OR_NEGATED_SAME_CONDITION,
+	PH_PAT_LOGIC_AND1,
+	PH_PAT_AND_XOR,
+	PH_PAT_MUL_SUB,
+	PH_PAT_XOR_CHAIN,
+	PH_PAT_LNOT_OR_LNOT_LNOT,
+	PH_NUM_PHASES,
+};
+
+// Times a phase from construction to destruction. Timers nest, and each one
+// is recorded under the chain of timers around it on the same thread, so the
+// same phase reached in different ways is kept apart. The outermost timer
+// on a thread says which function and maturity level the time is for. The
+// times are collected on the thread, and only added to g_PhaseTimes once the
+// thread starts timing another function or maturity level, or when Flush is
+// called, which is done when a decompilation finishes.
+//
+// Callers that read the clock themselves anyway can pass in the time the 
+// phase started, and call Finish with the time it ended, rather than have 
+// the timer read the clock again.
+//
+// With PHASE_TIMERS set to 0, the timers compile to nothing.
+struct PhaseTimer
+{
+#if PHASE_TIMERS
+	PhaseTimer(Phase ph, mbl_array_t *mba = NULL);
+	PhaseTimer(Phase ph, mbl_array_t *mba, uint64 nsStart);
+	~PhaseTimer();
+	void Finish(uint64 nsEnd);
+	static void Flush();
+
+private:
+	uint64 m_nsStart;
+	bool m_bNested;
+	bool m_bFinished;
+
+	void Start(Phase ph, mbl_array_t *mba);
+#else
+	PhaseTimer(Phase ph, mbl_array_t *mba = NULL) {};
+	PhaseTimer(Phase ph, mbl_array_t *mba, uint64 nsStart) {};
+	void Finish(uint64 nsEnd) {};
+	static void Flush() {};
+#endif
+};
+
+struct PhaseStats
+{
+	uint64 nCalls;
+	uint64 nsTotal;
+	uint64 nsMax;
+
+	PhaseStats() : nCalls(0), nsTotal(0), nsMax(0) {};
+	void Add(uint64 ns, int n)
+	{
+		nCalls += n;
+		nsTotal += ns;
+		if (ns > nsMax)
+			nsMax = ns;
+	}
+};
+
+// A chain of nested phases, outermost first, packed PHASE_PATH_BITS to a
+// phase. 0 is the empty chain.
+typedef uint64 PhasePath;
+#define PHASE_PATH_BITS 5
+#define PHASE_PATH_MAX_DEPTH 12
+
+// The time spent in each phase, per function and maturity level, for the
+// SESSION_MAX_TIMINGS functions worked on most recently. Export writes it all
+// out as JSON, as CSV, and as folded stacks (one line per chain of phases,
+// with the time spent in the innermost one itself, in microseconds) for
+// flamegraph.pl and similar tools.
+struct PhaseTimes
+{
+	PhaseTimes() : m_nTicks(0) {};
+	void Add(ea_t ea, int maturity, const std::vector<std::pair<PhasePath, PhaseStats> > &times);
+	bool Export(const char *path);
+	void Clear();
+	size_t Size();
+	size_t BytesUsed();
+
+private:
+	typedef std::pair<int, PhasePath> Key;
+	struct FunctionTimes
+	{
+		uint64 nLastUsed;
+		std::map<Key, PhaseStats> phases;
+	};
+	std::map<ea_t, FunctionTimes> m_Functions;
+	uint64 m_nTicks;
+	std::mutex m_Mutex;
+
+	void WriteJson(FILE *fp);
+	void WriteCsv(FILE *fp);
+	void WriteFolded(FILE *fp);
+};
+
+extern PhaseTimes g_PhaseTimes;
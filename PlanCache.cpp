@@ -0,0 +1,81 @@
+#include <hexrays.hpp>
+#include "HexRaysUtil.hpp"
+#include "PlanCache.hpp"
+#include "Config.hpp"
+
+PlanCache g_PlanCache;
+
+size_t CachedFunction::BytesUsed() const
+{
+	size_t nBytes = sizeof(*this) + rounds.capacity() * sizeof(CachedRound);
+	for (auto &round : rounds)
+	{
+		nBytes += round.dispatchers.capacity() * sizeof(CachedDispatcher);
+		for (auto &cd : round.dispatchers)
+		{
+			nBytes += cd.plans.capacity() * sizeof(CachedPlan);
+			for (auto &cp : cd.plans)
+				nBytes += cp.erasures.capacity() * sizeof(cp.erasures[0]);
+		}
+	}
+	return nBytes;
+}
+
+// Look up the rounds for a function whose microcode at MMAT_LOCOPT hashed to
+// hash. Returns NULL if there aren't any, or if they were for different
+// microcode.
+PlanCache::Entry PlanCache::Find(ea_t ea, uint64 hash)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	auto it = m_Functions.find(ea);
+	if (it == m_Functions.end() || it->second.entry->hash != hash)
+	{
+		++m_nMisses;
+		return Entry();
+	}
+	++m_nHits;
+	it->second.nLastUsed = ++m_nTicks;
+	return it->second.entry;
+}
+
+// Remember the rounds for a function, replacing whatever was there before
+void PlanCache::Store(ea_t ea, const Entry &entry)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	auto it = m_Functions.find(ea);
+	if (it == m_Functions.end())
+	{
+		while (m_Functions.size() >= SESSION_MAX_PLANS)
+		{
+			auto oldest = m_Functions.begin();
+			for (auto jt = m_Functions.begin(); jt != m_Functions.end(); ++jt)
+				if (jt->second.nLastUsed < oldest->second.nLastUsed)
+					oldest = jt;
+			m_Functions.erase(oldest);
+		}
+		it = m_Functions.insert(std::make_pair(ea, Slot())).first;
+	}
+	it->second.entry = entry;
+	it->second.nLastUsed = ++m_nTicks;
+}
+
+void PlanCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_Functions.clear();
+}
+
+size_t PlanCache::Size()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	return m_Functions.size();
+}
+
+size_t PlanCache::BytesUsed()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	size_t nBytes = NodeBytes<std::pair<ea_t, Slot> >(m_Functions.size());
+	for (auto &kv : m_Functions)
+		nBytes += kv.second.entry->BytesUsed();
+	return nBytes;
+}
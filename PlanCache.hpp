@@ -0,0 +1,92 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <hexrays.hpp>
+#include "Governor.hpp"
+
+// A PredPlan as it was applied, with the instructions it erased given by
+// their block numbers and positions within those blocks rather than by
+// pointers, so that it can be applied to another copy of the same microcode.
+// iPathOperand says which operand of the last erasure on the way to the
+// state variable (0 for l, 1 for r, 2 for d) holds the variable that tells
+// the paths of a two-way block apart.
+struct CachedPlan
+{
+	int iPred;
+	int iKind;
+	int iDestNo;
+	int iNonJcc;
+	int iGotoTarget;
+	int iJccTarget;
+	int iTwoWay;
+	uint64 pathKey;
+	int iPathErasures;
+	int iPathOperand;
+	int nShared;
+	std::vector<std::pair<int, int> > erasures;
+};
+
+// The plans applied to one dispatcher, in the order they were applied
+struct CachedDispatcher
+{
+	int iDispatch;
+	std::vector<CachedPlan> plans;
+};
+
+// One round of unflattening: what the microcode looked like beforehand, the
+// mode it was done in, what was done, and what came of it
+struct CachedRound
+{
+	mba_maturity_t maturity;
+	uint64 hash;
+	GovernorMode mode;
+	int nRecovered;
+	int nUnresolved;
+	std::vector<CachedDispatcher> dispatchers;
+};
+
+// Every round from one decompilation of a function, keyed by the hash of the
+// microcode at MMAT_LOCOPT, before anything was done to it
+struct CachedFunction
+{
+	uint64 hash;
+	std::vector<CachedRound> rounds;
+
+	size_t BytesUsed() const;
+};
+
+// The outcome of the unflattener's analysis for the functions decompiled
+// recently. Refreshing a function's pseudocode regenerates its microcode,
+// which is usually exactly the same as the last time; in that case, the
+// rounds can be replayed without any of the analysis. Entries are shared,
+// and never modified once stored, so several decompilations can replay the
+// same one at once. At most SESSION_MAX_PLANS functions are kept; the least
+// recently used ones are forgotten first.
+struct PlanCache
+{
+	typedef std::shared_ptr<const CachedFunction> Entry;
+
+	PlanCache() : m_nHits(0), m_nMisses(0), m_nTicks(0) {};
+	Entry Find(ea_t ea, uint64 hash);
+	void Store(ea_t ea, const Entry &entry);
+	void Clear();
+	size_t Size();
+	size_t BytesUsed();
+
+	int m_nHits;
+	int m_nMisses;
+
+private:
+	struct Slot
+	{
+		Entry entry;
+		uint64 nLastUsed;
+	};
+	std::map<ea_t, Slot> m_Functions;
+	uint64 m_nTicks;
+	std::mutex m_Mutex;
+};
+
+extern PlanCache g_PlanCache;
@@ -0,0 +1,386 @@
+#define USE_DANGEROUS_FUNCTIONS
+#include <algorithm>
+#include <hexrays.hpp>
+#include "HexRaysUtil.hpp"
+#include "DefUtil.hpp"
+#include "StateVarSolver.hpp"
+#include "PhaseTimer.hpp"
+#include "Config.hpp"
+
+static int debugmsg(const char *fmt, ...)
+{
+#if UNFLATTENVERBOSE
+	va_list va;
+	va_start(va, fmt);
+	return vmsg(fmt, va);
+#endif
+	return 0;
+}
+
+// Most variables that we'll track at once. The state variables are rarely
+// copied around more than a handful of times, so if there are more than this,
+// something else is going on.
+#define MAX_STATE_VARS 64
+
+bool StateConstSet::Add(uint64 value)
+{
+	if (bTop)
+		return false;
+	auto it = std::lower_bound(values.begin(), values.end(), value);
+	if (it != values.end() && *it == value)
+		return false;
+	if (values.size() >= MAX_STATE_CONSTS)
+		SetTop();
+	else
+		values.insert(it, value);
+	return true;
+}
+
+bool StateConstSet::Merge(const StateConstSet &rhs)
+{
+	if (bTop)
+		return false;
+	if (rhs.bTop)
+	{
+		SetTop();
+		return true;
+	}
+	bool bChanged = false;
+	for (auto v : rhs.values)
+		bChanged |= Add(v);
+	return bChanged;
+}
+
+bool StateVarSolution::SingleConstant(int iBlock, uint64 &value) const
+{
+	if (iBlock < 0 || iBlock >= m_AtEnd.size() || !m_AtEnd[iBlock].IsSingle())
+		return false;
+	value = m_AtEnd[iBlock].values[0];
+	return true;
+}
+
+// A definition of one of the tracked variables. Every variable also has a
+// pseudo-definition at the function's entry, standing for whatever it held
+// on the way in.
+struct StateDef
+{
+	enum { DEF_ENTRY, DEF_CONST, DEF_COPY, DEF_UNKNOWN };
+	int iKind;
+	int iVar;
+	int iBlock;
+
+	// For DEF_CONST, the constant; for DEF_COPY, the variable copied from
+	uint64 value;
+	int iSrcVar;
+};
+
+// Sets of definitions, one bit each
+typedef std::vector<uint64> DefBits;
+
+static inline void SetDefBit(DefBits &bits, int i)
+{
+	bits[i >> 6] |= 1ULL << (i & 63);
+}
+
+// Call fn(i) for every definition i that is in both sets
+template <typename F>
+static void ForEachCommonDef(const DefBits &a, const DefBits &b, F fn)
+{
+	for (int w = 0; w < a.size(); ++w)
+	{
+		for (uint64 bits = a[w] & b[w]; bits != 0; bits &= bits - 1)
+			fn((w << 6) + popcount64((bits & (0 - bits)) - 1));
+	}
+}
+
+static bool IsTrackable(const mop_t &op)
+{
+	return op.t == mop_r || op.t == mop_S;
+}
+
+// Work out what the dispatcher's assignment variable holds at the end of each
+// of the dispatcher's predecessors. This proceeds in three steps:
+// 1. Decide which variables to track: the assignment and comparison variables,
+//    plus anything copied into or out of a tracked variable.
+// 2. Solve for the definitions of those variables that reach the start and
+//    end of each block, as bit vectors, iterating over the blocks in reverse
+//    postorder until nothing changes.
+// 3. Propagate constants from numeric assignments through the copies, again
+//    until nothing changes. A definition that isn't a numeric assignment or
+//    a copy, such as a call that might clobber the variable, makes the
+//    variable's value unknown.
+bool SolveStateVars(mbl_array_t *mba, const CFFlattenInfo &cfi, StateVarSolution &sol)
+{
+	PhaseTimer timer(PH_STATE_VARS);
+	sol.Clear();
+	uint64 nsStart = get_nsec_stamp();
+
+	if (cfi.opAssigned == NULL || cfi.opCompared == NULL || !IsTrackable(*cfi.opAssigned) || !IsTrackable(*cfi.opCompared))
+		return false;
+
+	// Step 1: find the variables. Keep going until no more are added, since
+	// copies of copies count as well.
+	MopInternTable vars;
+	int iAssigned = vars.Intern(cfi.opAssigned);
+	vars.Intern(cfi.opCompared);
+	bool bGrew = true;
+	while (bGrew)
+	{
+		bGrew = false;
+		for (auto &e : cfi.m_Index.m_Copies)
+		{
+			const mop_t &l = e.ins->l, &d = e.ins->d;
+			if (!IsTrackable(l) || !IsTrackable(d))
+				continue;
+			bool bTrackedL = vars.Find(&l) >= 0, bTrackedD = vars.Find(&d) >= 0;
+			if (bTrackedL == bTrackedD)
+				continue;
+			bool bAdded;
+			vars.Intern(bTrackedL ? &d : &l, &bAdded);
+			bGrew |= bAdded;
+		}
+		if (vars.Size() > MAX_STATE_VARS)
+		{
+			debugmsg("[I] State variable solve: too many copies of the state variables\n");
+			return false;
+		}
+	}
+	int nVars = vars.Size();
+
+	mblock_t *mbEntry = mba->get_mblock(0);
+	std::vector<mlist_t> varLists(nVars);
+	mlist_t allVars;
+	for (int i = 0; i < nVars; ++i)
+	{
+		InsertOp(mbEntry, varLists[i], const_cast<mop_t *>(vars.m_Mops[i]));
+		allVars.add(varLists[i]);
+	}
+
+	// Collect the definitions of the variables, in order within each block.
+	// The entry pseudo-definitions come first.
+	std::vector<StateDef> defs;
+	for (int i = 0; i < nVars; ++i)
+	{
+		StateDef sd;
+		sd.iKind = StateDef::DEF_ENTRY;
+		sd.iVar = i;
+		sd.iBlock = -1;
+		sd.value = 0;
+		sd.iSrcVar = -1;
+		defs.push_back(sd);
+	}
+	std::vector<int> blockDefs(mba->qty + 1);
+	for (int i = 0; i < mba->qty; ++i)
+	{
+		blockDefs[i] = defs.size();
+		mblock_t *mb = mba->get_mblock(i);
+		for (minsn_t *ins = mb->head; ins != NULL; ins = ins->next)
+		{
+			mlist_t def = mb->build_def_list(*ins, MAY_ACCESS | FULL_XDSU);
+			if (!def.has_common(allVars))
+				continue;
+			for (int v = 0; v < nVars; ++v)
+			{
+				if (!def.has_common(varLists[v]))
+					continue;
+				StateDef sd;
+				sd.iKind = StateDef::DEF_UNKNOWN;
+				sd.iVar = v;
+				sd.iBlock = i;
+				sd.value = 0;
+				sd.iSrcVar = -1;
+
+				// Only a mov of the whole variable tells us what it holds
+				if (ins->opcode == m_mov && ins->d.size == vars.m_Mops[v]->size && vars.Find(&ins->d) == v)
+				{
+					if (ins->l.t == mop_n)
+					{
+						sd.iKind = StateDef::DEF_CONST;
+						sd.value = ins->l.nnn->value;
+					}
+					else if (IsTrackable(ins->l) && ins->l.size == ins->d.size)
+					{
+						sd.iSrcVar = vars.Find(&ins->l);
+						if (sd.iSrcVar >= 0)
+							sd.iKind = StateDef::DEF_COPY;
+					}
+				}
+				defs.push_back(sd);
+			}
+		}
+	}
+	blockDefs[mba->qty] = defs.size();
+	int nDefs = defs.size();
+	int nWords = (nDefs + 63) / 64;
+
+	// Step 2: reaching definitions. Each block generates the last definition
+	// of each variable that it defines, and kills the rest of that variable's
+	// definitions.
+	std::vector<DefBits> varDefs(nVars, DefBits(nWords, 0));
+	for (int i = 0; i < nDefs; ++i)
+		SetDefBit(varDefs[defs[i].iVar], i);
+
+	std::vector<DefBits> gen(mba->qty, DefBits(nWords, 0));
+	std::vector<uint64> killVars(mba->qty, 0);
+	for (int i = 0; i < mba->qty; ++i)
+	{
+		std::vector<int> lastDef(nVars, -1);
+		for (int d = blockDefs[i]; d < blockDefs[i + 1]; ++d)
+			lastDef[defs[d].iVar] = d;
+		for (int v = 0; v < nVars; ++v)
+		{
+			if (lastDef[v] < 0)
+				continue;
+			SetDefBit(gen[i], lastDef[v]);
+			killVars[i] |= 1ULL << v;
+		}
+	}
+
+	intvec_t rpo;
+	ComputeRPO(mba, rpo);
+
+	std::vector<DefBits> in(mba->qty, DefBits(nWords, 0)), out(mba->qty, DefBits(nWords, 0));
+	std::vector<bool> queued(mba->qty, false);
+	for (auto i : rpo)
+		queued[i] = true;
+	bool bAnyQueued = true;
+	DefBits newIn(nWords), newOut(nWords);
+	while (bAnyQueued)
+	{
+		bAnyQueued = false;
+		for (auto i : rpo)
+		{
+			if (!queued[i])
+				continue;
+			queued[i] = false;
+			++sol.m_nBlockVisits;
+
+			mblock_t *mb = mba->get_mblock(i);
+			std::fill(newIn.begin(), newIn.end(), 0);
+			if (i == 0)
+				for (int v = 0; v < nVars; ++v)
+					SetDefBit(newIn, v);
+			for (auto p : mb->predset)
+				for (int w = 0; w < nWords; ++w)
+					newIn[w] |= out[p][w];
+
+			for (int w = 0; w < nWords; ++w)
+			{
+				uint64 keep = ~0ULL;
+				for (uint64 k = killVars[i]; k != 0; k &= k - 1)
+					keep &= ~varDefs[popcount64((k & (0 - k)) - 1)][w];
+				newOut[w] = gen[i][w] | (newIn[w] & keep);
+			}
+			in[i].swap(newIn);
+			if (newOut != out[i])
+			{
+				out[i].swap(newOut);
+				for (auto s : mb->succset)
+				{
+					queued[s] = true;
+					bAnyQueued = true;
+				}
+			}
+		}
+	}
+
+	// Step 3: work out where each copy got its value from. Within a block,
+	// that's the previous definition of the source variable, if there is
+	// one; otherwise it's whatever reached the start of the block.
+	std::vector<std::vector<int> > sources(nDefs), users(nDefs);
+	for (int i = 0; i < mba->qty; ++i)
+	{
+		std::vector<int> lastDef(nVars, -1);
+		for (int d = blockDefs[i]; d < blockDefs[i + 1]; ++d)
+		{
+			StateDef &sd = defs[d];
+			if (sd.iKind == StateDef::DEF_COPY)
+			{
+				if (lastDef[sd.iSrcVar] >= 0)
+					sources[d].push_back(lastDef[sd.iSrcVar]);
+				else
+					ForEachCommonDef(in[i], varDefs[sd.iSrcVar], [&](int s) { sources[d].push_back(s); });
+				for (auto s : sources[d])
+					users[s].push_back(d);
+			}
+			lastDef[sd.iVar] = d;
+		}
+	}
+
+	// Then propagate the constants along the copies
+	std::vector<StateConstSet> values(nDefs);
+	intvec_t worklist;
+	for (int i = 0; i < nDefs; ++i)
+	{
+		switch (defs[i].iKind)
+		{
+			case StateDef::DEF_CONST:
+				values[i].Add(defs[i].value);
+				worklist.push_back(i);
+				break;
+			case StateDef::DEF_ENTRY:
+			case StateDef::DEF_UNKNOWN:
+				values[i].SetTop();
+				worklist.push_back(i);
+				break;
+		}
+	}
+	while (!worklist.empty())
+	{
+		int d = worklist.back();
+		worklist.pop_back();
+		++sol.m_nValueVisits;
+		for (auto u : users[d])
+			if (values[u].Merge(values[d]))
+				worklist.push_back(u);
+	}
+
+	// Finally, read off the values at the ends of the dispatcher's
+	// predecessors. For single constants, also note which blocks the
+	// definitions that produced them live in.
+	sol.m_AtEnd.resize(mba->qty);
+	sol.m_DefBlocks.resize(mba->qty);
+	std::vector<bool> visited(nDefs, false);
+	intvec_t stack, touched;
+	for (auto p : mba->get_mblock(cfi.iDispatch)->predset)
+	{
+		StateConstSet &atEnd = sol.m_AtEnd[p];
+		ForEachCommonDef(out[p], varDefs[iAssigned], [&](int d)
+		{
+			atEnd.Merge(values[d]);
+			stack.push_back(d);
+		});
+		if (atEnd.values.empty() && !atEnd.bTop)
+			atEnd.SetTop();
+		if (!atEnd.IsSingle())
+		{
+			stack.clear();
+			continue;
+		}
+
+		std::vector<int> &defBlocks = sol.m_DefBlocks[p];
+		while (!stack.empty())
+		{
+			int d = stack.back();
+			stack.pop_back();
+			if (visited[d])
+				continue;
+			visited[d] = true;
+			touched.push_back(d);
+			if (defs[d].iBlock >= 0)
+				defBlocks.push_back(defs[d].iBlock);
+			for (auto s : sources[d])
+				stack.push_back(s);
+		}
+		std::sort(defBlocks.begin(), defBlocks.end());
+		defBlocks.erase(std::unique(defBlocks.begin(), defBlocks.end()), defBlocks.end());
+		for (auto d : touched)
+			visited[d] = false;
+		touched.clear();
+	}
+
+	sol.m_nVars = nVars;
+	sol.m_nDefs = nDefs;
+	sol.m_nsElapsed = get_nsec_stamp() - nsStart;
+	return true;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <vector>
+#include <hexrays.hpp>
+#include "CFFlattenInfo.hpp"
+
+// Most constants that a variable can be known to hold at once before we just
+// say it could be anything
+#define MAX_STATE_CONSTS 8
+
+// The constants that a state variable can hold at some point. If bTop is set,
+// it could hold something other than these, i.e., we don't know.
+struct StateConstSet
+{
+	bool bTop;
+	std::vector<uint64> values;
+
+	StateConstSet() : bTop(false) {}
+	bool IsSingle() const { return !bTop && values.size() == 1; }
+	bool Merge(const StateConstSet &rhs);
+	bool Add(uint64 value);
+	void SetTop()
+	{
+		bTop = true;
+		values.clear();
+	}
+};
+
+// Constant propagation for the assignment and comparison variables of a
+// dispatcher, and every variable that is copied into or out of them. Rather
+// than walking backwards from each dispatcher predecessor separately, this
+// solves for reaching definitions of those variables over the whole function
+// at once, so it sees through blocks with several predecessors as long as
+// every path brings the same constant along.
+struct StateVarSolution
+{
+	// What the assignment variable holds at the end of each block. Only
+	// filled in for the predecessors of the dispatcher.
+	std::vector<StateConstSet> m_AtEnd;
+
+	// For each block in m_AtEnd, the blocks containing the definitions that
+	// the constants came from. If any of them change, the answer is stale.
+	std::vector<std::vector<int> > m_DefBlocks;
+
+	// Statistics about the solve
+	int m_nVars;
+	int m_nDefs;
+	int m_nBlockVisits;
+	int m_nValueVisits;
+	uint64 m_nsElapsed;
+
+	StateVarSolution() { Clear(); }
+	bool Valid() const { return !m_AtEnd.empty(); }
+	bool SingleConstant(int iBlock, uint64 &value) const;
+	void Clear()
+	{
+		m_AtEnd.clear();
+		m_DefBlocks.clear();
+		m_nVars = 0;
+		m_nDefs = 0;
+		m_nBlockVisits = 0;
+		m_nValueVisits = 0;
+		m_nsElapsed = 0;
+	}
+
+	// Clear, and give back the memory too
+	void Release()
+	{
+		Clear();
+		std::vector<StateConstSet>().swap(m_AtEnd);
+		std::vector<std::vector<int> >().swap(m_DefBlocks);
+	}
+	size_t BytesUsed() const
+	{
+		size_t nBytes = m_AtEnd.capacity() * sizeof(StateConstSet) + m_DefBlocks.capacity() * sizeof(std::vector<int>);
+		for (auto &s : m_AtEnd)
+			nBytes += s.values.capacity() * sizeof(uint64);
+		for (auto &v : m_DefBlocks)
+			nBytes += v.capacity() * sizeof(int);
+		return nBytes;
+	}
+};
+
+bool SolveStateVars(mbl_array_t *mba, const CFFlattenInfo &cfi, StateVarSolution &sol);
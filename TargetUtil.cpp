@@ -1,6 +1,8 @@
 #include <hexrays.hpp>
 #include "HexRaysUtil.hpp"
 #include "TargetUtil.hpp"
+#include "PhaseTimer.hpp"
+#include "Config.hpp"
 
 static int debugmsg(const char *fmt, ...)
 {
@@ -14,7 +16,7 @@ static int debugmsg(const char *fmt, ...)
 
 // Append a goto onto a non-empty block, which is assumed not to already have
 // a goto at the end of it.
-void AppendGotoOntoNonEmptyBlock(mblock_t *blk, int iBlockDest)
+void AppendGotoOntoNonEmptyBlock(mblock_t *blk, int iBlockDest, EditJournal *journal)
 {
 	assert(blk->tail != NULL);
 	
@@ -31,14 +33,22 @@ void AppendGotoOntoNonEmptyBlock(mblock_t *blk, int iBlockDest)
 	
 	// Add it onto the block
 	blk->insert_into_block(newGoto, blk->tail);
+	if (journal != NULL)
+		journal->Inserted(blk, newGoto);
 }
 
 // For a block with a single successor, change its target from some old block
 // to a new block. This is only on the graph level, not in terms of gotos.
-void ChangeSingleTarget(mblock_t *blk, int iOldTarget, int iNewTarget)
+void ChangeSingleTarget(mblock_t *blk, int iOldTarget, int iNewTarget, EditJournal *journal)
 {
 	assert(blk->nsucc() == 1);
 	mbl_array_t *mba = blk->mba;
+	if (journal != NULL)
+	{
+		journal->SaveBlock(blk);
+		journal->SaveBlock(mba->get_mblock(iNewTarget));
+		journal->SaveBlock(mba->get_mblock(iOldTarget));
+	}
 	
 	// Overwrite the successor with the new target
 	blk->succset[0] = iNewTarget;
@@ -68,8 +78,10 @@ bool is_call_block(mblock_t *blk)
 // but simply falls through to a block with a single goto on it. Also, this
 // process happens recursively; i.e., if A goes to B, and B goes to C, and C
 // goes to D, then after we've done our tranformations, A will go to D.
-int RemoveSingleGotos(mbl_array_t *mba)
+int RemoveSingleGotos(mbl_array_t *mba, EditJournal *journal)
 {
+	PhaseTimer timer(PH_SINGLE_GOTOS);
+
 	// This information determines, ultimately, to which block a goto will go.
 	// As mentioned in the function comment, this accounts for gotos-to-gotos.
 	int *forwarderInfo = new int[mba->qty];
@@ -164,17 +176,21 @@ int RemoveSingleGotos(mbl_array_t *mba)
 
 		// If the block had a goto, overwrite its block destination.
 		if (bWasGoto)
+		{
+			if (journal != NULL)
+				journal->SaveInsn(blk, mgoto);
 			mgoto->l.b = iGotoTarget;
+		}
 
 		// Otherwise, add a goto onto the block. You might think you could skip
 		// this step and just change the successor information, but you'll get
 		// an INTERR if you do.
 		else
-			AppendGotoOntoNonEmptyBlock(blk, iGotoTarget);
+			AppendGotoOntoNonEmptyBlock(blk, iGotoTarget, journal);
 
 		// Change the successor/predecessor information for this block and its
 		// old and new target.
-		ChangeSingleTarget(blk, iOriginalGotoTarget, iGotoTarget);
+		ChangeSingleTarget(blk, iOriginalGotoTarget, iGotoTarget, journal);
 		
 		// Counter of the number of blocks changed.
 		++iRetVal;
@@ -261,8 +277,9 @@ void DeferredGraphModifier::Replace(int src, int oldDest, int newDest)
 }
 
 // Apply the planned changes to the graph
-int DeferredGraphModifier::Apply(mbl_array_t *mba)
+int DeferredGraphModifier::Apply(mbl_array_t *mba, DominatorTree *domTree)
 {
+	PhaseTimer timer(PH_GRAPH_APPLY);
 	int iChanged = 0;
 	
 	// Iterate through the edges slated for removal
@@ -272,6 +289,11 @@ int DeferredGraphModifier::Apply(mbl_array_t *mba)
 		mblock_t *mDst = mba->get_mblock(re.second);
 		
 		// Remove the source as a predecessor for dest, and vice versa
+		if (m_Journal != NULL)
+		{
+			m_Journal->SaveBlock(mSrc);
+			m_Journal->SaveBlock(mDst);
+		}
 		mSrc->succset.del(mDst->serial);
 		mDst->predset.del(mSrc->serial);
 
@@ -288,6 +310,11 @@ int DeferredGraphModifier::Apply(mbl_array_t *mba)
 		mblock_t *mDst = mba->get_mblock(ae.second);
 
 		// Add the source as a predecessor for dest, and vice versa
+		if (m_Journal != NULL)
+		{
+			m_Journal->SaveBlock(mSrc);
+			m_Journal->SaveBlock(mDst);
+		}
 		mSrc->succset.add(mDst->serial);
 		mDst->predset.add(mSrc->serial);
 
@@ -296,6 +323,28 @@ int DeferredGraphModifier::Apply(mbl_array_t *mba)
 #endif
 		++iChanged;
 	}
+
+	// Bring the dominator tree up-to-date with the new graph structure. Only
+	// the subtree affected by the edits is recomputed.
+	if (domTree != NULL && iChanged != 0)
+	{
+#if DOMVERIFY
+		uint64 tStart = get_nsec_stamp();
+#endif
+		domTree->ApplyEdits(mba, m_RemoveEdges, m_AddEdges);
+#if DOMVERIFY
+		// Check the incremental result against a from-scratch computation,
+		// and report how long each of them took.
+		uint64 tIncremental = get_nsec_stamp() - tStart;
+		DominatorTree full;
+		tStart = get_nsec_stamp();
+		full.Compute(mba);
+		uint64 tFull = get_nsec_stamp() - tStart;
+		if (!(full == *domTree))
+			msg("[E] Incremental dominator tree does not match full recomputation\n");
+		msg("[I] %d edits on %d blocks: incremental dominator update %llu us, full recomputation %llu us\n", m_RemoveEdges.size() + m_AddEdges.size(), mba->qty, tIncremental / 1000, tFull / 1000);
+#endif
+	}
 	return iChanged;
 }
 
@@ -309,7 +358,7 @@ bool DeferredGraphModifier::ChangeGoto(mblock_t *blk, int iOld, int iNew)
 	
 	// If the last instruction isn't a goto, add a new one
 	if (blk->tail->opcode != m_goto)
-		AppendGotoOntoNonEmptyBlock(blk, iNew);
+		AppendGotoOntoNonEmptyBlock(blk, iNew, m_Journal);
 
 	// Otherwise, if it is a goto...
 	else
@@ -322,7 +371,11 @@ bool DeferredGraphModifier::ChangeGoto(mblock_t *blk, int iOld, int iNew)
 		
 		// And if so, do it
 		else
+		{
+			if (m_Journal != NULL)
+				m_Journal->SaveInsn(blk, blk->tail);
 			blk->tail->l.b = iNew;
+		}
 	}
 	
 	// If we did change the destination, plan to update the graph later
@@ -376,8 +429,13 @@ void DeleteBlock(mblock_t *mb)
 // At the time of writing, I'm still coordinating with Hex-Rays to see if I can
 // make use of internal decompiler machinery to perform elimination. If I can,
 // we'll use that instead of this function. For now, we prune manually.
-int PruneUnreachable(mbl_array_t *mba)
+//
+// Since removing blocks renumbers the remaining ones, a dominator tree for the
+// graph can be passed in, and it will be renumbered to match.
+int PruneUnreachable(mbl_array_t *mba, DominatorTree *domTree)
 {
+	PhaseTimer timer(PH_PRUNE);
+
 	// This set marks the vertices we've already visited. This both prevents 
 	// infinite loops in the depth-first search, as well as records the 
 	// unreachable blocks after the search terminates.
@@ -430,11 +488,184 @@ int PruneUnreachable(mbl_array_t *mba)
 		}
 	}
 	
+	// Remember which block object had which number, so that we can work out
+	// how the blocks were renumbered afterwards.
+	std::vector<mblock_t *> blocksBefore;
+	if (domTree != NULL && nRemoved != 0)
+		for (int i = 0; i < mba->qty; ++i)
+			blocksBefore.push_back(mba->get_mblock(i));
+
 	// At this point we have to explicitly trigger removal of empty blocks. If
 	// we don't, we'll get an INTERR.
 	if(nRemoved != 0)
 		mba->remove_empty_blocks();
 
+	// Map the old block numbers onto the new ones, and renumber the dominator
+	// tree accordingly. The removed blocks' objects have been freed, so we 
+	// only compare their pointers, never dereference them.
+	if (domTree != NULL && nRemoved != 0)
+	{
+		std::map<mblock_t *, int> newNumbers;
+		for (int i = 0; i < mba->qty; ++i)
+			newNumbers[mba->get_mblock(i)] = i;
+		
+		intvec_t oldToNew;
+		oldToNew.resize(blocksBefore.size(), -1);
+		for (int i = 0; i < blocksBefore.size(); ++i)
+		{
+			auto it = newNumbers.find(blocksBefore[i]);
+			if (it != newNumbers.end())
+				oldToNew[i] = it->second;
+		}
+		domTree->RemapBlocks(mba, oldToNew);
+	}
+
 	// Returns the number of blocks removed.
 	return nRemoved;
 }
+
+// Can the block numbered iSrc absorb its sole successor? Both blocks have to
+// be ordinary ones, linked by a single edge that is the only way into the
+// successor, and the successor mustn't loop back onto itself.
+static bool CanMergeWithSucc(mbl_array_t *mba, int iSrc)
+{
+	mblock_t *src = mba->get_mblock(iSrc);
+	if (iSrc == 0 || src->type != BLT_1WAY || src->nsucc() != 1 || is_call_block(src))
+		return false;
+
+	int iDst = src->succ(0);
+	mblock_t *dst = mba->get_mblock(iDst);
+	if (iDst == iSrc || iDst == 0 || iDst == mba->qty - 1 || dst->npred() != 1)
+		return false;
+	if (dst->type == BLT_STOP || dst->type == BLT_XTRN)
+		return false;
+	for (auto iSucc : dst->succset)
+		if (iSucc == iDst)
+			return false;
+
+	// The source either jumps to the successor, or falls through to it.
+	minsn_t *srcTail = src->tail;
+	if (srcTail != NULL && srcTail->opcode != m_goto && iDst != iSrc + 1)
+		return false;
+
+	// If the successor falls through to the next block, the merged block 
+	// will too, which only works out if the successor is already right after
+	// the source, or if we can add a goto instead.
+	bool bFallsThrough = dst->type == BLT_2WAY || (dst->type == BLT_1WAY && (dst->tail == NULL || dst->tail->opcode != m_goto));
+	if (bFallsThrough && iDst != iSrc + 1)
+	{
+		if (dst->type != BLT_1WAY || dst->tail == NULL || is_call_block(dst))
+			return false;
+	}
+	return true;
+}
+
+// Move the instructions of a block's sole successor onto the end of the block
+// and take over the successor's outgoing edges, leaving the successor empty
+// and disconnected.
+static void MergeWithSucc(mbl_array_t *mba, mblock_t *src, EditJournal *journal)
+{
+	int iDst = src->succ(0);
+	mblock_t *dst = mba->get_mblock(iDst);
+
+	// If the successor is going to be separated from the block it falls 
+	// through to, make the transfer explicit.
+	if (iDst != src->serial + 1 && dst->type == BLT_1WAY && dst->tail->opcode != m_goto)
+		AppendGotoOntoNonEmptyBlock(dst, dst->succ(0), journal);
+
+	// The goto to the successor is superfluous now. If the merge might be
+	// undone, the journal hangs onto it.
+	minsn_t *srcTail = src->tail;
+	if (srcTail != NULL && srcTail->opcode == m_goto)
+	{
+		minsn_t *prev = srcTail->prev;
+		src->remove_from_block(srcTail);
+		if (journal != NULL)
+			journal->Removed(src, srcTail, prev);
+		else
+			delete srcTail;
+	}
+
+	// Move the instructions over, in order
+	while (dst->head != NULL)
+	{
+		minsn_t *ins = dst->head;
+		dst->remove_from_block(ins);
+		src->insert_into_block(ins, src->tail);
+		if (journal != NULL)
+			journal->Moved(dst, NULL, src, ins);
+	}
+
+	// Take over the successor's outgoing edges
+	if (journal != NULL)
+	{
+		journal->SaveBlock(src);
+		journal->SaveBlock(dst);
+	}
+	src->succset.clear();
+	for (auto iSucc : dst->succset)
+	{
+		mblock_t *succ = mba->get_mblock(iSucc);
+		if (journal != NULL)
+			journal->SaveBlock(succ);
+		succ->predset.del(iDst);
+		succ->predset.add(src->serial);
+		src->succset.add(iSucc);
+	}
+	src->type = dst->type;
+	if (dst->end > src->end)
+		src->end = dst->end;
+
+	// Disconnect the successor. It's now empty, and remove_empty_blocks will 
+	// get rid of it. Until then, its type has to agree with its lack of 
+	// successors, or the graph won't verify.
+	dst->succset.clear();
+	dst->predset.clear();
+	dst->type = BLT_0WAY;
+}
+
+// Unflattening leaves behind long chains of blocks where each one has only
+// one successor, and that successor has only one predecessor. Hex-Rays would
+// carry them through every later maturity level, so concatenate each chain 
+// into its first block. Blocks are renumbered afterwards, so any dominator 
+// tree for the graph is no longer valid. Returns the number of blocks merged
+// away.
+//
+// If a journal is given, the merges are checked before the emptied blocks are
+// removed, which is the last point at which they can be undone, and the whole
+// graph is verified too if bVerify is set. If either fails, they're rolled 
+// back, and -1 is returned.
+int MergeBlockChains(mbl_array_t *mba, EditJournal *journal, bool bVerify)
+{
+	PhaseTimer timer(PH_MERGE_CHAINS);
+	int nMerged = 0;
+	for (int i = 0; i < mba->qty; ++i)
+	{
+		// Keep absorbing successors until the chain ends
+		bool bMerged = false;
+		while (CanMergeWithSucc(mba, i))
+		{
+			MergeWithSucc(mba, mba->get_mblock(i), journal);
+			bMerged = true;
+			++nMerged;
+		}
+		if (bMerged)
+			mba->get_mblock(i)->mark_lists_dirty();
+	}
+
+	if (journal != NULL && nMerged != 0)
+	{
+		if (!CheckGraphStructure(mba, true) || (bVerify && !VerifyNoThrow(mba)))
+		{
+			journal->Rollback();
+			return -1;
+		}
+		journal->Commit();
+	}
+
+	// Now get rid of the emptied blocks, all at once.
+	if (nMerged != 0)
+		mba->remove_empty_blocks();
+
+	return nMerged;
+}
@@ -1,22 +1,32 @@
 #pragma once
 #include <hexrays.hpp>
+#include "DominatorTree.hpp"
+#include "EditJournal.hpp"
 
-int RemoveSingleGotos(mbl_array_t *mba);
+// The functions that take an EditJournal record their changes in it, if one
+// is given.
+void AppendGotoOntoNonEmptyBlock(mblock_t *blk, int iBlockDest, EditJournal *journal = NULL);
+int RemoveSingleGotos(mbl_array_t *mba, EditJournal *journal = NULL);
 bool SplitMblocksByJccEnding(mblock_t *pred1, mblock_t *pred2, mblock_t *&endsWithJcc, mblock_t *&nonJcc, int &jccDest, int &jccFallthrough);
-int PruneUnreachable(mbl_array_t *mba);
+int PruneUnreachable(mbl_array_t *mba, DominatorTree *domTree = NULL);
+int MergeBlockChains(mbl_array_t *mba, EditJournal *journal = NULL, bool bVerify = false);
 
 // The "deferred graph modifier" records changes that the client wishes to make
 // to a given graph, but does not apply them immediately. Weird things could
 // happen if we were to modify a graph while we were iterating over it, so save
-// the modifications until we're done iterating over the graph.
+// the modifications until we're done iterating over the graph. If a dominator
+// tree is supplied to Apply, it is updated incrementally to reflect the edits.
+// If a journal is supplied, the changes to the graph are recorded in it.
 struct DeferredGraphModifier
 {
+	EditJournal *m_Journal;
+	DeferredGraphModifier(EditJournal *journal = NULL) : m_Journal(journal) {};
 	std::vector<std::pair<int, int> > m_RemoveEdges;
 	std::vector<std::pair<int, int> > m_AddEdges;
 	void Remove(int src, int dest);
 	void Add(int src, int dest);
 	void Replace(int src, int oldDest, int newDest);
-	int Apply(mbl_array_t *mba);
+	int Apply(mbl_array_t *mba, DominatorTree *domTree = NULL);
 	bool ChangeGoto(mblock_t *blk, int iOld, int iNew);
 	void Clear() { m_RemoveEdges.clear(); m_AddEdges.clear(); }
 };
\ No newline at end of file
@@ -8,11 +8,16 @@
 #include "CFFlattenInfo.hpp"
 #include "TargetUtil.hpp"
 #include "DefUtil.hpp"
+#include "FlattenClassifier.hpp"
+#include "StateVarSolver.hpp"
+#include "Governor.hpp"
+#include "DeadStoreElim.hpp"
+#include "EditJournal.hpp"
+#include "VerdictStore.hpp"
+#include "PlanCache.hpp"
+#include "PhaseTimer.hpp"
 #include "Config.hpp"
 
-std::set<ea_t> g_BlackList;
-std::set<ea_t> g_WhiteList;
-
 static int debugmsg(const char *fmt, ...)
 {
 #if UNFLATTENVERBOSE
@@ -31,13 +36,9 @@ void DumpMBAToFile(mbl_array_t *mba, const char *fpath)
 	qfclose(fp);
 }
 
-mba_maturity_t g_Last = MMAT_ZERO;
-int g_NumGotosRemoved = 0;
-int atThisMaturity = 0;
-
 // Find the block that dominates iDispPred, and which is one of the targets of
 // the control flow flattening switch.
-mblock_t *CFUnflattener::GetDominatedClusterHead(mbl_array_t *mba, int iDispPred, int &iClusterHead)
+mblock_t *UnflattenContext::GetDominatedClusterHead(mbl_array_t *mba, int iDispPred, int &iClusterHead)
 {
 	mblock_t *mbClusterHead = NULL;
 	// Find the block that is targeted by the dispatcher, and that 
@@ -57,6 +58,14 @@ mblock_t *CFUnflattener::GetDominatedClusterHead(mbl_array_t *mba, int iDispPred
 			debugmsg("[I] Block %d was not part of a dominated cluster\n", iDispPred);
 			return NULL;
 		}
+		
+		// The cluster information was derived from the dominator tree, so this
+		// should never fail. Checking is two integer comparisons, though.
+		if (!cfi.m_DomTree.Dominates(iClusterHead, iDispPred))
+		{
+			debugmsg("[E] Cluster head %d does not dominate block %d\n", iClusterHead, iDispPred);
+			return NULL;
+		}
 		mbClusterHead = mba->get_mblock(iClusterHead);
 #if UNFLATTENVERBOSE
 		debugmsg("[I] Block %d was part of dominated cluster %d\n", iDispPred, iClusterHead);
@@ -77,34 +86,33 @@ mblock_t *CFUnflattener::GetDominatedClusterHead(mbl_array_t *mba, int iDispPred
 // switches to a strategy of searching in the forward direction from 
 // mbClusterHead, looking for assignments to that stack variable.
 // Information about the chain of assignment instructions along the way are
-// stored in the vector called m_DeferredErasuresLocal, a member variable of
-// the CFUnflattener class.
-int CFUnflattener::FindBlockTargetOrLastCopy(mblock_t *mb, mblock_t *mbClusterHead, mop_t *what, bool bAllowMultiSuccs)
+// appended to "erasures". This function does not modify the mba.
+int UnflattenContext::FindBlockTargetOrLastCopy(mblock_t *mb, mblock_t *mbClusterHead, mop_t *what, bool bAllowMultiSuccs, MovChain &erasures, uint64 *pKey)
 {
 	mbl_array_t *mba = mb->mba;
 	int iClusterHead = mbClusterHead->serial;
 
-	MovChain local;
+	MovChain local(erasures.get_allocator());
 
 	mop_t *opNum = NULL, *opCopy;
 	// Search backwards looking for a numeric assignment to "what". We may or 
 	// may not find a numeric assignment, but we might find intervening 
 	// assignments where "what" is copied from other variables.
-	bool bFound = FindNumericDefBackwards(mb, what, opNum, local, true, bAllowMultiSuccs, iClusterHead);
-	
+	bool bFound = FindNumericDefBackwards(mb, what, opNum, local, true, bAllowMultiSuccs, iClusterHead, &m_DefCache);
+
 	// If we found no intervening assignments to "what", that's bad.
 	if (local.empty())
 		return -1;
-	
+
 	// opCopy now contains the last non-numeric assignment that we saw before
 	// FindNumericDefBackwards terminated (either due to not being able to 
 	// follow definitions, or, if bAllowMultiSuccs is true, because it recursed
 	// into a block with more than one successor.
 	opCopy = local.back().opCopy;
-	
+
 	// Copy the assignment chain into the erasures vector, so we can later 
 	// remove them if our analysis succeeds.
-	m_DeferredErasuresLocal.insert(m_DeferredErasuresLocal.end(), local.begin(), local.end());
+	erasures.insert(erasures.end(), local.begin(), local.end());
 
 	// If we didn't find a numeric definition, but we did find an assignment 
 	// from a stack variable, switch to a forward analysis from the beginning
@@ -124,22 +132,27 @@ int CFUnflattener::FindBlockTargetOrLastCopy(mblock_t *mb, mblock_t *mbClusterHe
 		}
 
 	}
-	
+
 	// If we found a numeric assignment...
 	if (bFound)
 	{
 		// Look up the integer number of the block corresponding to that value.
 		int iDestNo = cfi.FindBlockByKey(opNum->nnn->value);
-		
+
 		// If we couldn't find the block, that's bad news. 
 		if (iDestNo < 0)
 			msg("[E] Block %d assigned unknown key %llx to assigned var\n", mb->serial, opNum->nnn->value);
-		
-		// Otherwise, we win! Return the block number.
+
+		// Otherwise, we win! Return the block number, and the key if the 
+		// caller wants it.
 		else
+		{
+			if (pKey != NULL)
+				*pKey = opNum->nnn->value;
 			return iDestNo;
+		}
 	}
-	
+
 	// Negative return code indicates failure.
 	return -1;
 }
@@ -148,9 +161,8 @@ int CFUnflattener::FindBlockTargetOrLastCopy(mblock_t *mb, mblock_t *mbClusterHe
 // such as if statements. Given a block that assigns to the assignment variable
 // that has two predecessors, analyze each of the predecessors looking for 
 // numeric assignments by calling the previous function.
-bool CFUnflattener::HandleTwoPreds(mblock_t *mb, mblock_t *mbClusterHead, mop_t *opCopy, mblock_t *&nonJcc, int &actualGotoTarget, int &actualJccTarget)
+bool UnflattenContext::HandleTwoPreds(mblock_t *mb, mblock_t *mbClusterHead, mop_t *opCopy, mblock_t *&nonJcc, int &actualGotoTarget, int &actualJccTarget, uint64 &gotoKey, MovChain &erasures)
 {
-	char buf[1000];
 	mbl_array_t *mba = mb->mba;
 	int iDispPred = mb->serial;
 	int iClusterHead = mbClusterHead->serial;
@@ -185,7 +197,7 @@ bool CFUnflattener::HandleTwoPreds(mblock_t *mb, mblock_t *mbClusterHead, mop_t
 		debugmsg("[I] Block %d w/preds %d, %d, non-jcc pred %d had %d predecessors (not 1)\n", iDispPred, pred1->serial, pred2->serial, nonJcc->serial, nonJcc->npred());
 		return false;
 	}
-	
+
 	// ... namely, from the block ending with the jcc.
 	if (nonJcc->pred(0) != endsWithJcc->serial)
 	{
@@ -196,14 +208,14 @@ bool CFUnflattener::HandleTwoPreds(mblock_t *mb, mblock_t *mbClusterHead, mop_t
 	// Call the previous function to locate the numeric definition of the 
 	// variable that is used to update the assignment variable if the jcc is
 	// not taken.
-	actualGotoTarget = FindBlockTargetOrLastCopy(endsWithJcc, mbClusterHead, opCopy, false);
-	
+	actualGotoTarget = FindBlockTargetOrLastCopy(endsWithJcc, mbClusterHead, opCopy, false, erasures, &gotoKey);
+
 	// If that succeeded...
 	if (actualGotoTarget >= 0)
 	{
 		// ... then do the same thing when the jcc is not taken.
-		actualJccTarget = FindBlockTargetOrLastCopy(nonJcc, mbClusterHead, opCopy, true);
-		
+		actualJccTarget = FindBlockTargetOrLastCopy(nonJcc, mbClusterHead, opCopy, true, erasures);
+
 		// If that succeeded, great! We can unflatten this two-way block.
 		if (actualJccTarget >= 0)
 			return true;
@@ -213,10 +225,10 @@ bool CFUnflattener::HandleTwoPreds(mblock_t *mb, mblock_t *mbClusterHead, mop_t
 
 // Erase the now-superfluous chain of instructions that were used to copy a
 // numeric value into the assignment variable.
-void CFUnflattener::ProcessErasures(mbl_array_t *mba)
+void UnflattenContext::ProcessErasures(mbl_array_t *mba, const MovChain &erasures)
 {
-	m_PerformedErasuresGlobal.insert(m_PerformedErasuresGlobal.end(), m_DeferredErasuresLocal.begin(), m_DeferredErasuresLocal.end());
-	for (auto erase : m_DeferredErasuresLocal)
+	PhaseTimer timer(PH_ERASURES);
+	for (auto erase : erasures)
 	{
 #if UNFLATTENVERBOSE
 		qstring qs;
@@ -225,10 +237,10 @@ void CFUnflattener::ProcessErasures(mbl_array_t *mba)
 		msg("[I] Erasing %a: %s\n", erase.insMov->ea, qs.c_str());
 #endif
 		// Be gone, sucker
+		m_Journal.SaveInsn(mba->get_mblock(erase.iBlock), erase.insMov);
 		mba->get_mblock(erase.iBlock)->make_nop(erase.insMov);
+		MarkDirty(erase.iBlock);
 	}
-
-	m_DeferredErasuresLocal.clear();
 }
 
 /*
@@ -244,91 +256,159 @@ void RequestBlockCombination(mbl_array_t *mba)
 }
 */
 
-// This is the top-level un-flattening function for an entire graph. Hex-Rays
-// calls this function since we register our CFUnflattener class as a block
-// optimizer.
-int idaapi CFUnflattener::func(mblock_t *blk)
+// Is an instruction one of the predecessor's own erasures, which will be gone
+// by the time the plan has been applied?
+static bool IsPathErasure(const PredPlan &plan, minsn_t *ins)
 {
-	char buf[1000];
-	vd_printer_t vd;
-
-	// Was this function blacklisted? Skip it if so
-	mbl_array_t *mba = blk->mba;
-	if (g_BlackList.find(mba->entry_ea) != g_BlackList.end())
-		return 0;
-
-#if UNFLATTENVERBOSE || UNFLATTENDEBUG
-	const char *matStr = MicroMaturityToString(mba->maturity);
-#endif
-#if UNFLATTENVERBOSE
-	debugmsg("[I] Block optimization called at maturity level %s\n", matStr);
-#endif
-
-	// Only operate once per maturity level
-	if (g_Last == mba->maturity)
-		return 0;
-
-	// Update the maturity level
-	g_Last = mba->maturity;
-
-#if UNFLATTENDEBUG
-	// If we're debugging, save a copy of the graph on disk
-	snprintf(buf, sizeof(buf), "c:\\temp\\dumpBefore-%s-%d.txt", matStr, atThisMaturity);
-	DumpMBAToFile(mba, buf);
-#endif
+	for (size_t i = 0; i < plan.iPathErasures; ++i)
+		if (plan.erasures[i].insMov == ins)
+			return true;
+	return false;
+}
 
-	// We only operate at MMAT_LOCOPT
-	if (mba->maturity != MMAT_LOCOPT)
-		return 0;
+// Branching on opPath at the end of the block only works if it still holds
+// what was copied into the state variable by then. Check that nothing left in
+// the block after the last of the predecessor's own erasures, which is where
+// opPath was copied from, might define it.
+static bool PathVarSurvives(mblock_t *mb, const PredPlan &plan)
+{
+	const MovInfo &last = plan.erasures[plan.iPathErasures - 1];
+	if (last.iBlock != mb->serial)
+		return false;
 
-	int iChanged = 0;
-	
-	// If local optimization has just been completed, remove transfer-to-gotos
-	iChanged = RemoveSingleGotos(mba);
-	//return iChanged;
+	mlist_t ml;
+	if (!InsertOp(mb, ml, plan.opPath))
+		return false;
 
+	for (minsn_t *ins = last.insMov->next; ins != NULL; ins = ins->next)
+	{
+		if (ins->opcode == m_nop || (ins == mb->tail && ins->opcode == m_goto) || IsPathErasure(plan, ins))
+			continue;
+		mlist_t def = mb->build_def_list(*ins, MAY_ACCESS | FULL_XDSU);
+		if (def.has_common(ml))
+		{
 #if UNFLATTENVERBOSE
-	debugmsg("\tRemoved %d vacuous GOTOs\n", iChanged);
+			debugmsg("[I] Block %d redefines the variable its paths are told apart by at %a\n", mb->serial, ins->ea);
 #endif
+			return false;
+		}
+	}
+	return true;
+}
 
-#if UNFLATTENDEBUG
-	snprintf(buf, sizeof(buf), "c:\\temp\\dumpAfter-%s-%d.txt", matStr, atThisMaturity);
-	DumpMBAToFile(mba, buf);
-#endif
+// A two-way predecessor of the dispatcher is reached along two paths, each of
+// which leads somewhere different. The instructions on it that aren't part of
+// the assignment to the state variable are shared by both paths. Decide how
+// to give each path its own destination:
+// * If nothing is shared, the second path can just skip the block.
+// * If only a little is shared, give the second path a copy of it.
+// * Otherwise, keep the shared instructions in one place, and branch at the
+//   end of the block on the variable that was copied into the state
+//   variable, which tells the two paths apart. If the shared instructions
+//   might change that variable, copy them after all.
+void UnflattenContext::ChooseTwoWayStrategy(mblock_t *mb, PredPlan &plan)
+{
+	plan.nShared = 0;
+	for (minsn_t *ins = mb->head; ins != NULL; ins = ins->next)
+	{
+		if (ins->opcode == m_nop || (ins == mb->tail && ins->opcode == m_goto))
+			continue;
+		if (!IsPathErasure(plan, ins))
+			++plan.nShared;
+	}
 
-	// Might as well verify we haven't broken anything
-	if (iChanged)
-		mba->verify(true);
+	if (plan.nShared == 0)
+		plan.iTwoWay = PredPlan::TWOWAY_RETARGET;
+	else if (plan.nShared <= TWOWAY_COPY_MAX_INSNS || plan.iGotoTarget == plan.iJccTarget || mb->tail == NULL || mb->tail->opcode != m_goto)
+		plan.iTwoWay = PredPlan::TWOWAY_COPY;
+	else if (!PathVarSurvives(mb, plan))
+		plan.iTwoWay = PredPlan::TWOWAY_COPY;
+	else
+		plan.iTwoWay = PredPlan::TWOWAY_BRANCH;
+}
 
-#if UNFLATTENVERBOSE
-		mba->print(vd);
-#endif
+// Make a block end with a goto to iDest, whether it ends with a goto already,
+// falls through, or is empty.
+static void EndWithGoto(mblock_t *blk, int iDest, EditJournal &journal)
+{
+	if (blk->tail != NULL && blk->tail->opcode == m_goto)
+	{
+		journal.SaveInsn(blk, blk->tail);
+		blk->tail->l.b = iDest;
+	}
+	else if (blk->tail != NULL)
+		AppendGotoOntoNonEmptyBlock(blk, iDest, &journal);
+	else
+	{
+		minsn_t *newGoto = new minsn_t(blk->start);
+		newGoto->opcode = m_goto;
+		newGoto->l.t = mop_b;
+		newGoto->l.b = iDest;
+		newGoto->l.size = NOSIZE;
+		blk->insert_into_block(newGoto, NULL);
+		journal.Inserted(blk, newGoto);
+	}
+}
 
-	// Get the preliminary information needed for control flow flattening, such
-	// as the assignment/comparison variables.
-	if (!cfi.GetAssignedAndComparisonVariables(blk))
+// Turn the goto at the end of a block into a branch to iTargetEq if opPath 
+// holds key, and to iTargetNe otherwise. A conditional jump has to fall 
+// through to the next block, so if neither target is the next block, this
+// uses a jump table with one case and a default instead.
+static void EndWithPathBranch(mblock_t *blk, const mop_t &opPath, uint64 key, int iTargetEq, int iTargetNe, EditJournal &journal)
+{
+	minsn_t *br = blk->tail;
+	journal.SaveInsn(blk, br);
+	journal.SaveBlock(blk);
+	br->l = opPath;
+	br->r.erase();
+	br->d.erase();
+	if (iTargetNe == blk->serial + 1 || iTargetEq == blk->serial + 1)
 	{
-		debugmsg("[E] Couldn't get control-flow flattening information\n");
-		return iChanged;
+		bool bEqFallsThrough = iTargetEq == blk->serial + 1;
+		br->opcode = bEqFallsThrough ? m_jnz : m_jz;
+		br->r.make_number(key, opPath.size, br->ea);
+		br->d.t = mop_b;
+		br->d.b = bEqFallsThrough ? iTargetNe : iTargetEq;
+		br->d.size = NOSIZE;
+		blk->type = BLT_2WAY;
 	}
+	else
+	{
+		mcases_t *cases = new mcases_t;
+		cases->values.push_back(svalvec_t());
+		cases->values.back().push_back(key);
+		cases->targets.push_back(iTargetEq);
 
-	// Create an object that allows us to modify the graph at a future point.
-	DeferredGraphModifier dgm;
-	bool bDirtyChains = false;
+		// No values means the default case
+		cases->values.push_back(svalvec_t());
+		cases->targets.push_back(iTargetNe);
 
-	// Iterate through the predecessors of the top-level control flow switch
-	for (auto iDispPred : mba->get_mblock(cfi.iDispatch)->predset)
+		br->opcode = m_jtbl;
+		br->r.t = mop_c;
+		br->r.c = cases;
+		br->r.size = NOSIZE;
+		blk->type = BLT_NWAY;
+	}
+}
+
+// Work out where one predecessor of the dispatcher really goes, and which
+// assignments become superfluous once it goes there directly. This doesn't 
+// modify the mba or cfi.
+void UnflattenContext::ResolvePredecessor(mbl_array_t *mba, int iDispPred, PredPlan &plan)
+{
+	mblock_t *mb = mba->get_mblock(iDispPred);
+	bool bInCluster = false;
+
+	do
 	{
-		mblock_t *mb = mba->get_mblock(iDispPred);
-		
 		// The predecessors should only have one successor, i.e., they should 
 		// directly branch to the dispatcher, not in a conditional fashion
 		if (mb->nsucc() != 1)
 		{
 			debugmsg("[I] Block %d had %d successors, not 1\n", iDispPred, mb->nsucc());
-			continue;
+			break;
 		}
-		
+
 		// Find the block that dominates this cluster, or skip this block if
 		// we can't. This ensures that we only try to unflatten parts of the
 		// control flow graph that were actually flattened. Also, we need the
@@ -337,49 +417,36 @@ int idaapi CFUnflattener::func(mblock_t *blk)
 		int iClusterHead;
 		mblock_t *mbClusterHead = GetDominatedClusterHead(mba, iDispPred, iClusterHead);
 		if (mbClusterHead == NULL)
-			continue;
-
-		// It's best to process erasures for every block we unflatten 
-		// immediately, so we don't end up duplicating instructions that we 
-		// want to eliminate
-		m_DeferredErasuresLocal.clear();
+			break;
+		bInCluster = true;
 
 		// Try to find a numeric assignment to the assignment variable, but 
 		// pass false for the last parameter so that the search stops if it 
 		// reaches a block with more than one successor. This ought to succeed
 		// if the flattened control flow region only has one destination, 
 		// rather than two destinations for flattening of if-statements.
-		int iDestNo = FindBlockTargetOrLastCopy(mb, mbClusterHead, cfi.opAssigned, false);
-		
+		int iDestNo = FindBlockTargetOrLastCopy(mb, mbClusterHead, cfi.opAssigned, false, plan.erasures);
+		plan.iPathErasures = plan.erasures.size();
+
 		// Couldn't find any assignments at all to the assignment variable?
 		// That's bad, don't continue.
-		if (m_DeferredErasuresLocal.empty())
-			continue;
+		if (plan.erasures.empty())
+			break;
 
-		// Did we find a block target? Great; just update the CFG to point the
-		// destination directly to its target, rather than back to the 
-		// dispatcher.
+		// Did we find a block target? Great; the predecessor can point
+		// directly to its target, rather than back to the dispatcher.
 		if (iDestNo >= 0)
 		{
-			// Make a note to ourselves to modify the graph structure later
-			dgm.ChangeGoto(mb, cfi.iDispatch, iDestNo);
-			
-			// Erase the intermediary assignments to the assignment variable
-			ProcessErasures(mba);
-
-#if UNFLATTENVERBOSE
-			msg("[I] Changed goto on %d to %d\n", iDispPred, iDestNo);
-#endif
-
-			++iChanged;
-			continue;
+			plan.iKind = PredPlan::PLAN_GOTO;
+			plan.iDestNo = iDestNo;
+			break;
 		}
 
 		// Stash off a copy of the last variable in the chain of assignments
 		// to the assignment variable, as well as the assignment instruction 
 		// (the latter only for debug-printing purposes).
-		mop_t *opCopy = m_DeferredErasuresLocal.back().opCopy;
-		minsn_t *m = m_DeferredErasuresLocal.back().insMov;
+		mop_t *opCopy = plan.erasures.back().opCopy;
+		minsn_t *m = plan.erasures.back().insMov;
 
 #if UNFLATTENVERBOSE
 		debugmsg("[I] Block %d did not define assign a number to assigned var; assigned %s instead\n", iDispPred, mopt_t_to_string(m->l.t));
@@ -392,63 +459,428 @@ int idaapi CFUnflattener::func(mblock_t *blk)
 #if UNFLATTENVERBOSE
 			debugmsg("[I] Block %d that assigned non-numeric value had %d predecessors, not 2\n", iDispPred, mb->npred());
 #endif
-			continue;
+			break;
 		}
 
 		mblock_t *nonJcc;
-		int actualGotoTarget, actualJccTarget;
-		
+
 		// Call the function that handles the case of a conditional assignment
 		// to the assignment variable (i.e., the flattened version of an 
 		// if-statement).
-		if (HandleTwoPreds(mb, mbClusterHead, opCopy, nonJcc, actualGotoTarget, actualJccTarget))
+		if (HandleTwoPreds(mb, mbClusterHead, opCopy, nonJcc, plan.iGotoTarget, plan.iJccTarget, plan.pathKey, plan.erasures))
 		{
-			// If it succeeded...
-			
-			// Get rid of the superfluous assignments
-			ProcessErasures(mba);
-			
-			// Make a note to ourselves to modify the graph structure later,
-			// for the non-taken side of the conditional. Change the goto 
-			// target.
-			dgm.Replace(mb->serial, cfi.iDispatch, actualGotoTarget);
-			mb->tail->l.b = actualGotoTarget;
-
-			// Mark that the def-use information will need re-analyzing
-			bDirtyChains = true;
-			
-			// Copy the instructions from the block that targets the dispatcher
-			// onto the end of the jcc taken block.
-			minsn_t *mbHead = mb->head;
-			minsn_t *mbCurr = mbHead;
-			do
+			plan.iKind = PredPlan::PLAN_TWOWAY;
+			plan.iNonJcc = nonJcc->serial;
+			plan.opPath = opCopy;
+			ChooseTwoWayStrategy(mb, plan);
+		}
+	} while (false);
+
+	// Nothing to erase unless the plan is going to be applied
+	if (plan.iKind == PredPlan::PLAN_NONE)
+		plan.erasures.clear();
+
+	// If searching backwards didn't work, perhaps because the definition is
+	// on the other side of a block with several predecessors, see whether the
+	// function-wide solve knows that the assignment variable always holds the
+	// same constant here. If so, we can branch straight to that constant's 
+	// block. The assignments stay where they are, which is always safe.
+	// The solve predates any changes made to this dispatcher, so don't trust
+	// it if the definitions it relied upon have been modified since.
+	uint64 value;
+	if (plan.iKind == PredPlan::PLAN_NONE && bInCluster && m_StateVars.SingleConstant(iDispPred, value))
+	{
+		const std::vector<int> &defBlocks = m_StateVars.m_DefBlocks[iDispPred];
+		bool bStale = m_DirtyBlocks[iDispPred];
+		for (auto i : defBlocks)
+			bStale |= (bool)m_DirtyBlocks[i];
+		int iDestNo = bStale ? -1 : cfi.FindBlockByKey(value);
+		if (iDestNo >= 0)
+		{
+			plan.iKind = PredPlan::PLAN_GOTO;
+			plan.iDestNo = iDestNo;
+#if UNFLATTENVERBOSE
+			debugmsg("[I] Block %d resolved to %d by the state variable solve\n", iDispPred, iDestNo);
+#endif
+		}
+	}
+
+}
+
+// Carry out a plan made by ResolvePredecessor. Returns the number of changes
+// made, not counting the edges that dgm will modify later.
+int UnflattenContext::ApplyPlan(mbl_array_t *mba, int iDispPred, const PredPlan &plan, DeferredGraphModifier &dgm, bool &bDirtyChains)
+{
+	char buf[1000];
+	mblock_t *mb = mba->get_mblock(iDispPred);
+
+	if (plan.iKind == PredPlan::PLAN_GOTO)
+	{
+		// Make a note to ourselves to modify the graph structure later
+		dgm.ChangeGoto(mb, cfi.iDispatch, plan.iDestNo);
+		MarkDirty(iDispPred);
+
+		// Erase the intermediary assignments to the assignment variable
+		ProcessErasures(mba, plan.erasures);
+
+#if UNFLATTENVERBOSE
+		msg("[I] Changed goto on %d to %d\n", iDispPred, plan.iDestNo);
+#endif
+		return 1;
+	}
+
+	if (plan.iKind == PredPlan::PLAN_TWOWAY && plan.iTwoWay == PredPlan::TWOWAY_BRANCH)
+	{
+		// Only get rid of the assignment to the state variable. The 
+		// assignments on the way there are what tell the paths apart now.
+		// The variable being branched on is an operand of the former, so 
+		// hang onto a copy of it.
+		mop_t opPath = *plan.opPath;
+		MovChain shared(plan.erasures.begin(), plan.erasures.begin() + plan.iPathErasures);
+		ProcessErasures(mba, shared);
+
+		// Branch to wherever each path was headed
+		EndWithPathBranch(mb, opPath, plan.pathKey, plan.iGotoTarget, plan.iJccTarget, m_Journal);
+		dgm.Remove(mb->serial, cfi.iDispatch);
+		dgm.Add(mb->serial, plan.iGotoTarget);
+		dgm.Add(mb->serial, plan.iJccTarget);
+		MarkDirty(iDispPred);
+		bDirtyChains = true;
+		m_nInsnsNotCopied += plan.nShared;
+
+#if UNFLATTENVERBOSE
+		debugmsg("[I] Branched at the end of %d to %d or %d instead of copying %d instructions\n", iDispPred, plan.iGotoTarget, plan.iJccTarget, plan.nShared);
+#endif
+		return 0;
+	}
+
+	if (plan.iKind == PredPlan::PLAN_TWOWAY)
+	{
+		mblock_t *nonJcc = mba->get_mblock(plan.iNonJcc);
+
+		// Get rid of the superfluous assignments
+		ProcessErasures(mba, plan.erasures);
+
+		// Make a note to ourselves to modify the graph structure later,
+		// for the non-taken side of the conditional. Change the goto
+		// target.
+		dgm.Replace(mb->serial, cfi.iDispatch, plan.iGotoTarget);
+		m_Journal.SaveInsn(mb, mb->tail);
+		mb->tail->l.b = plan.iGotoTarget;
+		MarkDirty(iDispPred);
+
+		// Mark that the def-use information will need re-analyzing
+		bDirtyChains = true;
+
+		// Copy the instructions from the block that targets the dispatcher
+		// onto the end of the jcc taken block, ahead of its goto if it has
+		// one. The goto at the end and the erased instructions aren't 
+		// needed; if that's all there is, nothing is copied.
+		minsn_t *insertAfter = nonJcc->tail;
+		if (insertAfter != NULL && insertAfter->opcode == m_goto)
+			insertAfter = insertAfter->prev;
+		if (plan.iTwoWay == PredPlan::TWOWAY_COPY)
+		{
+			for (minsn_t *mbCurr = mb->head; mbCurr != NULL; mbCurr = mbCurr->next)
 			{
+				if (mbCurr->opcode == m_nop || (mbCurr == mb->tail && mbCurr->opcode == m_goto))
+					continue;
 				minsn_t *mCopy = new minsn_t(*mbCurr);
-				nonJcc->insert_into_block(mCopy, nonJcc->tail);
-				mbCurr = mbCurr->next;
+				insertAfter = nonJcc->insert_into_block(mCopy, insertAfter);
+				m_Journal.Inserted(nonJcc, mCopy);
 
 #if UNFLATTENVERBOSE
-				mcode_t_to_string(nonJcc->tail, buf, sizeof(buf));
-				debugmsg("[I] %d: tail is %s\n", nonJcc->serial, buf);
+				mcode_t_to_string(mCopy, buf, sizeof(buf));
+				debugmsg("[I] %d: copied %s\n", nonJcc->serial, buf);
 #endif
+			}
+		}
 
-			} while (mbCurr != NULL);
+		// Make a note to ourselves to modify the graph structure later,
+		// for the taken side of the conditional. Change the goto target.
+		dgm.Replace(nonJcc->serial, mb->serial, plan.iJccTarget);
+		EndWithGoto(nonJcc, plan.iJccTarget, m_Journal);
 
-			
-			// Make a note to ourselves to modify the graph structure later,
-			// for the taken side of the conditional. Change the goto target.
-			dgm.Replace(nonJcc->serial, mb->serial, actualJccTarget);
-			nonJcc->tail->l.b = actualJccTarget;
-			
-			// We added instructions to the nonJcc block, so its def-use lists
-			// are now spoiled. Mark it dirty.
-			nonJcc->mark_lists_dirty();
+		// We added instructions to the nonJcc block, so its def-use lists
+		// are now spoiled. Mark it dirty.
+		nonJcc->mark_lists_dirty();
+		MarkDirty(nonJcc->serial);
+	}
+	return 0;
+}
+
+// The position of an instruction within its block, and the other way around
+static int InsnIndex(mblock_t *blk, minsn_t *ins)
+{
+	int i = 0;
+	for (minsn_t *p = blk->head; p != NULL; p = p->next, ++i)
+		if (p == ins)
+			return i;
+	return -1;
+}
+
+static minsn_t *InsnAt(mblock_t *blk, int iInsn)
+{
+	minsn_t *ins = blk->head;
+	for (int i = 0; ins != NULL && i < iInsn; ++i)
+		ins = ins->next;
+	return ins;
+}
+
+// Record a plan that's about to be applied, in a form that can be applied to
+// another copy of the same microcode. Returns false if it can't be.
+static bool EncodePlan(mbl_array_t *mba, int iDispPred, const PredPlan &plan, CachedPlan &cp)
+{
+	cp.iPred = iDispPred;
+	cp.iKind = plan.iKind;
+	cp.iDestNo = plan.iDestNo;
+	cp.iNonJcc = plan.iNonJcc;
+	cp.iGotoTarget = plan.iGotoTarget;
+	cp.iJccTarget = plan.iJccTarget;
+	cp.iTwoWay = plan.iTwoWay;
+	cp.pathKey = plan.pathKey;
+	cp.iPathErasures = plan.iPathErasures;
+	cp.iPathOperand = -1;
+	cp.nShared = plan.nShared;
+	for (auto &mi : plan.erasures)
+	{
+		int iInsn = InsnIndex(mba->get_mblock(mi.iBlock), mi.insMov);
+		if (iInsn < 0)
+			return false;
+		cp.erasures.push_back(std::make_pair(mi.iBlock, iInsn));
+	}
+
+	// The path variable is an operand of the last assignment on the way to
+	// the state variable
+	if (plan.iKind == PredPlan::PLAN_TWOWAY)
+	{
+		if (plan.iPathErasures == 0 || plan.iPathErasures > plan.erasures.size())
+			return false;
+		minsn_t *ins = plan.erasures[plan.iPathErasures - 1].insMov;
+		if (plan.opPath == &ins->l)
+			cp.iPathOperand = 0;
+		else if (plan.opPath == &ins->r)
+			cp.iPathOperand = 1;
+		else if (plan.opPath == &ins->d)
+			cp.iPathOperand = 2;
+		else
+			return false;
+	}
+	return true;
+}
+
+// The reverse of EncodePlan. Returns false if the plan doesn't fit the 
+// graph, which shouldn't happen if the microcode's hash matched.
+static bool DecodePlan(mbl_array_t *mba, const CachedPlan &cp, PredPlan &plan)
+{
+	if (cp.iPred < 0 || cp.iPred >= mba->qty)
+		return false;
+	plan.Clear();
+	plan.iKind = cp.iKind;
+	plan.iDestNo = cp.iDestNo;
+	plan.iNonJcc = cp.iNonJcc;
+	plan.iGotoTarget = cp.iGotoTarget;
+	plan.iJccTarget = cp.iJccTarget;
+	plan.iTwoWay = cp.iTwoWay;
+	plan.pathKey = cp.pathKey;
+	plan.iPathErasures = cp.iPathErasures;
+	plan.nShared = cp.nShared;
+	for (auto &e : cp.erasures)
+	{
+		minsn_t *ins = e.first >= 0 && e.first < mba->qty ? InsnAt(mba->get_mblock(e.first), e.second) : NULL;
+		if (ins == NULL)
+			return false;
+		plan.erasures.emplace_back();
+		MovInfo &mi = plan.erasures.back();
+		mi.iBlock = e.first;
+		mi.insMov = ins;
+		mi.opCopy = &ins->l;
+	}
+	if (plan.iKind == PredPlan::PLAN_TWOWAY)
+	{
+		if (plan.iPathErasures == 0 || plan.iPathErasures > plan.erasures.size() || plan.iNonJcc < 0 || plan.iNonJcc >= mba->qty)
+			return false;
+		minsn_t *ins = plan.erasures[plan.iPathErasures - 1].insMov;
+		plan.opPath = cp.iPathOperand == 0 ? &ins->l : cp.iPathOperand == 1 ? &ins->r : &ins->d;
+	}
+	return true;
+}
+
+// Unflatten the current dispatcher, as described by cfi. Returns the number
+// of changes made. Blocks whose instructions were modified are marked in 
+// m_DirtyBlocks. The number of edges redirected away from the dispatcher is
+// added to nRecovered, and the number of predecessors that couldn't be 
+// resolved, to nUnresolved.
+//
+// Each predecessor of the dispatcher is first resolved into a plan, without
+// modifying anything, and the plan is then applied before moving on to the
+// next predecessor. Keeping the two apart is what lets the plans be recorded
+// in the plan cache and replayed later.
+int UnflattenContext::UnflattenDispatcher(mbl_array_t *mba, bool &bDirtyChains, int &nRecovered, int &nUnresolved)
+{
+	// Create an object that allows us to modify the graph at a future point.
+	DeferredGraphModifier dgm(&m_Journal);
+	int iChanged = 0;
+
+	// Work out the values of the state variables at the end of each 
+	// predecessor, for the ones that searching backwards can't handle. This
+	// is a luxury when we're short on time.
+	if (m_Mode == GOV_FULL)
+		SolveStateVars(mba, cfi, m_StateVars);
+#if UNFLATTENVERBOSE
+	debugmsg("[I] State variable solve: %d variables, %d definitions, %d block visits, %d value visits, %.3fms\n", m_StateVars.m_nVars, m_StateVars.m_nDefs, m_StateVars.m_nBlockVisits, m_StateVars.m_nValueVisits, m_StateVars.m_nsElapsed / 1e6);
+#endif
+
+	// The graph isn't modified until dgm is applied, so the predecessors stay
+	// put while we work on them.
+	const intvec_t &preds = mba->get_mblock(cfi.iDispatch)->predset;
+	int nPreds = preds.size();
+	PredPlan plan;
+
+	// Iterate through the predecessors of the control flow switch
+	for (int i = 0; i < nPreds; ++i)
+	{
+		plan.Clear();
+		{
+			PhaseTimer timer(PH_RESOLVE);
+			ResolvePredecessor(mba, preds[i], plan);
+		}
+#if PLAN_CACHE
+		if (m_RecRound != NULL && plan.iKind != PredPlan::PLAN_NONE)
+		{
+			m_RecRound->dispatchers.back().plans.emplace_back();
+			if (!EncodePlan(mba, preds[i], plan, m_RecRound->dispatchers.back().plans.back()))
+				m_RecRound = NULL;
 		}
+#endif
+		iChanged += ApplyPlan(mba, preds[i], plan, dgm, bDirtyChains);
+
+		// Keep track of how many edges were pointed away from the dispatcher,
+		// and how many predecessors still lead to it.
+		if (plan.iKind == PredPlan::PLAN_GOTO)
+			nRecovered += 1;
+		else if (plan.iKind == PredPlan::PLAN_TWOWAY)
+			nRecovered += 2;
+		else
+			++nUnresolved;
 	} // end for loop that unflattens all blocks
-	
+
 	// After we've processed every block, apply the deferred modifications to
-	// the graph structure.
-	iChanged += dgm.Apply(mba);
+	// the graph structure. This also brings the dominator tree up-to-date,
+	// so that later analyses don't have to recompute it from scratch.
+	iChanged += dgm.Apply(mba, &cfi.m_DomTree);
+
+	// The searches for definitions followed the edges that were just changed,
+	// so nothing that was remembered about them can be trusted anymore.
+	m_DefCache.Flush();
+
+	return iChanged;
+}
+
+// One pass of unflattening over the whole graph: find the dispatchers as they
+// stand now, and point as many of their predecessors as possible directly at
+// their destinations. Returns the number of changes made. The number of edges
+// recovered and of predecessors left pointing at a dispatcher are returned in
+// nRecovered and nUnresolved.
+int UnflattenContext::UnflattenRound(mbl_array_t *mba, int &nRecovered, int &nUnresolved)
+{
+	nRecovered = 0;
+	nUnresolved = 0;
+
+	// Throw away everything left over from the last round, and start
+	// allocating this round's analysis state from the beginning of the 
+	// arena.
+	Clear(true);
+
+	// Find all of the dispatchers in the function, along with the information
+	// that they share, such as the dominator tree.
+	std::vector<DispatcherCandidate> dispatchers;
+	if (!cfi.FindDispatchers(mba, dispatchers))
+	{
+		debugmsg("[E] Couldn't get control-flow flattening information\n");
+		return 0;
+	}
+	
+	// Unflatten the dispatchers, innermost first. Unflattening one dispatcher
+	// doesn't renumber any blocks, and keeps the dominator tree up-to-date, 
+	// so all that's needed before moving onto the next one is to rescan the 
+	// blocks whose instructions were modified.
+	int iChanged = 0;
+	bool bDirtyChains = false;
+	int nDispatchers = 0;
+	for (auto &dc : dispatchers)
+	{
+		// Leave alone the dispatchers whose unflattening had to be undone
+		// before
+		ea_t eaDispatch = mba->get_mblock(dc.iDispatch)->start;
+		if (g_XformBlackList.Has(mba->entry_ea, XF_DISPATCHER, eaDispatch))
+			continue;
+
+		// Get the preliminary information needed for control flow flattening,
+		// such as the assignment/comparison variables.
+		if (!cfi.AnalyzeDispatcher(mba, dc))
+		{
+			debugmsg("[E] Couldn't get control-flow flattening information for dispatcher %d\n", dc.iDispatch);
+			continue;
+		}
+		
+		m_DirtyBlocks.assign(mba->qty, false);
+		int nRecoveredBefore = nRecovered, nUnresolvedBefore = nUnresolved;
+		bool bDirtyChainsBefore = bDirtyChains;
+#if PLAN_CACHE
+		if (m_RecRound != NULL)
+		{
+			m_RecRound->dispatchers.emplace_back();
+			m_RecRound->dispatchers.back().iDispatch = cfi.iDispatch;
+		}
+#endif
+		int nChanged = UnflattenDispatcher(mba, bDirtyChains, nRecovered, nUnresolved);
+
+		// Make sure we haven't broken anything. No blocks are renumbered 
+		// until every dispatcher has been unflattened, so if we have, this
+		// dispatcher's changes can still be undone. Everything that was 
+		// worked out from them has to be thrown away too.
+		if (!CommitOrRollback(mba, m_Journal, m_Mode == GOV_FULL, XF_DISPATCHER, eaDispatch))
+		{
+			nChanged = 0;
+			nRecovered = nRecoveredBefore;
+			nUnresolved = nUnresolvedBefore;
+			bDirtyChains = bDirtyChainsBefore;
+			cfi.m_DomTree.Compute(mba);
+			cfi.m_Index.Refresh(mba, m_DirtyBlocks);
+#if PLAN_CACHE
+			if (m_RecRound != NULL)
+				m_RecRound->dispatchers.pop_back();
+#endif
+		}
+#if PLAN_CACHE
+		else if (m_RecRound != NULL && m_RecRound->dispatchers.back().plans.empty())
+			m_RecRound->dispatchers.pop_back();
+#endif
+		if (nChanged != 0)
+		{
+			iChanged += nChanged;
+			++nDispatchers;
+			cfi.m_Index.Refresh(mba, m_DirtyBlocks);
+		}
+	}
+#if UNFLATTENVERBOSE
+	debugmsg("[I] Unflattened %d of %d dispatchers\n", nDispatchers, dispatchers.size());
+#endif
+
+	return FinishRound(mba, iChanged, nDispatchers, bDirtyChains);
+}
+
+// Everything that happens after the dispatchers have been unflattened in a
+// round, whether that was worked out just now or replayed: tidying up the
+// graph, and making sure it's still sound.
+int UnflattenContext::FinishRound(mbl_array_t *mba, int iChanged, int nDispatchers, bool bDirtyChains)
+{
+	// Once we've unflattened something here, later rounds shouldn't second-
+	// guess that the function is obfuscated, even if what's left of the 
+	// dispatchers no longer looks like much.
+	if (nDispatchers != 0)
+		g_Verdicts.Set(mba->entry_ea, VERDICT_FLATTENED);
 
 	// If we modified the graph structure, hopefully some blocks (especially 
 	// those making up the control flow dispatch switch, but also perhaps
@@ -457,10 +889,37 @@ int idaapi CFUnflattener::func(mblock_t *blk)
 	// anymore and can do a better job.
 	if (iChanged != 0)
 	{
-		int nRemoved = PruneUnreachable(mba);
+		int nRemoved = PruneUnreachable(mba, &cfi.m_DomTree);
 		iChanged += nRemoved;
 #if UNFLATTENVERBOSE
 		msg("[I] Removed %d blocks\n", nRemoved);
+		msg("[I] Dominator tree: %d full computations, %d incremental updates, %d blocks recomputed\n", cfi.m_DomTree.m_nFullComputations, cfi.m_DomTree.m_nIncrementalUpdates, cfi.m_DomTree.m_nBlocksRecomputed);
+#endif
+
+#if MERGE_BLOCK_CHAINS
+		// What's left is full of straight-line chains of blocks. Fold them
+		// together so that later maturities have less to chew on. This
+		// renumbers the blocks, so the dominator tree is done for.
+#if UNFLATTENVERBOSE
+		int nBlocksBefore = mba->qty;
+#endif
+		int nMerged = 0;
+		if (!g_XformBlackList.Has(mba->entry_ea, XF_MERGE_CHAINS))
+			nMerged = MergeBlockChains(mba, &m_Journal, m_Mode == GOV_FULL);
+		if (nMerged < 0)
+		{
+			BlacklistTransformation(mba, XF_MERGE_CHAINS);
+			nMerged = 0;
+		}
+		if (nMerged != 0)
+		{
+			iChanged += nMerged;
+			bDirtyChains = true;
+			cfi.m_DomTree.Clear();
+		}
+#if UNFLATTENVERBOSE
+		msg("[I] Merged %d blocks into their predecessors: %d blocks -> %d\n", nMerged, nBlocksBefore, mba->qty);
+#endif
 #endif
 	}
 
@@ -474,12 +933,498 @@ int idaapi CFUnflattener::func(mblock_t *blk)
 #elif IDA_SDK_VERSION >= 720
 		mba->mark_chains_dirty();
 #endif
+		PhaseTimer timer(PH_OPTIMIZE_LOCAL);
 		mba->optimize_local(0);
 	}
 
-	// If we changed the graph, verify that we did so legally.
-	if (iChanged != 0)
-		mba->verify(true);
+	// If we changed the graph, verify that we did so legally. Everything has
+	// been committed by now, so there's nothing left to undo. Merging block 
+	// chains is the last change made to the graph before optimize_local, so
+	// leave it out the next time this function is decompiled.
+	if (iChanged != 0 && m_Mode == GOV_FULL && !VerifyNoThrow(mba))
+	{
+		g_XformBlackList.Insert(mba->entry_ea, XF_MERGE_CHAINS);
+		msg("[E] %a: the graph didn't verify after unflattening; blacklisted block chain merging for this function\n", mba->entry_ea);
+	}
+
+#if UNFLATTENVERBOSE
+	debugmsg("[I] Definition cache: %d hits, %d misses (%d stale)\n", m_DefCache.m_nHits, m_DefCache.m_nMisses, m_DefCache.m_nStale);
+	debugmsg("[I] Avoided copying %d instructions for two-way blocks so far\n", m_nInsnsNotCopied);
+	debugmsg("[I] Arena: %d bytes allocated, %d peak, %d reserved, %d resets\n", (int)cfi.m_Arena.m_nAllocated, (int)cfi.m_Arena.m_nPeak, (int)cfi.m_Arena.m_nReserved, cfi.m_Arena.m_nResets);
+#endif
+
+	return iChanged;
+}
+
+// Do one round of unflattening. If an earlier decompilation did this round 
+// to exactly the same microcode, in a mode at least as thorough as the 
+// current one, just do the same again. Otherwise, work it out, and record 
+// what was done for next time.
+int UnflattenContext::RunRound(mbl_array_t *mba, int &nRecovered, int &nUnresolved)
+{
+#if PLAN_CACHE
+	if (m_Record == NULL)
+		return UnflattenRound(mba, nRecovered, nUnresolved);
+
+	uint64 hash = hash_mba(mba);
+	if (m_Replay != NULL)
+	{
+		const CachedRound *cr = m_iReplay < m_Replay->rounds.size() ? &m_Replay->rounds[m_iReplay++] : NULL;
+		if (cr != NULL && cr->maturity == mba->maturity && cr->hash == hash && cr->mode <= m_Mode)
+		{
+			int iChanged = ReplayRound(mba, *cr, nRecovered, nUnresolved);
+			if (iChanged >= 0)
+			{
+				m_Record->rounds.push_back(*cr);
+				return iChanged;
+			}
+		}
+
+		// Things have turned out differently this time, so none of the 
+		// rounds after this one can be trusted either
+		m_Replay.reset();
+	}
+
+	m_Record->rounds.emplace_back();
+	m_RecRound = &m_Record->rounds.back();
+	m_RecRound->maturity = mba->maturity;
+	m_RecRound->hash = hash;
+	m_RecRound->mode = m_Mode;
+	int iChanged = UnflattenRound(mba, nRecovered, nUnresolved);
+	if (m_RecRound != NULL)
+	{
+		m_RecRound->nRecovered = nRecovered;
+		m_RecRound->nUnresolved = nUnresolved;
+		m_RecRound = NULL;
+		m_bRecordDirty = true;
+		return iChanged;
+	}
+
+	// Something in this round couldn't be recorded. Later rounds depend on 
+	// it, so keep what we have, and stop recording.
+	m_Record->rounds.pop_back();
+	StorePlans();
+	return iChanged;
+#else
+	return UnflattenRound(mba, nRecovered, nUnresolved);
+#endif
+}
+
+// Apply the plans that an earlier decompilation recorded for this round, 
+// instead of working them out again. They're checked all together, and if
+// they don't fit after all, they're undone and -1 is returned.
+int UnflattenContext::ReplayRound(mbl_array_t *mba, const CachedRound &round, int &nRecovered, int &nUnresolved)
+{
+	int iChanged = 0;
+	bool bDirtyChains = false;
+	bool bOk = true;
+
+	// Only the replaying itself is timed as such; what comes after is the same
+	// as for a round that was analyzed
+	{
+		PhaseTimer timer(PH_REPLAY);
+		Clear(true);
+		cfi.m_DomTree.Compute(mba);
+
+		for (auto &cd : round.dispatchers)
+		{
+			if (cd.iDispatch < 0 || cd.iDispatch >= mba->qty)
+			{
+				bOk = false;
+				break;
+			}
+			cfi.iDispatch = cd.iDispatch;
+			m_DirtyBlocks.assign(mba->qty, false);
+			DeferredGraphModifier dgm(&m_Journal);
+			for (auto &cp : cd.plans)
+			{
+				PredPlan plan;
+				bOk = DecodePlan(mba, cp, plan);
+				if (!bOk)
+					break;
+				iChanged += ApplyPlan(mba, cp.iPred, plan, dgm, bDirtyChains);
+			}
+			if (!bOk)
+				break;
+			iChanged += dgm.Apply(mba, &cfi.m_DomTree);
+			m_DefCache.Flush();
+		}
+
+		if (!bOk || !CheckGraphStructure(mba) || (m_Mode == GOV_FULL && !VerifyNoThrow(mba)))
+		{
+			debugmsg("[E] The cached plans for round %d didn't fit; analyzing it instead\n", m_nRounds + 1);
+			m_Journal.Rollback();
+			return -1;
+		}
+		m_Journal.Commit();
+	}
+#if UNFLATTENVERBOSE
+	debugmsg("[I] Replayed %d cached dispatchers for round %d\n", round.dispatchers.size(), m_nRounds + 1);
+#endif
+
+	nRecovered = round.nRecovered;
+	nUnresolved = round.nUnresolved;
+	return FinishRound(mba, iChanged, round.dispatchers.size(), bDirtyChains);
+}
+
+// Hand what was recorded over to the cache, if any of it was worked out 
+// afresh; rounds that were only replayed are in there already.
+void UnflattenContext::StorePlans()
+{
+#if PLAN_CACHE
+	if (m_Record != NULL && m_bRecordDirty)
+		g_PlanCache.Store(m_Mba->entry_ea, m_Record);
+	m_Record.reset();
+	m_Replay.reset();
+	m_RecRound = NULL;
+	m_bRecordDirty = false;
+#endif
+}
+
+// Count the instructions in the graph, which is what the work budget is
+// measured in.
+static int CountInsns(mbl_array_t *mba)
+{
+	int nInsns = 0;
+	for (int i = 0; i < mba->qty; ++i)
+		for (minsn_t *ins = mba->get_mblock(i)->head; ins != NULL; ins = ins->next)
+			++nInsns;
+	return nInsns;
+}
+
+bool UnflattenContext::OverBudget() const
+{
+	return m_nRounds >= UNFLATTEN_MAX_ROUNDS
+		|| m_nsSpent >= (uint64)UNFLATTEN_BUDGET_MS * 1000000
+		|| m_nInsnsSpent >= (uint64)UNFLATTEN_BUDGET_INSNS;
+}
+
+// This is the top-level un-flattening function for an entire graph. Hex-Rays
+// calls CFUnflattener::func since we register it as a block optimizer, which
+// passes the call on to the context for the graph.
+//
+// The first round happens at MMAT_LOCOPT. Some predecessors of a dispatcher
+// can't be resolved that early; for example, the value of the state variable
+// might only become a constant after Hex-Rays has propagated it across calls
+// or globally. Those predecessors are the ones that still point at the 
+// dispatcher afterwards, so further rounds just look at the dispatchers 
+// again. They happen right away after running local optimization, as long 
+// as that lets each round recover something, and then again at each 
+// maturity level up to UNFLATTEN_LAST_MATURITY. It stops when every 
+// predecessor is resolved, or when the budget in Config.hpp runs out.
+int UnflattenContext::Run(mblock_t *blk)
+{
+	char buf[1000];
+	vd_printer_t vd;
+
+	// Was this function blacklisted? Skip it if so
+	mbl_array_t *mba = blk->mba;
+	if (g_Verdicts.Get(mba->entry_ea) == VERDICT_NOT_FLATTENED)
+		return 0;
+
+#if UNFLATTENVERBOSE || UNFLATTENDEBUG
+	const char *matStr = MicroMaturityToString(mba->maturity);
+#endif
+#if UNFLATTENVERBOSE
+	debugmsg("[I] Block optimization called at maturity level %s\n", matStr);
+#endif
+
+	// Only operate once per maturity level. This also keeps us from being 
+	// re-entered when we call optimize_local below.
+	if (m_LastMaturity == mba->maturity)
+		return 0;
+
+	// Update the maturity level
+	m_LastMaturity = mba->maturity;
+
+	// If this function has cost too much already, do less, or nothing
+	GovernorSession *gs = g_Governor.Find(mba);
+	m_Mode = gs->Mode(GOV_UNFLATTEN);
+	if (m_Mode == GOV_SKIP)
+		return 0;
+	PhaseTimer timer(PH_UNFLATTEN, mba);
+
+#if UNFLATTENDEBUG
+	// If we're debugging, save a copy of the graph on disk
+	qsnprintf(buf, sizeof(buf), "c:\\temp\\dumpBefore-%s-%a.txt", matStr, mba->entry_ea);
+	DumpMBAToFile(mba, buf);
+#endif
+
+	int iChanged = 0;
+
+	// We start at MMAT_LOCOPT. After that, we only keep going if there's 
+	// something left to do.
+	if (mba->maturity == MMAT_LOCOPT)
+	{
+		uint64 nsStart = get_nsec_stamp();
+
+		// Unless we've already seen that this function is obfuscated, take a
+		// quick look at it before doing anything expensive. Most functions 
+		// aren't flattened, and this weeds them out cheaply.
+		if (g_Verdicts.Get(mba->entry_ea) != VERDICT_FLATTENED)
+		{
+			FlattenClassification fc;
+			if (!ClassifyFlattening(mba, fc))
+			{
+				if (fc.bBlacklist)
+					g_Verdicts.Set(mba->entry_ea, VERDICT_NOT_FLATTENED, fc.Entropy());
+				gs->Charge(GOV_UNFLATTEN, get_nsec_stamp() - nsStart, 0);
+				return 0;
+			}
+		}
+
+#if PLAN_CACHE
+		// If this is the same microcode that we've unflattened before, we 
+		// can do the same again without all of the analysis
+		uint64 hash = hash_mba(mba);
+		m_Replay = g_PlanCache.Find(mba->entry_ea, hash);
+		m_iReplay = 0;
+		m_Record = std::make_shared<CachedFunction>();
+		m_Record->hash = hash;
+		m_bRecordDirty = false;
+#endif
+
+		// If local optimization has just been completed, remove 
+		// transfer-to-gotos. Might as well make sure we haven't broken 
+		// anything, and undo it if we have.
+		if (!g_XformBlackList.Has(mba->entry_ea, XF_SINGLE_GOTOS))
+		{
+			iChanged = RemoveSingleGotos(mba, &m_Journal);
+			if (!CommitOrRollback(mba, m_Journal, m_Mode == GOV_FULL, XF_SINGLE_GOTOS))
+				iChanged = 0;
+		}
+		m_nGotosRemoved += iChanged;
+
+#if UNFLATTENVERBOSE
+		debugmsg("\tRemoved %d vacuous GOTOs\n", iChanged);
+#endif
+
+#if UNFLATTENDEBUG
+		qsnprintf(buf, sizeof(buf), "c:\\temp\\dumpAfter-%s-%a.txt", matStr, mba->entry_ea);
+		DumpMBAToFile(mba, buf);
+#endif
+
+#if UNFLATTENVERBOSE
+		mba->print(vd);
+#endif
+
+		m_bActive = true;
+		m_nRounds = 0;
+		m_nsSpent = 0;
+		m_nInsnsSpent = 0;
+		gs->Charge(GOV_UNFLATTEN, get_nsec_stamp() - nsStart, 0);
+	}
+	else if (!m_bActive || mba->maturity < MMAT_LOCOPT)
+		return 0;
+
+	// Past the last level at which we retry, we're done with this function
+	else if (mba->maturity > UNFLATTEN_LAST_MATURITY)
+	{
+		m_bActive = false;
+		Compact();
+		m_nBytesUsed = BytesUsed();
+		return 0;
+	}
+
+	while (true)
+	{
+		uint64 nsStart = get_nsec_stamp();
+		int nInsns = CountInsns(mba);
+
+		int nRecovered, nUnresolved;
+		iChanged += RunRound(mba, nRecovered, nUnresolved);
+
+		uint64 nsRound = get_nsec_stamp() - nsStart;
+		++m_nRounds;
+		m_nsSpent += nsRound;
+		m_nInsnsSpent += nInsns;
+		gs->Charge(GOV_UNFLATTEN, nsRound, nInsns);
+		m_nEdgesRecovered += nRecovered;
+#if UNFLATTENVERBOSE
+		debugmsg("[I] Round %d at %s recovered %d edges, %d predecessors unresolved (%.3fms, %d instructions so far)\n", m_nRounds, matStr, nRecovered, nUnresolved, m_nsSpent / 1e6, (int)m_nInsnsSpent);
+#endif
+
+		// Nothing left to resolve: we're done for good.
+		if (nUnresolved == 0)
+		{
+			m_bActive = false;
+			break;
+		}
+
+		// Out of budget, or the governor told us to cut back: leave the rest
+		// flattened.
+		if (OverBudget() || gs->Mode(GOV_UNFLATTEN) != GOV_FULL)
+		{
+#if UNFLATTENVERBOSE
+			debugmsg("[I] Out of budget after %d rounds; %d predecessors left unresolved\n", m_nRounds, nUnresolved);
+#endif
+			m_bActive = false;
+			break;
+		}
+
+		// No progress at this maturity level. Hex-Rays may yet propagate the
+		// missing constants at a later one, so try again then.
+		if (nRecovered == 0)
+			break;
+
+		// Otherwise, we've changed the graph, which can open up new 
+		// opportunities for local optimization, which in turn can make more
+		// predecessors resolvable. Go again.
+#if IDA_SDK_VERSION == 710
+		mba->make_chains_dirty();
+#elif IDA_SDK_VERSION >= 720
+		mba->mark_chains_dirty();
+#endif
+		uint64 nsOptimize = get_nsec_stamp();
+		{
+			PhaseTimer timer(PH_OPTIMIZE_LOCAL);
+			mba->optimize_local(0);
+		}
+		gs->Charge(GOV_UNFLATTEN, get_nsec_stamp() - nsOptimize, 0);
+	}
+
+#if DEAD_STORE_ELIM
+	// Unflattening leaves lots of writes to the state variables behind, along
+	// with whatever junk was computed to feed them. Get rid of everything 
+	// that's no longer read, so the later maturities don't have to.
+	if (iChanged != 0 && !g_XformBlackList.Has(mba->entry_ea, XF_DEAD_STORES))
+	{
+		DeadStoreStats dss;
+		int nRemoved = EliminateDeadStores(mba, &dss, &m_Journal);
+		if (CommitOrRollback(mba, m_Journal, m_Mode == GOV_FULL, XF_DEAD_STORES))
+			iChanged += nRemoved;
+		gs->Charge(GOV_UNFLATTEN, dss.nsElapsed, 0);
+#if UNFLATTENVERBOSE
+		debugmsg("[I] Removed %d dead stores to %d variables (%d escaped) in %.3fms\n", dss.nRemoved, dss.nVars, dss.nEscaped, dss.nsElapsed / 1e6);
+#endif
+	}
+#endif
+
+	// There's no need to hang onto the analysis state if there won't be any
+	// more rounds
+	if (!m_bActive)
+		Compact();
+	m_nBytesUsed = BytesUsed();
 
 	return iChanged;
 }
+
+size_t UnflattenContext::BytesUsed()
+{
+	return sizeof(*this) + cfi.m_Arena.m_nReserved + m_DirtyBlocks.capacity() / 8 + m_DefCache.BytesUsed() + m_StateVars.BytesUsed() + m_Journal.BytesUsed() + (m_Record != NULL ? m_Record->BytesUsed() : 0);
+}
+
+UnflattenContext *CFUnflattener::GetContext(mbl_array_t *mba)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	auto it = m_Contexts.find(mba);
+	if (it != m_Contexts.end())
+	{
+		it->second->m_nLastUsed = ++m_nTicks;
+		return it->second;
+	}
+
+	// We weren't told about this graph being created, e.g. because the plugin
+	// was loaded in the middle of a decompilation. Start tracking it now.
+	UnflattenContext *ctx = NewContext(mba);
+	m_Contexts[mba] = ctx;
+	return ctx;
+}
+
+// Make room for a new context by throwing away the least recently used ones,
+// which belong to decompilations that failed before we could destroy their
+// contexts. One that's in progress is used all the time.
+UnflattenContext *CFUnflattener::NewContext(mbl_array_t *mba)
+{
+	while (m_Contexts.size() >= SESSION_MAX_DECOMPILATIONS)
+	{
+		auto oldest = m_Contexts.begin();
+		for (auto it = m_Contexts.begin(); it != m_Contexts.end(); ++it)
+			if (it->second->m_nLastUsed < oldest->second->m_nLastUsed)
+				oldest = it;
+		delete oldest->second;
+		m_Contexts.erase(oldest);
+	}
+	UnflattenContext *ctx = new UnflattenContext(mba);
+	ctx->m_nLastUsed = ++m_nTicks;
+	return ctx;
+}
+
+// Start afresh for a newly-generated graph. If one with the same address 
+// was still being tracked (because its decompilation failed before we could
+// destroy its context), throw that one away.
+void CFUnflattener::CreateContext(mbl_array_t *mba)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	auto it = m_Contexts.find(mba);
+	if (it != m_Contexts.end())
+	{
+		delete it->second;
+		m_Contexts.erase(it);
+	}
+	UnflattenContext *ctx = NewContext(mba);
+	m_Contexts[mba] = ctx;
+}
+
+void CFUnflattener::DestroyContext(mbl_array_t *mba)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	auto it = m_Contexts.find(mba);
+	if (it == m_Contexts.end())
+		return;
+	delete it->second;
+	m_Contexts.erase(it);
+}
+
+void CFUnflattener::Clear()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	for (auto &kv : m_Contexts)
+		delete kv.second;
+	m_Contexts.clear();
+}
+
+// The contexts' own figures are as of the end of their last call to Run
+size_t CFUnflattener::BytesUsed(int &nContexts)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	nContexts = m_Contexts.size();
+	size_t nBytes = NodeBytes<std::pair<mbl_array_t *, UnflattenContext *> >(m_Contexts.size());
+	for (auto &kv : m_Contexts)
+		nBytes += kv.second->m_nBytesUsed;
+	return nBytes;
+}
+
+int idaapi CFUnflattener::func(mblock_t *blk)
+{
+	return GetContext(blk->mba)->Run(blk);
+}
+
+// Hex-Rays tells us when microcode has been generated, which is before any of
+// the block optimizers are called on it, and when the ctree has been 
+// finalized, after which the microcode won't be optimized anymore.
+ssize_t idaapi CFUnflattener::HexRaysCallback(void *ud, hexrays_event_t event, va_list va)
+{
+	CFUnflattener *cfu = (CFUnflattener *)ud;
+	switch (event)
+	{
+		case hxe_microcode:
+		{
+			mbl_array_t *mba = va_arg(va, mbl_array_t *);
+			cfu->CreateContext(mba);
+			break;
+		}
+		case hxe_maturity:
+		{
+			cfunc_t *cfunc = va_arg(va, cfunc_t *);
+			ctree_maturity_t new_maturity = (ctree_maturity_t)va_arg(va, int);
+			if (new_maturity == CMAT_FINAL)
+			{
+				cfu->DestroyContext(cfunc->mba);
+				PhaseTimer::Flush();
+			}
+			break;
+		}
+	}
+	return 0;
+}
@@ -1,27 +1,183 @@
 #pragma once
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <hexrays.hpp>
+#include "HexRaysUtil.hpp"
 #include "CFFlattenInfo.hpp"
 #include "DefUtil.hpp"
+#include "TargetUtil.hpp"
+#include "StateVarSolver.hpp"
+#include "Governor.hpp"
+#include "EditJournal.hpp"
+#include "PlanCache.hpp"
 
-struct CFUnflattener : public optblock_t
+// What to do with one predecessor of the dispatcher. Working this out only
+// reads the mba; applying it is a separate step, so that it can be recorded
+// in the plan cache first.
+struct PredPlan
 {
+	enum { PLAN_NONE, PLAN_GOTO, PLAN_TWOWAY };
+	int iKind;
+
+	// PLAN_GOTO: the block that the predecessor should branch to directly
+	int iDestNo;
+
+	// PLAN_TWOWAY: the fall-through predecessor of the predecessor, and the 
+	// new targets of both
+	int iNonJcc;
+	int iGotoTarget;
+	int iJccTarget;
+
+	// PLAN_TWOWAY: how the two paths through the predecessor get separate 
+	// destinations (see ChooseTwoWayStrategy). The variable that was copied 
+	// into the state variable tells them apart; it holds pathKey on the way
+	// to iGotoTarget. The first iPathErasures erasures are the predecessor's
+	// own, and the rest are along the two paths. nShared is the number of 
+	// instructions that copying the predecessor would duplicate.
+	enum { TWOWAY_RETARGET, TWOWAY_COPY, TWOWAY_BRANCH };
+	int iTwoWay;
+	mop_t *opPath;
+	uint64 pathKey;
+	size_t iPathErasures;
+	int nShared;
+
+	// The chain of assignments to erase if the plan is applied
+	MovChain erasures;
+
+	PredPlan() { Clear(); }
+	void Clear()
+	{
+		iKind = PLAN_NONE;
+		iDestNo = iNonJcc = iGotoTarget = iJccTarget = -1;
+		iTwoWay = TWOWAY_COPY;
+		opPath = NULL;
+		pathKey = 0;
+		iPathErasures = 0;
+		nShared = 0;
+		erasures.clear();
+	}
+};
+
+// Everything the unflattener keeps track of while one function is being 
+// decompiled. Each mbl_array_t gets its own, so that several decompilations
+// can be in progress at once without stepping on each other.
+struct UnflattenContext
+{
+	mbl_array_t *m_Mba;
+
+	// The last maturity level we were called at, so that we only do the work
+	// once per level, and statistics
+	mba_maturity_t m_LastMaturity;
+	int m_nGotosRemoved;
+	int m_nInsnsNotCopied;
+
+	// Whether there are still dispatcher predecessors worth retrying at later
+	// maturity levels, and how much of the budget has been spent on them
+	bool m_bActive;
+	int m_nRounds;
+	int m_nEdgesRecovered;
+	uint64 m_nsSpent;
+	uint64 m_nInsnsSpent;
+
+	// How much effort the cost governor lets us spend right now
+	GovernorMode m_Mode;
+
+	// The changes made by the transformation in progress, in case they have
+	// to be undone
+	EditJournal m_Journal;
+
+	// The rounds that an earlier decompilation of the same microcode did, 
+	// and how many of them have been replayed. The rounds done by this one
+	// are recorded in m_Record, for the next; m_RecRound is the one being
+	// worked out right now, or NULL if it can't be recorded.
+	PlanCache::Entry m_Replay;
+	size_t m_iReplay;
+	std::shared_ptr<CachedFunction> m_Record;
+	CachedRound *m_RecRound;
+	bool m_bRecordDirty;
+
+	// When the context was last used, and roughly how much memory it held
+	// at the time
+	uint64 m_nLastUsed;
+	std::atomic<size_t> m_nBytesUsed;
+
 	CFFlattenInfo cfi;
-	MovChain m_DeferredErasuresLocal;
-	MovChain m_PerformedErasuresGlobal;
+	std::vector<bool> m_DirtyBlocks;
+	DefChainCache m_DefCache;
+	StateVarSolution m_StateVars;
 
 	void Clear(bool bFree)
 	{
+		m_DirtyBlocks.clear();
+		m_DefCache.Clear();
+		m_StateVars.Clear();
 		cfi.Clear(bFree);
-		m_DeferredErasuresLocal.clear();
-		m_PerformedErasuresGlobal.clear();
 	}
 
-	CFUnflattener() { Clear(false); };
-	~CFUnflattener() { Clear(true); }
-	int idaapi func(mblock_t *blk);
+	// Once there won't be any more rounds, give back all of the memory that
+	// was held onto for them
+	void Compact()
+	{
+		StorePlans();
+		Clear(true);
+		cfi.m_Arena.Release();
+		std::vector<bool>().swap(m_DirtyBlocks);
+		m_DefCache.Release();
+		m_StateVars.Release();
+		m_Journal.Release();
+	}
+	size_t BytesUsed();
+
+	// Note that a block's instructions were modified
+	void MarkDirty(int iBlock)
+	{
+		if (iBlock < m_DirtyBlocks.size())
+			m_DirtyBlocks[iBlock] = true;
+		m_DefCache.Invalidate(iBlock);
+	}
+
+	UnflattenContext(mbl_array_t *mba) : m_Mba(mba), m_LastMaturity(MMAT_ZERO), m_nGotosRemoved(0), m_nInsnsNotCopied(0), m_bActive(false), m_nRounds(0), m_nEdgesRecovered(0), m_nsSpent(0), m_nInsnsSpent(0), m_Mode(GOV_FULL), m_iReplay(0), m_RecRound(NULL), m_bRecordDirty(false), m_nLastUsed(0), m_nBytesUsed(0) { Clear(false); };
+	~UnflattenContext() { Clear(true); }
+	int Run(mblock_t *blk);
+	int RunRound(mbl_array_t *mba, int &nRecovered, int &nUnresolved);
+	int UnflattenRound(mbl_array_t *mba, int &nRecovered, int &nUnresolved);
+	int ReplayRound(mbl_array_t *mba, const CachedRound &round, int &nRecovered, int &nUnresolved);
+	int FinishRound(mbl_array_t *mba, int iChanged, int nDispatchers, bool bDirtyChains);
+	void StorePlans();
+	bool OverBudget() const;
+	int UnflattenDispatcher(mbl_array_t *mba, bool &bDirtyChains, int &nRecovered, int &nUnresolved);
 	mblock_t *GetDominatedClusterHead(mbl_array_t *mba, int iDispPred, int &iClusterHead);
-	int FindBlockTargetOrLastCopy(mblock_t *mb, mblock_t *mbClusterHead, mop_t *what, bool bAllowMultiSuccs);
-	bool HandleTwoPreds(mblock_t *mb, mblock_t *mbClusterHead, mop_t *opCopy, mblock_t *&endsWithJcc, int &actualGotoTarget, int &actualJccTarget);
-	void ProcessErasures(mbl_array_t *mba);
-};
\ No newline at end of file
+	int FindBlockTargetOrLastCopy(mblock_t *mb, mblock_t *mbClusterHead, mop_t *what, bool bAllowMultiSuccs, MovChain &erasures, uint64 *pKey = NULL);
+	bool HandleTwoPreds(mblock_t *mb, mblock_t *mbClusterHead, mop_t *opCopy, mblock_t *&endsWithJcc, int &actualGotoTarget, int &actualJccTarget, uint64 &gotoKey, MovChain &erasures);
+	void ChooseTwoWayStrategy(mblock_t *mb, PredPlan &plan);
+	void ResolvePredecessor(mbl_array_t *mba, int iDispPred, PredPlan &plan);
+	int ApplyPlan(mbl_array_t *mba, int iDispPred, const PredPlan &plan, DeferredGraphModifier &dgm, bool &bDirtyChains);
+	void ProcessErasures(mbl_array_t *mba, const MovChain &erasures);
+};
+
+// The block optimizer that Hex-Rays calls. It hands each call off to the
+// context for the mbl_array_t being optimized. Contexts are created when 
+// microcode is generated, and destroyed once the decompilation is finished
+// with the microcode; HexRaysCallback must be installed for that to happen.
+// Decompilations that fail leave their contexts behind, so only the 
+// SESSION_MAX_DECOMPILATIONS most recently used contexts are kept.
+struct CFUnflattener : public optblock_t
+{
+	std::map<mbl_array_t *, UnflattenContext *> m_Contexts;
+	uint64 m_nTicks;
+	std::mutex m_Mutex;
+
+	CFUnflattener() : m_nTicks(0) {};
+	~CFUnflattener() { Clear(); }
+	int idaapi func(mblock_t *blk);
+	UnflattenContext *GetContext(mbl_array_t *mba);
+	void CreateContext(mbl_array_t *mba);
+	void DestroyContext(mbl_array_t *mba);
+	void Clear();
+	size_t BytesUsed(int &nContexts);
+	static ssize_t idaapi HexRaysCallback(void *ud, hexrays_event_t event, va_list va);
+
+private:
+	UnflattenContext *NewContext(mbl_array_t *mba);
+};
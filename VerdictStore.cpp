@@ -0,0 +1,336 @@
+#include <hexrays.hpp>
+#include "HexRaysUtil.hpp"
+#include "VerdictStore.hpp"
+#include "FlattenClassifier.hpp"
+#include "Config.hpp"
+
+VerdictStore g_Verdicts;
+
+// Where the verdicts live in the IDB, and what they look like there
+#define VERDICT_NETNODE "$ HexRaysDeob verdicts"
+#define VERDICT_TAG 'V'
+#define VERDICT_MAGIC 0x56445248
+#define VERDICT_VERSION 2
+
+// The version is that of the format; classifier is the version of the rules
+// that the verdicts were reached by (FLATTEN_CLASSIFIER_VERSION)
+#pragma pack(push, 1)
+struct VerdictHeader
+{
+	uint32 magic;
+	uint32 version;
+	uint32 classifier;
+	uint32 count;
+};
+struct VerdictRecord
+{
+	uint64 ea;
+	uint64 end;
+	float score;
+	uint8 verdict;
+};
+#pragma pack(pop)
+
+static int debugmsg(const char *fmt, ...)
+{
+#if UNFLATTENVERBOSE
+	va_list va;
+	va_start(va, fmt);
+	return vmsg(fmt, va);
+#endif
+	return 0;
+}
+
+static size_t HashEa(ea_t ea)
+{
+	uint64 h = (uint64)ea * 0x9E3779B97F4A7C15ULL;
+	return (size_t)(h ^ (h >> 32));
+}
+
+// The end of the function that starts at ea, which has to match what it was
+// when the verdict was made
+static ea_t FuncEnd(ea_t ea)
+{
+	func_t *pfn = get_func(ea);
+	return pfn != NULL ? pfn->end_ea : BADADDR;
+}
+
+// Look up the entry for ea, if there is one. The caller holds the lock.
+VerdictStore::Entry *VerdictStore::Find(ea_t ea) const
+{
+	if (m_Table.empty())
+		return NULL;
+	size_t mask = m_Table.size() - 1;
+	for (size_t i = HashEa(ea) & mask; ; i = (i + 1) & mask)
+	{
+		const Entry &e = m_Table[i];
+		if (e.ea == ea)
+			return const_cast<Entry *>(&e);
+		if (e.ea == BADADDR)
+			return NULL;
+	}
+}
+
+// Look up the entry for ea, making one if there isn't one, with
+// VERDICT_NONE. The caller holds the lock exclusively.
+VerdictStore::Entry *VerdictStore::FindSlot(ea_t ea)
+{
+	if ((m_nUsed + 1) * 4 > m_Table.size() * 3)
+		Rehash(m_nLive + 1);
+
+	size_t mask = m_Table.size() - 1;
+	for (size_t i = HashEa(ea) & mask; ; i = (i + 1) & mask)
+	{
+		Entry &e = m_Table[i];
+		if (e.ea == ea)
+			return &e;
+		if (e.ea == BADADDR)
+		{
+			e.ea = ea;
+			e.end = BADADDR;
+			e.score = -1.0f;
+			e.verdict = VERDICT_NONE;
+			++m_nUsed;
+			return &e;
+		}
+	}
+}
+
+// Make room for at least nLive verdicts, keeping the table under 3/8 full,
+// and get rid of the slots of forgotten ones along the way
+void VerdictStore::Rehash(size_t nLive)
+{
+	size_t nCapacity = 64;
+	while (nCapacity * 3 < nLive * 8)
+		nCapacity *= 2;
+
+	std::vector<Entry> old;
+	old.swap(m_Table);
+	Entry empty;
+	empty.ea = BADADDR;
+	empty.end = BADADDR;
+	empty.score = -1.0f;
+	empty.verdict = VERDICT_NONE;
+	m_Table.assign(nCapacity, empty);
+	m_nUsed = 0;
+
+	size_t mask = nCapacity - 1;
+	for (auto &e : old)
+	{
+		if (e.ea == BADADDR || e.verdict == VERDICT_NONE)
+			continue;
+		size_t i = HashEa(e.ea) & mask;
+		while (m_Table[i].ea != BADADDR)
+			i = (i + 1) & mask;
+		m_Table[i] = e;
+		++m_nUsed;
+	}
+}
+
+// Read the verdicts in from the IDB the first time they're needed
+void VerdictStore::EnsureLoaded()
+{
+	if (m_bLoaded)
+		return;
+	std::unique_lock<std::shared_timed_mutex> lock(m_Mutex);
+	if (m_bLoaded)
+		return;
+	Load();
+	m_bLoaded = true;
+}
+
+void VerdictStore::Load()
+{
+	netnode n(VERDICT_NETNODE);
+	if (n == BADNODE)
+		return;
+	bytevec_t buf;
+	if (n.getblob(&buf, 0, VERDICT_TAG) <= 0)
+		return;
+
+	// Throw away anything we don't recognize, and verdicts that the current
+	// rules might not agree with; they're removed from the database when
+	// it's next saved.
+	VerdictHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(&hdr, buf.begin(), qmin(buf.size(), sizeof(hdr)));
+	if (hdr.magic == VERDICT_MAGIC && hdr.version < VERDICT_VERSION)
+	{
+		msg("[I] Discarding the stored obfuscation verdicts, which were made by an older version of the plugin\n");
+		m_bDirty = true;
+		return;
+	}
+	if (hdr.magic != VERDICT_MAGIC || hdr.version != VERDICT_VERSION || buf.size() != sizeof(hdr) + (size_t)hdr.count * sizeof(VerdictRecord))
+	{
+		msg("[E] Ignoring the stored obfuscation verdicts, which are in an unknown format\n");
+		m_bDirty = true;
+		return;
+	}
+	if (hdr.classifier != FLATTEN_CLASSIFIER_VERSION)
+	{
+		msg("[I] Discarding %d stored obfuscation verdicts, which were made by different rules (version %d, now %d)\n", hdr.count, hdr.classifier, FLATTEN_CLASSIFIER_VERSION);
+		m_bDirty = true;
+		return;
+	}
+
+	Rehash(hdr.count);
+	const uchar *p = buf.begin() + sizeof(hdr);
+	for (uint32 i = 0; i < hdr.count; ++i, p += sizeof(VerdictRecord))
+	{
+		VerdictRecord r;
+		memcpy(&r, p, sizeof(r));
+		if (r.verdict != VERDICT_NOT_FLATTENED && r.verdict != VERDICT_FLATTENED)
+			continue;
+		Entry *e = FindSlot((ea_t)r.ea);
+		if (e->verdict == VERDICT_NONE)
+			++m_nLive;
+		e->end = (ea_t)r.end;
+		e->score = r.score;
+		e->verdict = r.verdict;
+	}
+	m_bDirty = false;
+	debugmsg("[I] Loaded %d obfuscation verdicts from the database\n", (int)m_nLive);
+}
+
+Verdict VerdictStore::Get(ea_t ea, float *pScore)
+{
+	EnsureLoaded();
+	ea_t end = FuncEnd(ea);
+	std::shared_lock<std::shared_timed_mutex> lock(m_Mutex);
+	Entry *e = Find(ea);
+
+	// A verdict on a function that has since changed shape is worthless
+	if (e == NULL || e->verdict == VERDICT_NONE || e->end != end)
+		return VERDICT_NONE;
+	if (pScore != NULL)
+		*pScore = e->score;
+	return (Verdict)e->verdict;
+}
+
+// If score is negative, the verdict wasn't based on one, so any score that
+// was recorded before is kept.
+void VerdictStore::Set(ea_t ea, Verdict v, float score)
+{
+	EnsureLoaded();
+	ea_t end = FuncEnd(ea);
+	std::unique_lock<std::shared_timed_mutex> lock(m_Mutex);
+	Entry *e = FindSlot(ea);
+	if (e->verdict == VERDICT_NONE)
+		++m_nLive;
+	if (score >= 0.0f || e->verdict == VERDICT_NONE)
+		e->score = score;
+	e->verdict = v;
+	e->end = end;
+	m_bDirty = true;
+}
+
+// Returns whether there was a verdict to forget
+bool VerdictStore::Forget(ea_t ea)
+{
+	EnsureLoaded();
+	std::unique_lock<std::shared_timed_mutex> lock(m_Mutex);
+	Entry *e = Find(ea);
+	if (e == NULL || e->verdict == VERDICT_NONE)
+		return false;
+	e->verdict = VERDICT_NONE;
+	--m_nLive;
+	m_bDirty = true;
+	return true;
+}
+
+// Forget every verdict, in memory and, once the database is saved, in the 
+// IDB too. Returns how many there were.
+size_t VerdictStore::ForgetAll()
+{
+	EnsureLoaded();
+	std::unique_lock<std::shared_timed_mutex> lock(m_Mutex);
+	size_t nForgotten = m_nLive;
+	std::vector<Entry>().swap(m_Table);
+	m_nUsed = 0;
+	m_nLive = 0;
+	m_bDirty = true;
+	return nForgotten;
+}
+
+// Write the verdicts out to the IDB, if anything has changed
+void VerdictStore::Save()
+{
+	std::unique_lock<std::shared_timed_mutex> lock(m_Mutex);
+	if (!m_bLoaded || !m_bDirty)
+		return;
+
+	bytevec_t buf;
+	buf.resize(sizeof(VerdictHeader) + m_nLive * sizeof(VerdictRecord));
+	VerdictHeader hdr;
+	hdr.magic = VERDICT_MAGIC;
+	hdr.version = VERDICT_VERSION;
+	hdr.classifier = FLATTEN_CLASSIFIER_VERSION;
+	hdr.count = (uint32)m_nLive;
+	memcpy(buf.begin(), &hdr, sizeof(hdr));
+	uchar *p = buf.begin() + sizeof(hdr);
+	for (auto &e : m_Table)
+	{
+		if (e.ea == BADADDR || e.verdict == VERDICT_NONE)
+			continue;
+		VerdictRecord r;
+		r.ea = e.ea;
+		r.end = e.end;
+		r.score = e.score;
+		r.verdict = e.verdict;
+		memcpy(p, &r, sizeof(r));
+		p += sizeof(r);
+	}
+
+	netnode n(VERDICT_NETNODE, 0, true);
+	if (m_nLive == 0)
+		n.delblob(0, VERDICT_TAG);
+	else
+		n.setblob(buf.begin(), buf.size(), 0, VERDICT_TAG);
+	m_bDirty = false;
+	debugmsg("[I] Saved %d obfuscation verdicts to the database\n", (int)m_nLive);
+}
+
+// Forget everything in memory, but not in the IDB. The next lookup reads the
+// verdicts in again.
+void VerdictStore::Clear()
+{
+	std::unique_lock<std::shared_timed_mutex> lock(m_Mutex);
+	std::vector<Entry>().swap(m_Table);
+	m_nUsed = 0;
+	m_nLive = 0;
+	m_bDirty = false;
+	m_bLoaded = false;
+}
+
+size_t VerdictStore::Size() const
+{
+	std::shared_lock<std::shared_timed_mutex> lock(m_Mutex);
+	return m_nLive;
+}
+
+size_t VerdictStore::BytesUsed() const
+{
+	std::shared_lock<std::shared_timed_mutex> lock(m_Mutex);
+	return m_Table.capacity() * sizeof(Entry);
+}
+
+ssize_t idaapi VerdictStore::IdbCallback(void *ud, int code, va_list va)
+{
+	VerdictStore *vs = (VerdictStore *)ud;
+	switch (code)
+	{
+		// The function's code has changed, so it has to be looked at again
+		case idb_event::byte_patched:
+		{
+			ea_t ea = va_arg(va, ea_t);
+			func_t *pfn = get_func(ea);
+			if (pfn != NULL)
+				vs->Forget(pfn->start_ea);
+			break;
+		}
+		case idb_event::savebase:
+			vs->Save();
+			break;
+	}
+	return 0;
+}
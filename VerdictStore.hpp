@@ -0,0 +1,69 @@
+#pragma once
+#include <atomic>
+#include <shared_mutex>
+#include <vector>
+#include <hexrays.hpp>
+
+// What was decided about whether a function is flattened, either by the
+// quick classifier or by the full analysis
+enum Verdict
+{
+	VERDICT_NONE,
+	VERDICT_NOT_FLATTENED,
+	VERDICT_FLATTENED,
+};
+
+// The verdicts on every function seen so far in this database, along with the
+// entropy score that each was based upon (negative if there wasn't one).
+// They're stored in the IDB, so that functions classified in an earlier
+// session don't have to be classified again: they're read in the first time
+// one is needed, and written out whenever the database is saved, and when the
+// plugin is unloaded. A verdict is forgotten if any of the function's bytes
+// are patched, or if the function's bounds have changed since; all of them
+// are forgotten if the rules that reached them have changed since (see 
+// FLATTEN_CLASSIFIER_VERSION). The user can also forget them from the plugin.
+//
+// Lookups happen on every call to the unflattener, so the verdicts are kept
+// in an open-addressing hash table, which any number of threads can read at
+// once. It holds at most one entry per function in the database.
+// IdbCallback must be installed for HT_IDB events to catch the patches and
+// saves.
+struct VerdictStore
+{
+	VerdictStore() : m_nUsed(0), m_nLive(0), m_bDirty(false), m_bLoaded(false) {};
+	Verdict Get(ea_t ea, float *pScore = NULL);
+	void Set(ea_t ea, Verdict v, float score = -1.0f);
+	bool Forget(ea_t ea);
+	size_t ForgetAll();
+	void Save();
+	void Clear();
+	size_t Size() const;
+	size_t BytesUsed() const;
+	static ssize_t idaapi IdbCallback(void *ud, int code, va_list va);
+
+private:
+	// ea is BADADDR for a slot that has never been used. Forgotten verdicts
+	// keep their slots, with VERDICT_NONE, so that probing goes past them.
+	struct Entry
+	{
+		ea_t ea;
+		ea_t end;
+		float score;
+		uint8 verdict;
+	};
+
+	std::vector<Entry> m_Table;
+	size_t m_nUsed;
+	size_t m_nLive;
+	bool m_bDirty;
+	std::atomic<bool> m_bLoaded;
+	mutable std::shared_timed_mutex m_Mutex;
+
+	void EnsureLoaded();
+	void Load();
+	Entry *Find(ea_t ea) const;
+	Entry *FindSlot(ea_t ea);
+	void Rehash(size_t nLive);
+};
+
+extern VerdictStore g_Verdicts;
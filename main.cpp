@@ -15,6 +15,11 @@
 #include "PatternDeobfuscate.hpp"
 #include "AllocaFixer.hpp"
 #include "Unflattener.hpp"
+#include "Governor.hpp"
+#include "EditJournal.hpp"
+#include "VerdictStore.hpp"
+#include "PlanCache.hpp"
+#include "PhaseTimer.hpp"
 #include "Config.hpp"
 
 extern plugin_t PLUGIN;
@@ -33,9 +38,15 @@ int idaapi init(void)
 	const char *hxver = get_hexrays_version();
 	msg("Hex-rays version %s has been detected, %s ready to use\n", hxver, PLUGIN.wanted_name);
 
-	// Install our block and instruction optimization classes.
+	// Install our block and instruction optimization classes. The callbacks
+	// let the unflattener keep separate state for each function being
+	// decompiled, and the governor keep track of what each one costs. The
+	// IDB hook keeps the stored verdicts in sync with the database.
 #if DO_OPTIMIZATION
+	hook_to_notification_point(HT_IDB, VerdictStore::IdbCallback, &g_Verdicts);
 	install_optinsn_handler(&hook);
+	install_hexrays_callback(CostGovernor::HexRaysCallback, &g_Governor);
+	install_hexrays_callback(CFUnflattener::HexRaysCallback, &cfu);
 	install_optblock_handler(&cfu);
 #endif
 	return PLUGIN_KEEP;
@@ -51,17 +62,93 @@ void idaapi term(void)
 #if DO_OPTIMIZATION
 		remove_optinsn_handler(&hook);
 		remove_optblock_handler(&cfu);
+		remove_hexrays_callback(CFUnflattener::HexRaysCallback, &cfu);
+		remove_hexrays_callback(CostGovernor::HexRaysCallback, &g_Governor);
+
+		// Hang onto any verdicts that were reached since the last save
+		g_Verdicts.Save();
+		unhook_from_notification_point(HT_IDB, VerdictStore::IdbCallback, &g_Verdicts);
 		
 		// I couldn't figure out why, but my plugin would segfault if it tried
 		// to free mop_t pointers that it had allocated. Maybe hexdsp had been
 		// set to NULL at that point, so the calls to delete crashed? Anyway,
 		// cleaning up before we unload solved the issues.
-		cfu.Clear(true);
+		cfu.Clear();
+		g_Governor.Clear();
+		g_Verdicts.Clear();
+		g_PlanCache.Clear();
+		g_PhaseTimes.Clear();
 #endif
 		term_hexrays_plugin();
 	}
 }
 
+//--------------------------------------------------------------------------
+// Print how much memory each part of the plugin is holding onto. Everything
+// that outlives a single decompilation is bounded by the SESSION_MAX_* 
+// settings in Config.hpp; this shows how close to those bounds it is.
+static void ReportMemoryUsage()
+{
+	int nContexts, nSessions, nFunctions, nListings;
+	PhaseTimer::Flush();
+	size_t nContextBytes = cfu.BytesUsed(nContexts);
+	size_t nGovernorBytes = g_Governor.BytesUsed(nSessions, nFunctions);
+	size_t nExplorerBytes = ExplorerBytesUsed(nListings);
+	size_t nVerdictBytes = g_Verdicts.BytesUsed(), nXformBytes = g_XformBlackList.BytesUsed(), nPlanBytes = g_PlanCache.BytesUsed(), nTimerBytes = g_PhaseTimes.BytesUsed();
+	size_t nTotal = nContextBytes + nGovernorBytes + nExplorerBytes + nVerdictBytes + nXformBytes + nPlanBytes + nTimerBytes;
+
+	msg("[I] Memory in use by %s:\n", PLUGIN.wanted_name);
+	msg("[I]   unflattener:           %9llu bytes, %d decompilations in progress\n", (uint64)nContextBytes, nContexts);
+	msg("[I]   governor:              %9llu bytes, %d sessions, %d functions in history\n", (uint64)nGovernorBytes, nSessions, nFunctions);
+	msg("[I]   verdicts:              %9llu bytes, %d functions\n", (uint64)nVerdictBytes, (int)g_Verdicts.Size());
+	msg("[I]   transform blacklist:   %9llu bytes, %d transformations\n", (uint64)nXformBytes, (int)g_XformBlackList.Size());
+	msg("[I]   plan cache:            %9llu bytes, %d functions (%d hits, %d misses)\n", (uint64)nPlanBytes, (int)g_PlanCache.Size(), g_PlanCache.m_nHits, g_PlanCache.m_nMisses);
+	msg("[I]   phase timers:          %9llu bytes, %d functions\n", (uint64)nTimerBytes, (int)g_PhaseTimes.Size());
+	msg("[I]   microcode explorer:    %9llu bytes, %d microcode listings\n", (uint64)nExplorerBytes, nListings);
+	msg("[I]   total:                 %9llu bytes\n", (uint64)nTotal);
+}
+
+//--------------------------------------------------------------------------
+// Write out the time spent in each phase of the deobfuscation passes, as 
+// JSON, CSV and folded stacks, to files named after the one the user picks
+static void ExportPhaseTimes()
+{
+	const char *path = ask_file(true, "*.json", "Save phase timings as");
+	if (path == NULL)
+		return;
+	PhaseTimer::Flush();
+	g_PhaseTimes.Export(path);
+}
+
+//--------------------------------------------------------------------------
+// Forget whether the function under the cursor is flattened, or whether any
+// function is, so that the next decompilation decides again. That's needed
+// when a verdict turns out to be wrong, since verdicts are kept in the IDB.
+static void ForgetVerdicts(bool bAll)
+{
+	if (bAll)
+	{
+		size_t nForgotten = g_Verdicts.ForgetAll();
+		clear_cached_cfuncs();
+		msg("[I] Forgot the obfuscation verdicts on %d functions\n", (int)nForgotten);
+		return;
+	}
+
+	func_t *pfn = get_func(get_screen_ea());
+	if (pfn == NULL)
+	{
+		msg("[E] The cursor isn't in a function\n");
+		return;
+	}
+	if (g_Verdicts.Forget(pfn->start_ea))
+	{
+		mark_cfunc_dirty(pfn->start_ea);
+		msg("[I] Forgot the obfuscation verdict on %a; it will be decided again when the function is next decompiled\n", pfn->start_ea);
+	}
+	else
+		msg("[I] There was no obfuscation verdict on %a\n", pfn->start_ea);
+}
+
 //--------------------------------------------------------------------------
 bool idaapi run(size_t arg)
 {
@@ -75,6 +162,28 @@ bool idaapi run(size_t arg)
 		FixCallsToAllocaProbe();
 		return true;
 	}
+	if (arg == 4)
+	{
+		ReportMemoryUsage();
+		return true;
+	}
+	if (arg == 5)
+	{
+		ExportPhaseTimes();
+		return true;
+	}
+	if (arg == 6)
+	{
+		PhaseTimer::Flush();
+		g_PhaseTimes.Clear();
+		msg("[I] Cleared the phase timings\n");
+		return true;
+	}
+	if (arg == 7 || arg == 8)
+	{
+		ForgetVerdicts(arg == 8);
+		return true;
+	}
 #if IDA_SDK_VERSION >= 730
 	if (arg == 0)
 #else